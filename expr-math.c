@@ -1,141 +1,544 @@
-
-#include "expr-math.h"
-#include <math.h>
-
-double
-quadratic(double a, double b, double c)
-{
-  double d = b * b - 4 * a * c;
-  return (a == 0)
-    ? ( (b == 0 && c == 0) ? NAN : -(c / b) )
-    : ( (d < 0) ? NAN : (-b + sqrt(d)) / (2 * a) );
-}
-
-double
-nquadratic(double a, double b, double c)
-{
-  double d = b * b - 4 * a * c;
-  return (a == 0)
-    ? ( (b == 0 && c == 0) ? NAN : -(c / b) )
-    : ( (d < 0) ? NAN : (-b - sqrt(d)) / (2 * a) );
-}
-
-double
-trianglewave(double x)
-{
-  double frac, tmp;
-  frac = modf(x, &tmp) * 2.0;
-  return frac <= 1.0 ? frac : 2.0 - frac;
-}
-
-int
-approx(double a, double b)
-{
-#define CUTOFF .9999999 /* 15-17 significant digits; stop halfway */
-  double da = fabs(a);
-  double db = fabs(b);
-  int samesigns = (da == a) == (db == b); /* both pos or neg */
-  if (da > db) { double tmp = da; da = db; db = tmp; }
-  return samesigns && da >= (db * CUTOFF);
-}
-
-#ifdef TEST
-#include <stdio.h>
-
-void
-test_approx(void)
-{
-  struct {
-    int rv;
-    double a;
-    double b;
-  } tests[] = {
-    { 0, 1, 1.1 },
-    { 1, 1, 1.00000005 },
-    { 0, -1, 1.00000005 },
-    { 0, 1, -1.00000005 },
-    { 1, -1, -1.00000005 },
-    { 0, .000000001, .000000005 },
-    { 0, -.000000001, .000000005 },
-    { 0, .000000001, -.000000005 },
-    { 0, -.000000001, -.000000005 },
-    { 0, 1, 2 },
-    { 0, 0.5, 0.6 },
-    { 0, 0.000005, 0.000006 },
-    { 0, 1e100, 2e100 },
-    { 1, .9999999999e0, 1e0 },
-    { 1, .9999999999e1, 1e1 },
-    { 1, .9999999999e10, 1e10 },
-    { 1, .9999999999e20, 1e20 },
-    { 1, .9999999999e30, 1e30 },
-    { 1, .9999999999e31, 1e31 },
-    { 1, .9999999999e32, 1e32 },
-    { 1, .9999999999e33, 1e33 },
-    { 1, .9999999999e50, 1e50 },
-    { 1, .9999999999e62, 1e62 },
-    { 1, .9999999999e63, 1e63 },
-    { 1, .9999999999e64, 1e64 },
-    { 1, .9999999999e65, 1e65 },
-    { 1, .9999999999e100, 1e100 },
-    { 1, .9999999999e200, 1e200 },
-    { 1, .9999999999e300, 1e300 },
-    { 1, .9999999999e-1, 1e-1 },
-    { 1, .9999999999e-2, 1e-2 },
-    { 1, .9999999999e-10, 1e-10 },
-    { 1, .9999999999e-20, 1e-20 },
-    { 1, .9999999999e-30, 1e-30 },
-    { 1, .9999999999e-40, 1e-40 },
-    { 1, .9999999999e-100, 1e-100 },
-    { 1, .9999999999e-200, 1e-200 },
-    { 1, .9999999999e-300, 1e-300 },
-    { 0, 2e0, 1e0 },
-    { 0, 2e1, 1e1 },
-    { 0, 2e10, 1e10 },
-    { 0, 2e20, 1e20 },
-    { 0, 2e30, 1e30 },
-    { 0, 2e31, 1e31 },
-    { 0, 2e32, 1e32 },
-    { 0, 2e33, 1e33 },
-    { 0, 2e50, 1e50 },
-    { 0, 2e62, 1e62 },
-    { 0, 2e63, 1e63 },
-    { 0, 2e64, 1e64 },
-    { 0, 2e65, 1e65 },
-    { 0, 2e100, 1e100 },
-    { 0, 2e200, 1e200 },
-    { 0, 2e300, 1e300 },
-    { 0, 2e-1, 1e-1 },
-    { 0, 2e-2, 1e-2 },
-    { 0, 2e-10, 1e-10 },
-    { 0, 2e-20, 1e-20 },
-    { 0, 2e-30, 1e-30 },
-    { 0, 2e-40, 1e-40 },
-    { 0, 2e-100, 1e-100 },
-    { 0, 2e-200, 1e-200 },
-    { 0, 2e-300, 1e-300 },
-    { -1, 0.0, 0.0 }
-  };
-  size_t i;
-  int rv;
-  for (i = 0; tests[i].rv >= 0; ++i) {
-    if (tests[i].a == tests[i].b)
-      printf("approx failed: malformed test %d: %15.15g == %15.15g\n",
-             (int)i, tests[i].a, tests[i].b);
-    rv = approx(tests[i].a, tests[i].b);
-    if (rv != tests[i].rv)
-      printf("approx failed: %15.15g %15.15g -> %d should be %d (test %d) # %15.15g %15.15g\n",
-             tests[i].a, tests[i].b, rv, tests[i].rv, (int)i,
-             tests[i].a * CUTOFF, tests[i].b * CUTOFF);
-  }
-}
-
-int
-main(void)
-{
-  test_approx();
-  printf("math done\n");
-  return 0;
-}
-
-
-#endif
+
+#include "expr-math.h"
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+double
+quadratic(double a, double b, double c)
+{
+  double d = b * b - 4 * a * c;
+  return (a == 0)
+    ? ( (b == 0 && c == 0) ? NAN : -(c / b) )
+    : ( (d < 0) ? NAN : (-b + sqrt(d)) / (2 * a) );
+}
+
+double
+nquadratic(double a, double b, double c)
+{
+  double d = b * b - 4 * a * c;
+  return (a == 0)
+    ? ( (b == 0 && c == 0) ? NAN : -(c / b) )
+    : ( (d < 0) ? NAN : (-b - sqrt(d)) / (2 * a) );
+}
+
+double
+trianglewave(double x)
+{
+  double frac, tmp;
+  frac = modf(x, &tmp) * 2.0;
+  return frac <= 1.0 ? frac : 2.0 - frac;
+}
+
+/* The sample at or before v, clamped, and how far v is past it.
+ */
+static size_t
+lut_find(const double * table, double v, double * frac)
+{
+  size_t n = (size_t)table[0];
+  double at;
+  *frac = 0.0;
+  if (n < 2 || !(v > 0.0)) return 0;
+  if (v >= 1.0) return n - 1;
+  at = v * (double)(n - 1);
+  *frac = at - floor(at);
+  return (size_t)at;
+}
+
+double
+lut_linear(const double * table, double v)
+{
+  const double * y = table + 1;
+  double t;
+  size_t i;
+  if (isnan(v)) return v;
+  i = lut_find(table, v, &t);
+  return t == 0.0 ? y[i] : y[i] + t * (y[i + 1] - y[i]);
+}
+
+double
+lut_cubic(const double * table, double v)
+{
+  const double * y = table + 1;
+  size_t n = (size_t)table[0], i;
+  double t, p0, p1, p2, p3;
+  if (isnan(v)) return v;
+  i = lut_find(table, v, &t);
+  if (t == 0.0) return y[i];
+  p0 = y[i ? i - 1 : 0];
+  p1 = y[i];
+  p2 = y[i + 1];
+  p3 = y[i + 2 < n ? i + 2 : n - 1];
+  return p1 + 0.5 * t * (p2 - p0 + t * (2.0 * p0 - 5.0 * p1 + 4.0 * p2 - p3 +
+                                        t * (3.0 * (p1 - p2) + p3 - p0)));
+}
+
+double
+poly_piecewise(const double * table, double v)
+{
+  double len = table[0], n = table[1], at, u, a, b;
+  const double * p;
+  long k;
+  /* each index is checked as a double first, the table may be damaged */
+  if (!(v >= 0.0 && v <= 1.0) || !(n >= 1.0 && n + 1.0 <= len)) return NAN;
+  k = (long)(v * n); /* truncation is floor here, and cheaper */
+  at = table[2 + (k < (long)n ? k : (long)n - 1)];
+  if (!(at >= n + 2.0 && at + 2.0 <= len)) return NAN;
+  p = table + (long)at;
+  if (!(p[1] >= 0.0 && at + 2.0 + p[1] <= len)) return NAN;
+  k = (long)p[1];
+  /* the odd and even halves in u*u, for two shorter chains than Horner */
+  u = v - p[0];
+  p += 2;
+  if (k & 1) a = p[k], b = p[k - 1], k -= 2;
+  else a = 0.0, b = p[k], k -= 1;
+  for (v = u * u; k > 0; k -= 2) a = a * v + p[k], b = b * v + p[k - 1];
+  return b + u * a;
+}
+
+int
+approx(double a, double b)
+{
+#define CUTOFF .9999999 /* 15-17 significant digits; stop halfway */
+  double da = fabs(a);
+  double db = fabs(b);
+  int samesigns = (da == a) == (db == b); /* both pos or neg */
+  if (da > db) { double tmp = da; da = db; db = tmp; }
+  return samesigns && da >= (db * CUTOFF);
+}
+
+/* ********************************************************************** */
+/* Batch kernels */
+/* ********************************************************************** */
+
+/* Each kernel runs a branch-free polynomial approximation over a chunk
+ * of the input, VW lanes at a time in GCC vector types, then patches
+ * any lanes outside the approximation's range with libm.
+ * Other compilers get plain libm loops.
+ */
+#define VCHUNK 64
+
+#if defined(__GNUC__) && !defined(EXPR_NO_VMATH)
+#define EXPR_VMATH 1
+
+#define VW 2 /* one SSE2 register; wider vectors change the ABI */
+typedef double vdouble __attribute__((vector_size(VW * sizeof(double))));
+typedef unsigned long long vbits __attribute__((vector_size(VW * sizeof(double))));
+
+#define TWO52    4503599627370496.0 /* 2**52; adding it rounds to an integer */
+#define SIGNBIT  0x8000000000000000ULL
+#define LN2_HI   6.93147180369123816490e-01
+#define LN2_LO   1.90821492927058770002e-10
+
+#define VB(A)          ((vbits)(A))
+#define VD(A)          ((vdouble)(A))
+#define VSEL(M,A,B)    VD((VB(A) & VB(M)) | (VB(B) & ~VB(M)))
+#define VABS(A)        VD(VB(A) & ~SIGNBIT)
+#define VSIGN(A)       (VB(A) & SIGNBIT)
+
+#define VLOOP(KERNEL, INRANGE, LIBM) do { \
+    double t_[VCHUNK]; \
+    size_t i_, j_, m_; \
+    for (i_ = 0; i_ < n; i_ += m_) { \
+      m_ = n - i_ < VCHUNK ? n - i_ : VCHUNK; \
+      memcpy(t_, x + i_, sizeof(double) * m_); \
+      for (j_ = m_; j_ % VW; j_++) t_[j_] = 1.0; \
+      for (j_ = 0; j_ < m_; j_ += VW) { \
+        vdouble v_; \
+        memcpy(&v_, t_ + j_, sizeof(v_)); \
+        v_ = KERNEL(v_); \
+        memcpy(t_ + j_, &v_, sizeof(v_)); \
+      } \
+      for (j_ = 0; j_ < m_; j_++) { \
+        double v_ = x[i_ + j_]; \
+        if (!(INRANGE)) t_[j_] = LIBM; \
+      } \
+      memcpy(y + i_, t_, sizeof(double) * m_); \
+    } \
+  } while (0)
+
+/* Nearest integer, for |v| < 2**51.
+ */
+static vdouble
+k_nearest(vdouble v)
+{
+  return (v + (TWO52 + TWO52 / 2)) - (TWO52 + TWO52 / 2);
+}
+
+/* 2**n for an integral n in [-1022, 1023].
+ */
+static vdouble
+k_pow2i(vdouble n)
+{
+  return VD(VB(n + (1023.0 + TWO52)) << 52);
+}
+
+/* Sine and cosine share the reduction of x into [-pi/4, pi/4]
+ * (Cody-Waite, pi/4 in three parts) and the Cephes polynomials.
+ * 'shift' is 0 for sine and 1 for cosine: cos(x) = sin(x + pi/2).
+ */
+static vdouble
+k_sincos(vdouble x, unsigned long long shift)
+{
+  const double DP1 = 7.85398125648498535156E-1;
+  const double DP2 = 3.77489470793079817668E-8;
+  const double DP3 = 2.69515142907905952645E-15;
+  vdouble ax = VABS(x);
+  vdouble h = k_nearest(ax * M_2_PI);   /* quadrant */
+  vdouble j = h * 2.0;                  /* even octant */
+  vdouble z = ((ax - j * DP1) - j * DP2) - j * DP3;
+  vdouble zz = z * z;
+  vdouble s = z + z * zz * ((((( 1.58962301576546568060E-10  * zz
+                               - 2.50507477628578072866E-8) * zz
+                               + 2.75573136213857245213E-6) * zz
+                               - 1.98412698295895385996E-4) * zz
+                               + 8.33333333332211858878E-3) * zz
+                               - 1.66666666666666307295E-1);
+  vdouble c = 1.0 - 0.5 * zz + zz * zz * (((((-1.13585365213876817300E-11 * zz
+                                            + 2.08757008419747316778E-9) * zz
+                                            - 2.75573141792967388112E-7) * zz
+                                            + 2.48015872888517045348E-5) * zz
+                                            - 1.38888888888730564116E-3) * zz
+                                            + 4.16666666666665929218E-2);
+  vbits q = (VB(h + TWO52) + shift) & 3;
+  vbits neg = (q & 2) << 62;
+  vdouble r = VSEL((q & 1) != 0, c, s);
+  if (!shift) neg ^= VSIGN(x);
+  return VD(VB(r) ^ neg);
+}
+
+static vdouble k_sin(vdouble x) { return k_sincos(x, 0); }
+static vdouble k_cos(vdouble x) { return k_sincos(x, 1); }
+
+/* e**r - 1 for |r| <= ln(2)/2, Taylor to the 13th power.
+ */
+static vdouble
+k_expm1r(vdouble r)
+{
+  return r * (1.0 + r * (1.0/2 + r * (1.0/6 + r * (1.0/24 + r * (1.0/120
+       + r * (1.0/720 + r * (1.0/5040 + r * (1.0/40320 + r * (1.0/362880
+       + r * (1.0/3628800 + r * (1.0/39916800 + r * (1.0/479001600
+       + r * (1.0/6227020800.0)))))))))))));
+}
+
+static vdouble
+k_expm1(vdouble x)
+{
+  vdouble n = k_nearest(x * M_LOG2E);
+  vdouble r = (x - n * LN2_HI) - n * LN2_LO;
+  vdouble p = k_pow2i(n);
+  return (p - 1.0) + p * k_expm1r(r);
+}
+
+/* tanh(x) = (e**2x - 1) / (e**2x + 1), from expm1 to keep small x exact.
+ */
+static vdouble
+k_tanh(vdouble x)
+{
+  vdouble e = k_expm1(2.0 * VABS(x));
+  return VD(VB(e / (e + 2.0)) | VSIGN(x));
+}
+
+/* The same as trianglewave(), with modf() done by rounding.
+ */
+static vdouble
+k_triwave(vdouble x)
+{
+  vdouble t = k_nearest(x);
+  vdouble one = VD(VB((vdouble){0} + 1.0) | VSIGN(x));
+  vdouble frac;
+  t = VSEL(VABS(t) > VABS(x), t - one, t);
+  frac = VD(VB(VABS(x - t)) | VSIGN(x)) * 2.0;
+  return VSEL(frac <= 1.0, frac, 2.0 - frac);
+}
+
+#else /* !EXPR_VMATH */
+
+#define VLOOP(KERNEL, INRANGE, LIBM) do { \
+    size_t i_; \
+    for (i_ = 0; i_ < n; i_++) { \
+      double v_ = x[i_]; \
+      y[i_] = LIBM; \
+    } \
+  } while (0)
+
+#endif /* EXPR_VMATH */
+
+#define SINCOS_MAX  1.073741824e9 /* 2**30 */
+#define TANH_MAX    350.0         /* keeps 2**n and e**2x normal */
+
+void
+vsin(const double * x, double * y, size_t n)
+{
+  VLOOP(k_sin, fabs(v_) <= SINCOS_MAX, sin(v_));
+}
+
+void
+vcos(const double * x, double * y, size_t n)
+{
+  VLOOP(k_cos, fabs(v_) <= SINCOS_MAX, cos(v_));
+}
+
+void
+vtanh(const double * x, double * y, size_t n)
+{
+  VLOOP(k_tanh, fabs(v_) <= TANH_MAX, tanh(v_));
+}
+
+void
+vtrianglewave(const double * x, double * y, size_t n)
+{
+  VLOOP(k_triwave, fabs(v_) < TWO52 / 2, trianglewave(v_));
+}
+
+
+#ifdef TEST
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+
+void
+test_approx(void)
+{
+  struct {
+    int rv;
+    double a;
+    double b;
+  } tests[] = {
+    { 0, 1, 1.1 },
+    { 1, 1, 1.00000005 },
+    { 0, -1, 1.00000005 },
+    { 0, 1, -1.00000005 },
+    { 1, -1, -1.00000005 },
+    { 0, .000000001, .000000005 },
+    { 0, -.000000001, .000000005 },
+    { 0, .000000001, -.000000005 },
+    { 0, -.000000001, -.000000005 },
+    { 0, 1, 2 },
+    { 0, 0.5, 0.6 },
+    { 0, 0.000005, 0.000006 },
+    { 0, 1e100, 2e100 },
+    { 1, .9999999999e0, 1e0 },
+    { 1, .9999999999e1, 1e1 },
+    { 1, .9999999999e10, 1e10 },
+    { 1, .9999999999e20, 1e20 },
+    { 1, .9999999999e30, 1e30 },
+    { 1, .9999999999e31, 1e31 },
+    { 1, .9999999999e32, 1e32 },
+    { 1, .9999999999e33, 1e33 },
+    { 1, .9999999999e50, 1e50 },
+    { 1, .9999999999e62, 1e62 },
+    { 1, .9999999999e63, 1e63 },
+    { 1, .9999999999e64, 1e64 },
+    { 1, .9999999999e65, 1e65 },
+    { 1, .9999999999e100, 1e100 },
+    { 1, .9999999999e200, 1e200 },
+    { 1, .9999999999e300, 1e300 },
+    { 1, .9999999999e-1, 1e-1 },
+    { 1, .9999999999e-2, 1e-2 },
+    { 1, .9999999999e-10, 1e-10 },
+    { 1, .9999999999e-20, 1e-20 },
+    { 1, .9999999999e-30, 1e-30 },
+    { 1, .9999999999e-40, 1e-40 },
+    { 1, .9999999999e-100, 1e-100 },
+    { 1, .9999999999e-200, 1e-200 },
+    { 1, .9999999999e-300, 1e-300 },
+    { 0, 2e0, 1e0 },
+    { 0, 2e1, 1e1 },
+    { 0, 2e10, 1e10 },
+    { 0, 2e20, 1e20 },
+    { 0, 2e30, 1e30 },
+    { 0, 2e31, 1e31 },
+    { 0, 2e32, 1e32 },
+    { 0, 2e33, 1e33 },
+    { 0, 2e50, 1e50 },
+    { 0, 2e62, 1e62 },
+    { 0, 2e63, 1e63 },
+    { 0, 2e64, 1e64 },
+    { 0, 2e65, 1e65 },
+    { 0, 2e100, 1e100 },
+    { 0, 2e200, 1e200 },
+    { 0, 2e300, 1e300 },
+    { 0, 2e-1, 1e-1 },
+    { 0, 2e-2, 1e-2 },
+    { 0, 2e-10, 1e-10 },
+    { 0, 2e-20, 1e-20 },
+    { 0, 2e-30, 1e-30 },
+    { 0, 2e-40, 1e-40 },
+    { 0, 2e-100, 1e-100 },
+    { 0, 2e-200, 1e-200 },
+    { 0, 2e-300, 1e-300 },
+    { -1, 0.0, 0.0 }
+  };
+  size_t i;
+  int rv;
+  for (i = 0; tests[i].rv >= 0; ++i) {
+    if (tests[i].a == tests[i].b)
+      printf("approx failed: malformed test %d: %15.15g == %15.15g\n",
+             (int)i, tests[i].a, tests[i].b);
+    rv = approx(tests[i].a, tests[i].b);
+    if (rv != tests[i].rv)
+      printf("approx failed: %15.15g %15.15g -> %d should be %d (test %d) # %15.15g %15.15g\n",
+             tests[i].a, tests[i].b, rv, tests[i].rv, (int)i,
+             tests[i].a * CUTOFF, tests[i].b * CUTOFF);
+  }
+}
+
+void
+test_lut(void)
+{
+  static const double ramp[] = { 4, 0.0, 0.5, 0.25, 1.0 };
+  static const double one[] = { 1, 0.75 };
+  struct {
+    const double * table;
+    double v;
+    double lin;
+    double cub;
+  } tests[] = {
+    { ramp, 0.0, 0.0, 0.0 },
+    { ramp, 1.0 / 3.0, 0.5, 0.5 },
+    { ramp, 2.0 / 3.0, 0.25, 0.25 },
+    { ramp, 1.0, 1.0, 1.0 },
+    { ramp, -1.0, 0.0, 0.0 },
+    { ramp, 2.0, 1.0, 1.0 },
+    { ramp, 0.5, 0.375, 0.359375 },
+    { ramp, 1.0 / 6.0, 0.25, 0.265625 },
+    { one, 0.5, 0.75, 0.75 },
+    { NULL, 0.0, 0.0, 0.0 }
+  };
+  size_t i;
+  for (i = 0; tests[i].table; i++) {
+    double lin = lut_linear(tests[i].table, tests[i].v);
+    double cub = lut_cubic(tests[i].table, tests[i].v);
+    if (fabs(lin - tests[i].lin) > 1e-15 || fabs(cub - tests[i].cub) > 1e-15)
+      printf("lut failed: %g -> %.17g, %.17g should be %.17g, %.17g\n",
+             tests[i].v, lin, cub, tests[i].lin, tests[i].cub);
+  }
+  if (!isnan(lut_linear(ramp, NAN)) || !isnan(lut_cubic(ramp, NAN)))
+    printf("lut failed: NaN should stay NaN\n");
+}
+
+void
+test_poly(void)
+{
+  /* 1 + 2(v - .25) on [0, .5); none on [.5, 1) */
+  static const double pw[] = { 7, 2, 4, 0, .25, 1, 1, 2 };
+  static const double bad[] = { 4, 2, 9, 4, 0 };
+  struct {
+    double v;
+    double rv;
+  } tests[] = {
+    { 0.0, 0.5 },
+    { 0.25, 1.0 },
+    { 0.49, 1.48 },
+    { 0.5, NAN },
+    { 1.0, NAN },
+    { -0.1, NAN },
+    { 1.1, NAN },
+    { NAN, NAN },
+  };
+  size_t i;
+  for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+    double rv = poly_piecewise(pw, tests[i].v);
+    if (isnan(tests[i].rv) ? !isnan(rv) : fabs(rv - tests[i].rv) > 1e-15)
+      printf("poly failed: %g -> %.17g should be %.17g\n",
+             tests[i].v, rv, tests[i].rv);
+  }
+  if (!isnan(poly_piecewise(bad, 0.0)) || !isnan(poly_piecewise(bad, 0.75)))
+    printf("poly failed: a damaged table should give NaN\n");
+}
+
+/* Distance between two doubles in units in the last place.
+ * NaN is only close to NaN.
+ */
+static double
+ulps(double a, double b)
+{
+  long long ia, ib;
+  if (isnan(a) || isnan(b)) return (isnan(a) && isnan(b)) ? 0.0 : INFINITY;
+  memcpy(&ia, &a, sizeof(ia));
+  memcpy(&ib, &b, sizeof(ib));
+  if (ia < 0) ia = LLONG_MIN - ia;
+  if (ib < 0) ib = LLONG_MIN - ib;
+  return ia > ib ? (double)((unsigned long long)ia - (unsigned long long)ib)
+                 : (double)((unsigned long long)ib - (unsigned long long)ia);
+}
+
+#define VN  (1 << 16)
+#define VREPEAT  16
+
+static double vin[VN], vout[VN];
+
+static void
+vfill(double * v, double lo, double hi, unsigned seed)
+{
+  static const double specials[] = {
+    0.0, -0.0, 1.0, -1.0, 0.5, DBL_MIN, -DBL_MIN, 5e-324, DBL_MAX, -DBL_MAX,
+    1e300, -1e300, 1e10, -1e10, INFINITY, -INFINITY, NAN
+  };
+  size_t i, ns = sizeof(specials) / sizeof(specials[0]);
+  for (i = 0; i < VN; i++) {
+    seed = seed * 1103515245u + 12345u;
+    v[i] = i < ns ? specials[i] : lo + (hi - lo) * (double)(seed >> 8) / 16777216.0;
+  }
+}
+
+static void
+vreport(const char * name, double maxulp, double limit, clock_t tv, clock_t tl)
+{
+  double ns = 1e9 / CLOCKS_PER_SEC / ((double)VN * VREPEAT);
+  printf("%-14s max %g ulp, %.2f ns/value (libm %.2f ns/value)\n",
+         name, maxulp, (double)tv * ns, (double)tl * ns);
+  if (maxulp > limit)
+    printf("%s failed: max %g ulp should be at most %g\n", name, maxulp, limit);
+}
+
+void
+test_vkernel(const char * name, void (*vfn)(const double *, double *, size_t),
+             double (*fn)(double), double lo, double hi, double limit)
+{
+  clock_t tv, tl;
+  double maxulp = 0.0, sum = 0.0;
+  size_t i, r;
+  vfill(vin, lo, hi, 1);
+  vfn(vin, vout, VN);
+  for (i = 0; i < VN; i++) {
+    double u = ulps(vout[i], fn(vin[i]));
+    if (u > maxulp) maxulp = u;
+  }
+  tv = clock();
+  for (r = 0; r < VREPEAT; r++) vfn(vin, vout, VN);
+  tv = clock() - tv;
+  tl = clock();
+  for (r = 0; r < VREPEAT; r++)
+    for (i = 0; i < VN; i++) sum += fn(vin[i]);
+  tl = clock() - tl;
+  vreport(name, maxulp, limit, tv, tl + (sum == 42.0));
+}
+
+void
+test_vmath(void)
+{
+  test_vkernel("vsin",          vsin,          sin,          -10.0,  10.0, 2);
+  test_vkernel("vsin (1e6)",    vsin,          sin,          -1e6,   1e6,  2);
+  test_vkernel("vcos",          vcos,          cos,          -10.0,  10.0, 2);
+  test_vkernel("vcos (1e6)",    vcos,          cos,          -1e6,   1e6,  2);
+  test_vkernel("vtanh",         vtanh,         tanh,         -1.0,   1.0,  4);
+  test_vkernel("vtanh (30)",    vtanh,         tanh,         -30.0,  30.0, 4);
+  test_vkernel("vtrianglewave", vtrianglewave, trianglewave, -10.0,  10.0, 0);
+  fflush(stdout);
+}
+
+int
+main(void)
+{
+  test_approx();
+  test_lut();
+  test_poly();
+  test_vmath();
+  printf("math done\n");
+  return 0;
+}
+
+
+#endif
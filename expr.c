@@ -37,6 +37,32 @@ typedef enum expr_oper_e {
 #define op_isConst(OP)  ((OP) >= _OP_CONST_MIN && (OP) <= _OP_CONST_MAX)
 #define op_isFunc(OP)   ((OP) >= _OP_FUNC_MIN  && (OP) <= _OP_FUNC_MAX )
 #define op_isOper(OP)   ((OP) >= _OP_OPER_MIN  && (OP) <= _OP_OPER_MAX )
+#define op_isJump(OP)   ((OP) >= _OP_JUMP_MIN  && (OP) <= _OP_JUMP_MAX )
+
+/* What a jump does with the top when it jumps; see expr-optab.inc.
+ */
+#define op_jumpKeeps(OP)  ((OP) != OP_JFALSE)
+
+/* The stack effect in program order. A jump counts as a pop, which
+ * makes the depth at each opcode exact along every path: OP_JUMP ends
+ * the first arm of ?:, and the second arm starts without its value.
+ */
+#define op_pushes(OP)   (!op_isJump(OP))
+
+/* The operators expr_branch can lower to jumps.
+ */
+#define op_isBranch(OP) ((OP) == OP_COND || (OP) == OP_LOGAND || \
+                         (OP) == OP_LOGOR || (OP) == OP_COAL)
+
+/* The functions of a table literal, whose value is the table's offset
+ * in the pool: its length, then its values. See expr_table.
+ */
+#define op_hasTable(OP) ((OP) == OP_LUT || (OP) == OP_LUTC || (OP) == OP_POLY)
+
+/* The functions of any number of arguments, which the parser expands
+ * to a search over ?:. See expr_dispatch.
+ */
+#define op_isDispatch(OP) ((OP) == OP_SELECT || (OP) == OP_PIECEWISE)
 
 static struct expr_opinfo_s {
   char * name; /* source token or descriptive name */
@@ -68,22 +94,121 @@ typedef struct expr_opcode_s {
 
 /* ********************************************************************** */
 
+/* Number of samples expr_eval_n runs through each opcode at once.
+ */
+#define EXPR_BLOCK 64
+
+/* Everything an evaluation writes to, so that a program can run on
+ * many threads at once, each with a context of its own.
+ */
+struct EXPR_CTX_s {  /* typedef is in expr.h: EXPR_CTX */
+  size_t   depth;    /* the deepest program it can run */
+  size_t   nslots;   /* the most slots a program it runs can have */
+  double * stack;    /* the evaluation stack, depth + 1 */
+  double * slots;    /* the slots */
+  double * block;    /* the evaluation stack for expr_eval_n, depth * EXPR_BLOCK */
+  double * blockslots; /* the slots for expr_eval_n, nslots * EXPR_BLOCK */
+};
+
+/* The doubles a context needs, which follow it in memory.
+ */
+#define expr_ctx_size(DEPTH,NSLOTS) \
+  ((DEPTH) + 1 + (NSLOTS) + EXPR_BLOCK * ((DEPTH) + (NSLOTS)))
+
 struct EXPR_s {      /* typedef is in expr.h: EXPR */
-  size_t   capacity; /* the size of the code and stack arrays */
-  OPCODE * code;     /* the compiled program */
-  double * stack;    /* the evaluation stack */
+  unsigned char * code; /* the compiled program; see expr_pack */
+  double * pool;     /* the values of its OP_NUMBERs */
+  size_t   codelen;  /* the bytes in code, with the OP_EOF */
+  size_t   npool;    /* the values in pool */
+  EXPR_CTX * ctx;    /* the context for expr_eval and expr_eval_n */
+  size_t   folded;   /* opcodes removed by the optimizer */
+  size_t   rewritten; /* rewrites by expr_rewrite */
+  size_t   shared;   /* opcodes replaced by OP_LOAD; see expr_share */
+  size_t   nslots;   /* the number of OP_LOAD/OP_STORE slots */
+  size_t   branches; /* operators lowered to jumps; see expr_branch */
+  size_t   depth;    /* the maximum stack depth of the program */
+  size_t   fitted;   /* polynomial pieces; see expr_fit */
+  double   fiterr;   /* their largest error at the check points */
+  int      exact;    /* EXPR_EXACT and EXPR_FMA, if compiled with them */
+  int      tier;     /* EXPR_FLOAT and EXPR_FAST, if compiled with them */
+  void   * regs;     /* the code for the register VM, or NULL; see expr_lower */
+  void   * jit;      /* the native code, or NULL; see expr_jit */
+  size_t   jitsize;  /* the size of the jit mapping */
+  void   * ccso;     /* the dlopen() handle of the compiled C, or NULL; see expr_cc */
+  void   * cc;       /* its expr_cc_eval */
+  void   * ccn;      /* its expr_cc_eval_n */
+  EXPR   * grid;     /* the program expr_eval_grid runs, or NULL; see expr_grid */
+  void   * gens;     /* in that program, what fills its last ngens slots */
+  size_t   ngens;
 };
 
 /* ********************************************************************** */
 
+typedef struct expr_frame_s {
+  int    kind;     /* see expr_frame_e */
+  int    n;        /* the precedence, or the argument count */
+  size_t at;       /* the length of dst when pushed */
+  OPCODE tk;       /* the operator or function */
+} EXPRFRAME;
+
+typedef struct expr_bind_s {
+  const char * name;      /* in the source, or NULL for an argument */
+  size_t       len;
+  OPCODE     * code;      /* its value, with an OP_NAME for each name used */
+  size_t       codelen;
+} EXPRBIND;
+
+typedef struct expr_func_s {
+  char       * text;      /* the definition, "name(a, b) = body" */
+  const char * name;      /* in text */
+  size_t       len;
+  const char * body;      /* in text, after the '=' */
+  EXPRBIND   * params;    /* their names, in text */
+  int          argc;
+  int          state;     /* see expr_func_e */
+  OPCODE     * code;      /* the body, with an OP_PARAM for each use of one */
+  size_t       codelen;   /* without the OP_EOF */
+  size_t       nslots;    /* of its OP_LOADs and OP_STOREs */
+  double     * pool;      /* the tables of its OP_LUTs; see expr_table */
+  size_t       npool;
+} EXPRFUNC;
+
+enum expr_func_e {
+  LIB_PENDING,            /* not compiled yet */
+  LIB_BUSY,               /* being compiled; a call now is a cycle */
+  LIB_DONE,
+  LIB_FAILED
+};
+
+struct EXPR_LIB_s {       /* typedef is in expr.h: EXPR_LIB */
+  EXPRFUNC * funcs;
+  size_t     nfuncs;
+  size_t   * slots;       /* 1 + the function, by the hash of its name, or 0 */
+  size_t     nslots;      /* a power of 2 */
+};
+
 typedef struct expr_state_s {
   const char * src;       /* source script */
   const char * srcp;      /* first char of next token */
   size_t       curoffs;   /* index of first char of current token */
   OPCODE       tok;       /* current token */
-  size_t       dstlen;    /* length of dst buffer */
+  size_t       dstlen;    /* length of dst buffer; see expr_reserve */
   OPCODE     * dst;       /* destination buffer */
   OPCODE     * dstp;      /* pointer to output destination */
+  void (*handler)(const char *, void *); /* where errors go */
+  void       * ctxt;      /* the handler's context */
+  EXPRFRAME  * frames;    /* the parser's stack; see expr_prec_parse */
+  size_t       nframes;
+  size_t       framecap;
+  EXPRBIND   * binds;     /* the let-bindings so far; see expr_parse */
+  size_t       nbinds;
+  size_t       bindcap;
+  size_t       nslots;    /* given out so far, to OP_LOAD and OP_STORE */
+  EXPR_LIB   * lib;       /* the functions it may call, or NULL */
+  const EXPRFUNC * func;  /* the function being compiled, or NULL */
+  double     * pool;      /* the tables of OP_LUTs; see expr_table */
+  size_t       npool;
+  size_t       poolcap;
 } EXPRSTATE;
 
 #define CURTOKEN (&(pex->tok))
@@ -94,8 +219,13 @@ typedef struct expr_state_s {
 /* Error Handling */
 /* ********************************************************************** */
 
-static void (*error_handler)(const char *, void *) = NULL;
-static void * error_handler_ctxt = NULL;
+/* Compiling and evaluating are thread-safe. What little global state
+ * there is, is either set up once (see expr_init) or guarded.
+ */
+#if defined(__unix__) && !defined(EXPR_NO_THREADS)
+#define EXPR_THREADS 1
+#include <pthread.h>
+#endif
 
 static void
 default_error_handler(const char * msg, void * unused)
@@ -105,18 +235,28 @@ default_error_handler(const char * msg, void * unused)
   fflush(stderr);
 }
 
+/* The handler for expr_new and expr_new_with; expr_new_ex takes one.
+ */
+static void (*error_handler)(const char *, void *) = default_error_handler;
+static void * error_handler_ctxt = NULL;
+
 static int
 expr_error(EXPRSTATE * pex, const char * fmt, ...)
 {
   char tmp[2048];
-  char buf[2048];
+  char buf[2048 + 128]; /* tmp, after the name and the offset */
   va_list ap;
   va_start(ap, fmt);
   vsnprintf(tmp, sizeof(tmp), fmt, ap);
   va_end(ap);
-  snprintf(buf, sizeof(buf), "Syntax error at %lu: %s",
-           (unsigned long)pex->curoffs, tmp);
-  error_handler(buf, error_handler_ctxt);
+  if (pex->func)
+    snprintf(buf, sizeof(buf), "Syntax error in '%.*s' at %lu: %s",
+             (int)(pex->func->len < 63 ? pex->func->len : 63), pex->func->name,
+             (unsigned long)pex->curoffs, tmp);
+  else
+    snprintf(buf, sizeof(buf), "Syntax error at %lu: %s",
+             (unsigned long)pex->curoffs, tmp);
+  pex->handler(buf, pex->ctxt);
   return -1;
 }
 
@@ -131,6 +271,153 @@ expr_set_error_handler(void (*handle)(const char *, void *), void * ctxt)
 /* Tokenizer */
 /* ********************************************************************** */
 
+/* Identifiers are found with a perfect hash, and operators with a
+ * trie, both built once by tok_build from the operator table. The
+ * hash is FNV-1a; its low bits pick one of TOK_BUCKETS buckets, and
+ * the bucket's displacement, chosen so that no two names collide,
+ * mixes into the rest to pick a slot. A lookup is then one hash and
+ * one strcmp. Should no displacements be found for some future
+ * table, tok_ident falls back to comparing every name.
+ */
+#define TOK_BUCKETS  32
+#define TOK_SLOTS    256
+#define TOK_NODES    64
+#define TOK_NONE     0xFF
+
+static unsigned short tok_disp[TOK_BUCKETS];
+static unsigned char  tok_slot[TOK_SLOTS];   /* the identifier, or TOK_NONE */
+static int            tok_hashed = 0;
+
+static unsigned char  tok_punct[256];        /* 1 + index of the character */
+static unsigned char  tok_trie[TOK_NODES][33]; /* the child for each */
+static unsigned char  tok_trie_op[TOK_NODES]; /* the operator, or TOK_NONE */
+
+static unsigned long
+tok_hash(const char * s, size_t len)
+{
+  unsigned long h = 0x811C9DC5UL;
+  for (; len; len--, s++) h = ((h ^ (unsigned char)*s) * 0x01000193UL) & 0xFFFFFFFFUL;
+  return h;
+}
+
+static size_t
+tok_hash_slot(unsigned long h, unsigned d)
+{
+  h = ((h ^ (d * 0x9E3779B9UL)) * 0x85EBCA6BUL) & 0xFFFFFFFFUL;
+  return (size_t)(h >> 24) % TOK_SLOTS;
+}
+
+/* Place the names bucket by bucket, biggest first.
+ */
+static int
+tok_build_hash(void)
+{
+  size_t count[TOK_BUCKETS], b, i, k, n;
+  int t, u, order[TOK_BUCKETS];
+  size_t slots[_OP_IDENT_MAX - _OP_IDENT_MIN + 1];
+  unsigned d;
+
+  memset(count, 0, sizeof(count));
+  memset(tok_slot, TOK_NONE, sizeof(tok_slot));
+  for (t = _OP_IDENT_MIN; t <= _OP_IDENT_MAX; t++)
+    count[tok_hash(op_name(t), strlen(op_name(t))) % TOK_BUCKETS]++;
+  for (b = 0; b < TOK_BUCKETS; b++) order[b] = (int)b;
+  for (b = 1; b < TOK_BUCKETS; b++)
+    for (i = b; i && count[order[i - 1]] < count[order[i]]; i--) {
+      u = order[i]; order[i] = order[i - 1]; order[i - 1] = u;
+    }
+
+  for (b = 0; b < TOK_BUCKETS && count[order[b]]; b++) {
+    for (d = 0; d < 0x10000; d++) {
+      for (n = 0, t = _OP_IDENT_MIN; t <= _OP_IDENT_MAX; t++) {
+        unsigned long h = tok_hash(op_name(t), strlen(op_name(t)));
+        if (h % TOK_BUCKETS != (unsigned long)order[b]) continue;
+        slots[n] = tok_hash_slot(h, d);
+        if (tok_slot[slots[n]] != TOK_NONE) break;
+        for (k = 0; k < n && slots[k] != slots[n]; k++) /**/;
+        if (k < n) break;
+        n++;
+      }
+      if (t > _OP_IDENT_MAX) break;
+    }
+    if (d == 0x10000) return 0;
+    tok_disp[order[b]] = (unsigned short)d;
+    for (n = 0, t = _OP_IDENT_MIN; t <= _OP_IDENT_MAX; t++) {
+      unsigned long h = tok_hash(op_name(t), strlen(op_name(t)));
+      if (h % TOK_BUCKETS == (unsigned long)order[b])
+        tok_slot[slots[n++]] = (unsigned char)t;
+    }
+  }
+  return 1;
+}
+
+/* Called from expr_init.
+ */
+static void
+tok_build(void)
+{
+  int t, c, n = 1;
+  const char * s;
+
+  tok_hashed = tok_build_hash();
+
+  /* ASCII's 32, whatever the locale; the rows of tok_trie hold no more */
+  for (c = 1, t = 0; t < 256; t++)
+    tok_punct[t] = (unsigned char)(t > ' ' && t < 127 && !isalnum(t) ? c++ : 0);
+  assert(c == 33);
+  memset(tok_trie, 0, sizeof(tok_trie));
+  memset(tok_trie_op, TOK_NONE, sizeof(tok_trie_op));
+  for (t = _OP_OPER_MIN; t <= _OP_OPER_MAX; t++) {
+    int node = 0;
+    for (s = op_name(t); *s && tok_punct[(unsigned char)*s]; s++) /**/;
+    if (*s) continue; /* never gathered; see tok_next */
+    for (s = op_name(t); *s; s++) {
+      unsigned char * child = &(tok_trie[node][tok_punct[(unsigned char)*s]]);
+      if (!*child) {
+        assert(n < TOK_NODES);
+        *child = (unsigned char)n++;
+      }
+      node = *child;
+    }
+    if (tok_trie_op[node] == TOK_NONE) tok_trie_op[node] = (unsigned char)t;
+  }
+}
+
+/* The identifier named by the len characters at s, or OP_EOF.
+ */
+static expr_oper_t
+tok_ident(const char * s, size_t len)
+{
+  int t;
+  if (tok_hashed) {
+    unsigned long h = tok_hash(s, len);
+    t = tok_slot[tok_hash_slot(h, tok_disp[h % TOK_BUCKETS])];
+    if (t != TOK_NONE && !strncmp(op_name(t), s, len) && !op_name(t)[len])
+      return (expr_oper_t)t;
+    return OP_EOF;
+  }
+  for (t = _OP_IDENT_MIN; t <= _OP_IDENT_MAX; t++)
+    if (!strncmp(op_name(t), s, len) && !op_name(t)[len]) return (expr_oper_t)t;
+  return OP_EOF;
+}
+
+/* The longest operator at s, or OP_EOF; *len gets its length.
+ */
+static expr_oper_t
+tok_oper(const char * s, size_t * len)
+{
+  int node = 0, op = TOK_NONE;
+  size_t i;
+  for (i = 0, *len = 0; tok_punct[(unsigned char)s[i]]; i++) {
+    if (!(node = tok_trie[node][tok_punct[(unsigned char)s[i]]])) break;
+    if (tok_trie_op[node] != TOK_NONE) {
+      op = tok_trie_op[node];
+      *len = i + 1;
+    }
+  }
+  return op == TOK_NONE ? OP_EOF : (expr_oper_t)op;
+}
+
 static int
 tok_init(EXPRSTATE * pex, const char * src, OPCODE * dst, size_t dstlen)
 {
@@ -142,14 +429,63 @@ tok_init(EXPRSTATE * pex, const char * src, OPCODE * dst, size_t dstlen)
   pex->dstlen = dstlen;
   pex->dst = dst;
   pex->dstp = dst;
+  pex->frames = NULL;
+  pex->nframes = 0;
+  pex->framecap = 0;
+  pex->binds = NULL;
+  pex->nbinds = 0;
+  pex->bindcap = 0;
+  pex->nslots = 0;
+  pex->handler = default_error_handler;
+  pex->ctxt = NULL;
+  pex->lib = NULL;
+  pex->func = NULL;
+  pex->pool = NULL;
+  pex->npool = 0;
+  pex->poolcap = 0;
   return 0;
 }
 
+/* The library function named by the len characters at s, or -1.
+ */
+static size_t
+lib_find(const EXPR_LIB * lib, const char * s, size_t len)
+{
+  size_t i, k;
+  for (i = tok_hash(s, len) & (lib->nslots - 1); (k = lib->slots[i]) != 0;
+       i = (i + 1) & (lib->nslots - 1)) {
+    const EXPRFUNC * f = &(lib->funcs[k - 1]);
+    if (f->len == len && !strncmp(f->name, s, len)) return k - 1;
+  }
+  return (size_t)-1;
+}
+
+/* The parameter of f named by the len characters at s, or -1.
+ */
+static size_t
+lib_param(const EXPRFUNC * f, const char * s, size_t len)
+{
+  size_t i;
+  for (i = 0; i < (size_t)f->argc; i++)
+    if (f->params[i].len == len && !strncmp(f->params[i].name, s, len)) return i;
+  return (size_t)-1;
+}
+
+/* Whether the token at s is '='.
+ */
+static int
+tok_assigns(const char * s)
+{
+  size_t len;
+  while (*s && *s <= ' ') s++;
+  return tok_oper(s, &len) == OP_ASSIGN;
+}
+
 static int
 tok_next(EXPRSTATE * pex)
 {
   char buf[64];
-  size_t idx = 0;
+  size_t idx = 0, i;
 
 #define p   (pex->srcp)
 #define GATHER(TEST) do { \
@@ -189,8 +525,28 @@ tok_next(EXPRSTATE * pex)
 
   if (isalpha(*p)) {
     GATHER(isalnum);
-    for (CURTYPE = _OP_IDENT_MIN; CURTYPE <= _OP_IDENT_MAX; CURTYPE++) {
-      if (!strcmp(op_name(CURTYPE), buf)) { p += idx; return 0; }
+    /* a parameter of the function being compiled, which hides the rest */
+    if (pex->func && (i = lib_param(pex->func, p, idx)) != (size_t)-1) {
+      CURTYPE = OP_PARAM;
+      CURVALUE = (double)i;
+      p += idx;
+      return 0;
+    }
+    if ((CURTYPE = tok_ident(buf, idx)) != OP_EOF) { p += idx; return 0; }
+    /* a let-bound name, the latest first, or one about to be bound */
+    for (i = pex->nbinds; i--; )
+      if (pex->binds[i].len == idx && !strncmp(pex->binds[i].name, p, idx)) break;
+    if (i != (size_t)-1 || tok_assigns(p + idx)) {
+      CURTYPE = OP_NAME;
+      CURVALUE = i != (size_t)-1 ? (double)i : -1.0;
+      p += idx;
+      return 0;
+    }
+    if (pex->lib && (i = lib_find(pex->lib, p, idx)) != (size_t)-1) {
+      CURTYPE = OP_CALL;
+      CURVALUE = (double)i;
+      p += idx;
+      return 0;
     }
     return expr_error(pex, "unknown identifier '%s'", buf);
   }
@@ -198,13 +554,7 @@ tok_next(EXPRSTATE * pex)
   /* *** Operators *** */
 
   if (ispunct(*p)) {
-    GATHER(ispunct);
-    do {
-      for (CURTYPE = _OP_OPER_MIN; CURTYPE <= _OP_OPER_MAX; CURTYPE++) {
-        if (!strcmp(op_name(CURTYPE), buf)) { p += idx; return 0; }
-      }
-      buf[--idx] = '\0';
-    } while (idx);
+    if ((CURTYPE = tok_oper(p, &idx)) != OP_EOF) { p += idx; return 0; }
   }
   if (isprint(*p)) return expr_error(pex, "unknown character '%c'", *p);
   return expr_error(pex, "unknown character '\\x%02X'", *p);
@@ -226,284 +576,6535 @@ tok_next(EXPRSTATE * pex)
     } \
   } while (0)
 
-#define Q_PARSE_LEVEL(n)   Q(expr_prec_level(pex, (n)))
-#define Q_PARSE_PRIMARY()  Q(expr_prec_primary(pex))
+#define Q_PUSH(KIND,N,TK)  Q(expr_push(pex, (KIND), (N), (TK)))
 #define Q_APPEND(TK)  do { \
-    assert((size_t)(pex->dstp - pex->dst) < pex->dstlen); \
+    Q(expr_reserve(pex, 1)); \
     opcode_copy(pex->dstp, (TK)); \
     pex->dstp++; \
   } while (0)
 
-static int expr_prec_level(EXPRSTATE * pex, int prec);
+/* The grammar:
+ *
+ *   parse   : level(0) EOF ;
+ *   level(n) : primary
+ *            | level(n) op(n) level(n+1)
+ *            | level(n) "?" level(0) ":" level("?") ;
+ *   primary : NUMBER | VAR | IDENT '(' args? ')' | '(' expr ')'
+ *           | TABLED '(' table ',' expr ')' | unary_op primary ;
+ *   args : expr | args ',' expr ;
+ *   table : '[' NUMBER ( ',' NUMBER )* ']' ;
+ *
+ * where IDENT may also be a function of the library, called by
+ * inlining its body (see expr_call), and TABLED is lut or lutc, whose
+ * table goes to the pool (see expr_table). It is parsed by precedence
+ * climbing, without recursion: what each unfinished rule still has to
+ * do is a frame on a stack of its own, so generated sources nest as
+ * deep as memory allows, in time linear in their length. Each frame
+ * is one of:
+ */
+enum expr_frame_e {
+  F_LEVEL,  /* level(n), after a primary: n is the precedence */
+  F_BINOP,  /* awaiting the right operand of tk */
+  F_COND,   /* awaiting the middle of ?: */
+  F_COLON,  /* awaiting the last operand of ?: */
+  F_FUNC,   /* awaiting argument n + 1 of the function tk */
+  F_PAREN,  /* awaiting the inside of ( ) */
+  F_UNARY   /* awaiting the operand of tk */
+};
+
+/* Make room for n more opcodes. The source's length is enough for
+ * its own tokens; only let-bound names, copied in for each use, need
+ * more.
+ */
+static int
+expr_reserve(EXPRSTATE * pex, size_t n)
+{
+  size_t used = (size_t)(pex->dstp - pex->dst), cap;
+  OPCODE * d;
+  if (pex->dstlen - used >= n) return 0;
+  for (cap = pex->dstlen ? pex->dstlen : 64; cap - used < n; cap *= 2) /**/;
+  if (cap >= (size_t)(INT_MAX / sizeof(OPCODE)))
+    return expr_error(pex, "expression too large");
+  d = (OPCODE *)realloc(pex->dst, sizeof(OPCODE) * cap);
+  if (!d) return -1; /* no error printing on out-of-mem */
+  pex->dstp = d + used;
+  pex->dst = d;
+  pex->dstlen = cap;
+  return 0;
+}
+
+static int
+expr_push(EXPRSTATE * pex, int kind, int n, const OPCODE * tk)
+{
+  if (pex->nframes == pex->framecap) {
+    size_t cap = pex->framecap ? pex->framecap * 2 : 64;
+    EXPRFRAME * f = (EXPRFRAME *)realloc(pex->frames, sizeof(EXPRFRAME) * cap);
+    if (!f) return -1; /* no error printing on out-of-mem */
+    pex->frames = f;
+    pex->framecap = cap;
+  }
+  pex->frames[pex->nframes].kind = kind;
+  pex->frames[pex->nframes].n = n;
+  pex->frames[pex->nframes].at = (size_t)(pex->dstp - pex->dst);
+  if (tk) opcode_copy(&(pex->frames[pex->nframes].tk), tk);
+  pex->nframes++;
+  return 0;
+}
+
+/* Append v to the pool.
+ */
+static int
+expr_pool(EXPRSTATE * pex, double v)
+{
+  if (pex->npool == pex->poolcap) {
+    size_t cap = pex->poolcap ? pex->poolcap * 2 : 64;
+    double * p = (double *)realloc(pex->pool, sizeof(double) * cap);
+    if (!p) return -1; /* no error printing on out-of-mem */
+    pex->pool = p;
+    pex->poolcap = cap;
+  }
+  pex->pool[pex->npool++] = v;
+  return 0;
+}
+
+/* table ',' of the function tk: its length and then its numbers, each
+ * optionally signed, go to the pool, and tk's value is where.
+ */
+static int
+expr_table(EXPRSTATE * pex, OPCODE * tk)
+{
+  size_t at = pex->npool;
+  Q_REQUIRE(OP_LBRACKET);
+  Q(expr_pool(pex, 0.0));
+  for (;;) {
+    double sign = CURTYPE == OP_SUB ? -1.0 : 1.0;
+    if (CURTYPE == OP_SUB || CURTYPE == OP_ADD) Q_NEXT();
+    if (CURTYPE != OP_NUMBER)
+      return expr_error(pex, "unexpected '%s', expected a number",
+                        op_name(CURTYPE));
+    Q(expr_pool(pex, sign * CURVALUE));
+    Q_NEXT();
+    if (CURTYPE != OP_COMMA) break;
+    Q_NEXT();
+  }
+  Q_REQUIRE(OP_RBRACKET);
+  Q_REQUIRE(OP_COMMA);
+  pex->pool[at] = (double)(pex->npool - at - 1);
+  tk->value = (double)at;
+  return 0;
+}
+
+static void lib_compile(EXPR_LIB * lib, EXPRFUNC * f,
+                        void (*handle)(const char *, void *), void * ctxt);
+
+/* Check that the library function at the current token can be called,
+ * compiling it first while the library is being built.
+ */
+static int
+expr_callable(EXPRSTATE * pex)
+{
+  EXPRFUNC * f = &(pex->lib->funcs[(size_t)CURVALUE]);
+  if (f->state == LIB_PENDING) lib_compile(pex->lib, f, pex->handler, pex->ctxt);
+  if (f->state == LIB_BUSY)
+    return expr_error(pex, "'%.*s' calls itself",
+                      (int)(f->len < 63 ? f->len : 63), f->name);
+  if (f->state == LIB_FAILED)
+    return expr_error(pex, "'%.*s' has errors",
+                      (int)(f->len < 63 ? f->len : 63), f->name);
+  return 0;
+}
+
+static int
+expr_argc(const EXPRSTATE * pex, const OPCODE * tk)
+{
+  if (tk->type == OP_CALL) return pex->lib->funcs[(size_t)tk->value].argc;
+  return op_argc(tk->type);
+}
+
+/* Check that the function tk is given argc args.
+ */
+static int
+expr_arity(EXPRSTATE * pex, const OPCODE * tk, int argc)
+{
+  if (tk->type == OP_SELECT && argc < 2)
+    return expr_error(pex, "function takes 2 or more args, found %d", argc);
+  if (tk->type == OP_PIECEWISE && (argc < 2 || argc % 2))
+    return expr_error(pex, "function takes an even number of args, found %d",
+                      argc);
+  if (!op_isDispatch(tk->type) && argc != expr_argc(pex, tk))
+    return expr_error(pex, "function takes %d args, found %d",
+                      expr_argc(pex, tk), argc);
+  return 0;
+}
+
+/* Where each of the argc arguments from dst + start to dstp begins:
+ * argument k runs from ends[k] to ends[k + 1], where the stack was
+ * last k + 1 deep. Returns them, to be freed, or NULL if out of mem.
+ */
+static size_t *
+expr_arg_ends(const EXPRSTATE * pex, size_t start, int argc)
+{
+  size_t * ends = (size_t *)malloc(sizeof(size_t) * ((size_t)argc + 1));
+  size_t i, end = (size_t)(pex->dstp - pex->dst);
+  int depth;
+  if (!ends) return NULL;
+  ends[0] = start;
+  for (depth = 0, i = start; i < end; i++) {
+    depth += 1 - op_argc(pex->dst[i].type);
+    if (depth <= argc) ends[depth] = i + 1;
+  }
+  return ends;
+}
+
+/* The number of slots the len opcodes at code use: 1 + the highest.
+ */
+static size_t
+expr_slots(const OPCODE * code, size_t len)
+{
+  size_t i, n = 0;
+  for (i = 0; i < len; i++)
+    if ((code[i].type == OP_LOAD || code[i].type == OP_STORE) &&
+        (size_t)code[i].value >= n)
+      n = (size_t)code[i].value + 1;
+  return n;
+}
+
+/* Append piecewise(v, t1, e1, ..., tN, eN, e), whose arguments' code
+ * runs from dst + start: v < t1 ? e1 : v < t2 ? e2 : ... : e, for
+ * ascending ts, but as a binary search, whose ?: are flagged for
+ * expr_branch to lower to jumps. A sample then takes O(log N)
+ * compares and computes only the e it picks. select(i, e0, ..., eN)
+ * is piecewise(i, 1, e0, 2, e1, ..., N, eN-1, eN).
+ */
+static int
+expr_dispatch(EXPRSTATE * pex, const OPCODE * tk, size_t start, int argc)
+{
+  int indexed = tk->type == OP_SELECT;
+  size_t narms = indexed ? (size_t)argc - 1 : (size_t)argc / 2;
+  size_t * ends, * todo, end, vlen, n, k, sp;
+
+  if (!(ends = expr_arg_ends(pex, start, argc))) return -1;
+  todo = (size_t *)malloc(sizeof(size_t) * 2 * (2 * narms + 1));
+  end = (size_t)(pex->dstp - pex->dst);
+  vlen = ends[1] - ends[0];
+  /* every argument but v once, and a v, a < and a ?: per t */
+  n = (end - start) - vlen + (narms - 1) * (vlen + 2 + (size_t)indexed);
+  if (!todo || expr_reserve(pex, n + narms)) { /* and room for the jumps */
+    free(ends);
+    free(todo);
+    return -1;
+  }
+
+#define ARM(J)  (indexed ? (J) + 1 : (J) < narms - 1 ? 2 * (J) + 2 : (size_t)argc - 1)
+#define COPY(K)  do { \
+    memcpy(pex->dstp, pex->dst + ends[K], sizeof(OPCODE) * (ends[(K) + 1] - ends[K])); \
+    pex->dstp += ends[(K) + 1] - ends[K]; \
+  } while (0)
+#define EMIT(TYPE,VALUE)  do { \
+    pex->dstp->type = (TYPE); \
+    pex->dstp->value = (VALUE); \
+    pex->dstp++; \
+  } while (0)
+
+  /* the arms lo to hi, then, when lo > hi, a ?: */
+  sp = 0;
+  todo[sp++] = 0;
+  todo[sp++] = narms - 1;
+  while (sp) {
+    size_t hi = todo[--sp], lo = todo[--sp], mid;
+    if (lo > hi) { EMIT(OP_COND, 1.0); continue; }
+    if (lo == hi) { COPY(ARM(lo)); continue; }
+    mid = lo + (hi - lo) / 2;
+    COPY(0);
+    if (indexed) EMIT(OP_NUMBER, (double)(mid + 1));
+    else COPY(2 * mid + 1);
+    EMIT(OP_LT, 0.0);
+    todo[sp++] = 1;
+    todo[sp++] = 0;
+    todo[sp++] = mid + 1;
+    todo[sp++] = hi;
+    todo[sp++] = lo;
+    todo[sp++] = mid;
+  }
+#undef EMIT
+#undef COPY
+#undef ARM
+
+  k = (size_t)(pex->dstp - pex->dst) - end;
+  memmove(pex->dst + start, pex->dst + end, sizeof(OPCODE) * k);
+  pex->dstp = pex->dst + start + k;
+  free(ends);
+  free(todo);
+  return 0;
+}
+
+/* Move the code from dst + start to dst + end to a new binding of
+ * name, len long.
+ */
+static int
+expr_bind(EXPRSTATE * pex, const char * name, size_t len,
+          size_t start, size_t end)
+{
+  EXPRBIND * b;
+  if (pex->nbinds == pex->bindcap) {
+    size_t cap = pex->bindcap ? pex->bindcap * 2 : 8;
+    b = (EXPRBIND *)realloc(pex->binds, sizeof(EXPRBIND) * cap);
+    if (!b) return -1; /* no error printing on out-of-mem */
+    pex->binds = b;
+    pex->bindcap = cap;
+  }
+  b = &(pex->binds[pex->nbinds++]);
+  b->name = name;
+  b->len = len;
+  b->codelen = end - start;
+  b->code = (OPCODE *)malloc(sizeof(OPCODE) * (b->codelen ? b->codelen : 1));
+  if (!b->code) return -1; /* no error printing on out-of-mem */
+  memcpy(b->code, pex->dst + start, sizeof(OPCODE) * b->codelen);
+  return 0;
+}
 
-/* primary : NUMBER | VAR | IDENT '(' args? ')' | '(' expr ')'
- *         | unary_op primary ;
- * args : expr | args ',' expr ;
+/* Append the function tk, whose argc arguments' code runs from dst +
+ * start. A library function's body replaces its arguments, each of
+ * which becomes a binding without a name, with an OP_NAME of it in
+ * place of each OP_PARAM; like a let-binding, it is computed once,
+ * however many times the body uses it, and only in the arm that needs
+ * it. See expr_parse_names and expr_sink. Its
+ * tables go to the end of the pool, and its slots after those given
+ * out already.
  */
 static int
-expr_prec_primary(EXPRSTATE * pex)
+expr_call(EXPRSTATE * pex, const OPCODE * tk, size_t start, int argc)
+{
+  const EXPRFUNC * f;
+  size_t * ends, i, first = pex->nbinds, base = pex->npool;
+  int k;
+
+  if (op_isDispatch(tk->type)) return expr_dispatch(pex, tk, start, argc);
+  if (tk->type != OP_CALL) {
+    Q_APPEND(tk);
+    return 0;
+  }
+  f = &(pex->lib->funcs[(size_t)tk->value]);
+  for (i = 0; i < f->npool; i++) Q(expr_pool(pex, f->pool[i]));
+  if (!(ends = expr_arg_ends(pex, start, argc)))
+    return -1; /* no error printing on out-of-mem */
+  for (k = 0; k < argc; k++) {
+    if (expr_bind(pex, NULL, 0, ends[k], ends[k + 1])) {
+      free(ends);
+      return -1;
+    }
+  }
+  free(ends);
+
+  pex->dstp = pex->dst + start;
+  Q(expr_reserve(pex, f->codelen));
+  for (i = 0; i < f->codelen; i++) {
+    opcode_copy(pex->dstp, &(f->code[i]));
+    if (f->code[i].type == OP_PARAM) {
+      pex->dstp->type = OP_NAME;
+      pex->dstp->value += (double)first;
+    }
+    if (op_hasTable(f->code[i].type)) pex->dstp->value += (double)base;
+    if (f->code[i].type == OP_LOAD || f->code[i].type == OP_STORE)
+      pex->dstp->value += (double)pex->nslots;
+    pex->dstp++;
+  }
+  pex->nslots += f->nslots;
+  return 0;
+}
+
+static int
+expr_prec_parse(EXPRSTATE * pex)
 {
+  EXPRFRAME * top;
   OPCODE tmp;
-  if (CURTYPE == OP_NUMBER || op_isConst(CURTYPE) || op_isVar(CURTYPE)) {
+
+  Q_PUSH(F_LEVEL, 0, NULL);
+
+  /* a primary, then the frame it completes */
+primary:
+  if (CURTYPE == OP_NUMBER || op_isConst(CURTYPE) || op_isVar(CURTYPE) ||
+      CURTYPE == OP_PARAM) {
     Q_APPEND(CURTOKEN);
     Q_NEXT();
-    return 0;
+    goto operand;
+  }
+  if (CURTYPE == OP_NAME) {
+    if (CURVALUE < 0) { /* to be bound, but not here */
+      const char * name = pex->src + pex->curoffs - 1;
+      size_t len;
+      for (len = 0; isalnum((unsigned char)name[len]); len++) /**/;
+      return expr_error(pex, "unknown identifier '%.*s'",
+                        (int)(len < 63 ? len : 63), name);
+    }
+    Q_APPEND(CURTOKEN); /* see expr_parse_names */
+    Q_NEXT();
+    goto operand;
+  }
+  if (op_hasTable(CURTYPE)) {
+    Q_ADVANCE(&tmp);
+    Q_REQUIRE(OP_OPEN);
+    Q(expr_table(pex, &tmp));
+    Q_PUSH(F_FUNC, 0, &tmp);
+    Q_PUSH(F_LEVEL, 0, NULL);
+    goto primary;
   }
-  if (op_isFunc(CURTYPE)) {
-    int argc = 0;
+  if (op_isFunc(CURTYPE) || CURTYPE == OP_CALL) {
+    if (CURTYPE == OP_CALL) Q(expr_callable(pex));
     Q_ADVANCE(&tmp);
     Q_REQUIRE(OP_OPEN);
     if (CURTYPE != OP_CLOSE) {
-      Q_PARSE_LEVEL(0);
-      argc++;
-      while (CURTYPE == OP_COMMA) {
-        Q_NEXT();
-        Q_PARSE_LEVEL(0);
-        argc++;
-      }
+      Q_PUSH(F_FUNC, 0, &tmp);
+      Q_PUSH(F_LEVEL, 0, NULL);
+      goto primary;
     }
     Q_REQUIRE(OP_CLOSE);
-
-    if (argc != op_argc(tmp.type))
-      return expr_error(pex, "function takes %d args, found %d",
-                        op_argc(tmp.type), argc);
-    Q_APPEND(&tmp);
-    return 0;
+    Q(expr_arity(pex, &tmp, 0));
+    Q(expr_call(pex, &tmp, (size_t)(pex->dstp - pex->dst), 0));
+    goto operand;
   }
   if (CURTYPE == OP_OPEN) {
     Q_NEXT();
-    Q_PARSE_LEVEL(0);
-    Q_REQUIRE(OP_CLOSE);
-    return 0;
+    Q_PUSH(F_PAREN, 0, NULL);
+    Q_PUSH(F_LEVEL, 0, NULL);
+    goto primary;
   }
   if (CURTYPE == OP_LOGNOT || CURTYPE == OP_BITNOT ||
       CURTYPE == OP_ADD || CURTYPE == OP_SUB) {
     Q_ADVANCE(&tmp);
     if      (tmp.type == OP_ADD) tmp.type = OP_POS;
     else if (tmp.type == OP_SUB) tmp.type = OP_NEG;
-    Q_PARSE_PRIMARY();
-    Q_APPEND(&tmp);
-    return 0;
+    Q_PUSH(F_UNARY, 0, &tmp);
+    goto primary;
   }
   return expr_error(pex, "unexpected '%s'", op_name(CURTYPE));
+
+operand:
+  top = &(pex->frames[pex->nframes - 1]);
+  switch (top->kind) {
+    case F_LEVEL:
+      if (op_isOper(CURTYPE) && op_argc(CURTYPE) >= 2 &&
+          op_prec(CURTYPE) >= top->n) {
+        Q_ADVANCE(&tmp);
+        if (tmp.type == OP_COND) {
+          Q_PUSH(F_COND, 0, &tmp);
+          Q_PUSH(F_LEVEL, 0, NULL);
+        } else {
+          Q_PUSH(F_BINOP, 0, &tmp);
+          /* all binops are left-assoc */
+          Q_PUSH(F_LEVEL, op_prec(tmp.type) + 1, NULL);
+        }
+        goto primary;
+      }
+      if (--pex->nframes == 0) return 0;
+      goto operand;
+    case F_COND:
+      Q_REQUIRE(OP_COLON);
+      top->kind = F_COLON;
+      Q_PUSH(F_LEVEL, op_prec(OP_COND), NULL);
+      goto primary;
+    case F_FUNC:
+      top->n++;
+      if (CURTYPE == OP_COMMA) {
+        Q_NEXT();
+        Q_PUSH(F_LEVEL, 0, NULL);
+        goto primary;
+      }
+      Q_REQUIRE(OP_CLOSE);
+      Q(expr_arity(pex, &(top->tk), top->n));
+      Q(expr_call(pex, &(top->tk), top->at, top->n));
+      pex->nframes--;
+      goto operand;
+    case F_PAREN:
+      Q_REQUIRE(OP_CLOSE);
+      pex->nframes--;
+      goto operand;
+    default: /* F_BINOP, F_COLON, F_UNARY */
+      break;
+  }
+  Q_APPEND(&(top->tk));
+  pex->nframes--;
+  goto operand;
 }
 
-/* level(n) : primary
- *          | level(n) op(n) level(n+1)
- *          | level(n) "?" level(0) ":" level("?") ;
+/* name = level(0) ; with the name at the current token. The code
+ * of level(0) moves out of dst to the binding, and the name is bound
+ * before the ';' is passed, since the token after it may be the name.
  */
 static int
-expr_prec_level(EXPRSTATE * pex, int prec)
+expr_parse_bind(EXPRSTATE * pex)
 {
-  OPCODE tmp;
-  Q_PARSE_PRIMARY();
-  while (op_isOper(CURTYPE) && op_argc(CURTYPE) >= 2 && op_prec(CURTYPE) >= prec) {
-    Q_ADVANCE(&tmp);
-    if (tmp.type == OP_COND) {
-      Q_PARSE_LEVEL(0);
-      Q_REQUIRE(OP_COLON);
-      Q_PARSE_LEVEL(op_prec(tmp.type));
+  const char * name = pex->src + pex->curoffs - 1;
+  size_t len, start = (size_t)(pex->dstp - pex->dst);
+
+  Q_NEXT();
+  Q_REQUIRE(OP_ASSIGN);
+  Q(expr_prec_parse(pex));
+  for (len = 0; isalnum((unsigned char)name[len]); len++) /**/;
+  Q(expr_bind(pex, name, len, start, (size_t)(pex->dstp - pex->dst)));
+  pex->dstp = pex->dst + start;
+  Q_REQUIRE(OP_SEMI);
+  return 0;
+}
+
+/* A copy of the len opcodes at code, with each OP_NAME replaced by a
+ * load of the binding's slot or, if it has none, by its code, which
+ * is freed with its last use. Returns it, *outlen long, or NULL if
+ * out of mem.
+ */
+static OPCODE *
+expr_names_copy(EXPRSTATE * pex, const OPCODE * code, size_t len,
+                size_t * uses, const size_t * slots, size_t * outlen)
+{
+  OPCODE * res;
+  EXPRBIND * b;
+  size_t i, k, n;
+
+  for (n = i = 0; i < len; i++)
+    n += code[i].type == OP_NAME && !slots[(size_t)code[i].value] ?
+         pex->binds[(size_t)code[i].value].codelen : 1;
+  if (!(res = (OPCODE *)malloc(sizeof(OPCODE) * (n ? n : 1)))) return NULL;
+  for (n = i = 0; i < len; i++) {
+    if (code[i].type != OP_NAME) {
+      opcode_copy(&(res[n]), &(code[i]));
+      n++;
+      continue;
+    }
+    k = (size_t)code[i].value;
+    b = &(pex->binds[k]);
+    if (slots[k]) {
+      res[n].type = OP_LOAD;
+      res[n].value = (double)(slots[k] - 1);
+      n++;
     } else {
-      Q_PARSE_LEVEL(op_prec(tmp.type) + 1); /* all binops are left-assoc */
+      memcpy(res + n, b->code, sizeof(OPCODE) * b->codelen);
+      n += b->codelen;
+      if (--uses[k] == 0) {
+        free(b->code);
+        b->code = NULL;
+      }
     }
-    Q_APPEND(&tmp);
   }
-  return 0;
+  *outlen = n;
+  return res;
 }
 
-/* parse : level(0) EOF ;
+/* Resolve the OP_NAMEs of the bindings and of the body in dst, now
+ * that the uses of each binding are known. One used once, or whose
+ * code is a single opcode, is copied in place of its use. Any other
+ * is computed once, ahead of the body, into a slot of its own, which
+ * each use loads:
+ *
+ *   a STORE, b STORE THEN, ..., body THEN
+ *
+ * so that the code grows with the source, even for a chain of names,
+ * each used twice by the next, which copies would double at each link;
+ * expr_sink later moves each STORE into the arm its uses are in.
+ * A binding nothing uses is dropped.
  */
 static int
-expr_parse(const char * src, OPCODE * out, size_t outlen)
+expr_parse_names(EXPRSTATE * pex)
 {
-  EXPRSTATE pex0;
-#define pex  (&pex0)
-  tok_init(pex, src, out, outlen);
-  Q_NEXT();
-  Q_PARSE_LEVEL(0);
+  size_t n = pex->nbinds, len = (size_t)(pex->dstp - pex->dst);
+  size_t * uses, * slots, i, k, m, total, stored;
+  OPCODE * body = NULL, * code;
+  int rv = -1;
+
+  if (!n) return 0;
+  uses = (size_t *)calloc(2 * n, sizeof(size_t));
+  if (!uses) return -1; /* no error printing on out-of-mem */
+  slots = uses + n; /* each binding's slot + 1, or 0 */
+
+  /* a name only uses those bound before it */
+  for (i = 0; i < len; i++)
+    if (pex->dst[i].type == OP_NAME) uses[(size_t)pex->dst[i].value]++;
+  for (k = n; k--; )
+    for (i = 0; uses[k] && i < pex->binds[k].codelen; i++)
+      if (pex->binds[k].code[i].type == OP_NAME)
+        uses[(size_t)pex->binds[k].code[i].value]++;
+
+  for (total = stored = k = 0; k < n; k++) {
+    EXPRBIND * b = &(pex->binds[k]);
+    if (!uses[k]) continue;
+    code = expr_names_copy(pex, b->code, b->codelen, uses, slots, &m);
+    if (!code) goto done;
+    free(b->code);
+    b->code = code;
+    b->codelen = m;
+    if (uses[k] > 1 && m > 1) {
+      slots[k] = ++pex->nslots;
+      total += m + 2;
+      stored++;
+    }
+  }
+  if (!(body = expr_names_copy(pex, pex->dst, len, uses, slots, &m)))
+    goto done;
+
+  pex->dstp = pex->dst;
+  if (expr_reserve(pex, total + m + 1)) goto done;
+  for (i = k = 0; k < n; k++) {
+    if (!slots[k]) continue;
+    memcpy(pex->dstp, pex->binds[k].code, sizeof(OPCODE) * pex->binds[k].codelen);
+    pex->dstp += pex->binds[k].codelen;
+    pex->dstp->type = OP_STORE;
+    pex->dstp->value = (double)(slots[k] - 1);
+    pex->dstp++;
+    if (i++) {
+      pex->dstp->type = OP_THEN;
+      pex->dstp->value = 0.0;
+      pex->dstp++;
+    }
+  }
+  memcpy(pex->dstp, body, sizeof(OPCODE) * m);
+  pex->dstp += m;
+  if (stored) {
+    pex->dstp->type = OP_THEN;
+    pex->dstp->value = 0.0;
+    pex->dstp++;
+  }
+  rv = 0;
+done:
+  free(body);
+  free(uses);
+  return rv;
+}
+
+/* level(0) EOF, with the names it and the bindings use resolved.
+ */
+static int
+expr_parse_body(EXPRSTATE * pex)
+{
+  Q(expr_prec_parse(pex));
   Q_REQUIRE(OP_EOF);
+  Q(expr_parse_names(pex));
   Q_APPEND(CURTOKEN);
   return 0;
-#undef pex
+}
+
+/* parse : bind* level(0) EOF ;
+ * bind  : NAME '=' level(0) ';' ;
+ *
+ * The program is the code of the final level(0), after that of the
+ * bindings it uses; see expr_parse_names. *out may be
+ * reallocated to grow *outlen, even on failure, and *pool, *npool
+ * long, gets the tables, or NULL. The program may call the functions
+ * of lib; when it is the body of func, src is func's definition.
+ */
+static int
+expr_parse(const char * src, OPCODE ** out, size_t * outlen,
+           double ** pool, size_t * npool,
+           void (*handle)(const char *, void *), void * ctxt,
+           EXPR_LIB * lib, const EXPRFUNC * func)
+{
+  EXPRSTATE pex0;
+  int rv;
+  tok_init(&pex0, src, *out, *outlen);
+  pex0.handler = handle;
+  pex0.ctxt = ctxt;
+  pex0.lib = lib;
+  pex0.func = func;
+  if (func) pex0.srcp = func->body;
+  rv = tok_next(&pex0);
+  while (!rv && pex0.tok.type == OP_NAME && tok_assigns(pex0.srcp))
+    rv = expr_parse_bind(&pex0);
+  rv = rv || expr_parse_body(&pex0);
+  while (pex0.nbinds) free(pex0.binds[--pex0.nbinds].code);
+  free(pex0.frames);
+  free(pex0.binds);
+  *out = pex0.dst;
+  *outlen = pex0.dstlen;
+  *pool = pex0.pool;
+  *npool = pex0.npool;
+  return rv ? -1 : 0;
 }
 
 /* ********************************************************************** */
-/* Evaluator */
+/* Library */
 /* ********************************************************************** */
 
-int
-expr_eval(const EXPR * ex, double x, double * rv)
+/* Whether src is a definition, "name(a, b) = body": 0 if not, or else
+ * 1 + the number of parameters. If f is not NULL, its name, params
+ * (room for them all) and body are set to point into src.
+ */
+static int
+lib_header(const char * src, EXPRFUNC * f)
 {
-  OPCODE * op;
-  double * dst;
+  const char * s = src, * name;
+  size_t len;
+  int argc = 0;
 
-  if (!ex || !rv) return -1;
+#define SKIP()  while (*s && *s <= ' ') s++
+#define NAME()  do { \
+    if (!isalpha((unsigned char)*s)) return 0; \
+    for (name = s; isalnum((unsigned char)*s); s++) /**/; \
+    len = (size_t)(s - name); \
+    SKIP(); \
+  } while (0)
 
-  for (op = ex->code, dst = ex->stack;
-       op->type != OP_EOF;
-       op++, dst++) {
-    dst -= op_argc(op->type);
-    switch (op->type) {
-#undef COMMA
-#undef LIMIT
-#define zz  op->value
-#define aa  dst[0]
-#define bb  dst[1]
-#define cc  dst[2]
-#define SYMBOL(ENUM,PREC,TOK,ARGC,DOC,EVAL) case ENUM: dst[0]=(double)(EVAL); break;
-#include "expr-optab.inc"
+  SKIP();
+  NAME();
+  if (f) { f->name = name; f->len = len; }
+  if (*s++ != '(') return 0;
+  SKIP();
+  while (*s != ')') {
+    if (argc && *s++ != ',') return 0;
+    SKIP();
+    NAME();
+    if (f) { f->params[argc].name = name; f->params[argc].len = len; }
+    argc++;
+  }
+  s++;
+  SKIP();
+  if (tok_oper(s, &len) != OP_ASSIGN) return 0;
+  if (f) { f->body = s + len; f->argc = argc; }
+  return 1 + argc;
+#undef NAME
+#undef SKIP
+}
+
+/* Report what is wrong with the names of f, a definition to be added
+ * to lib. Returns -1 if anything is.
+ */
+static int
+lib_check(const EXPR_LIB * lib, const EXPRFUNC * f,
+          void (*handle)(const char *, void *), void * ctxt)
+{
+  EXPRSTATE pex0;
+  int i, rv = 0;
+
+  tok_init(&pex0, f->text, NULL, 0);
+  pex0.handler = handle;
+  pex0.ctxt = ctxt;
+  pex0.func = f;
+  pex0.curoffs = (size_t)(f->name - f->text) + 1;
+  if (tok_ident(f->name, f->len) != OP_EOF)
+    rv = expr_error(&pex0, "'%.*s' is built in", (int)f->len, f->name);
+  else if (lib_find(lib, f->name, f->len) != (size_t)-1)
+    rv = expr_error(&pex0, "'%.*s' is already defined", (int)f->len, f->name);
+  for (i = 0; i < f->argc; i++) {
+    const EXPRBIND * b = &(f->params[i]);
+    pex0.curoffs = (size_t)(b->name - f->text) + 1;
+    if (lib_param(f, b->name, b->len) < (size_t)i)
+      rv = expr_error(&pex0, "'%.*s' is already a parameter", (int)b->len, b->name);
+  }
+  return rv;
+}
+
+/* Compile the body of f, and of each function it calls first; see
+ * expr_callable.
+ */
+static void
+lib_compile(EXPR_LIB * lib, EXPRFUNC * f,
+            void (*handle)(const char *, void *), void * ctxt)
+{
+  size_t capacity = strlen(f->body) + 1;
+  OPCODE * code = (OPCODE *)malloc(sizeof(OPCODE) * capacity);
+
+  f->state = LIB_BUSY;
+  if (code && !expr_parse(f->text, &code, &capacity, &(f->pool), &(f->npool),
+                          handle, ctxt, lib, f)) {
+    for (f->codelen = 0; code[f->codelen].type != OP_EOF; f->codelen++) /**/;
+    f->nslots = expr_slots(code, f->codelen);
+    f->code = code;
+    f->state = LIB_DONE;
+    return;
+  }
+  if (code) free(code);
+  f->state = LIB_FAILED;
+}
+
+/* ********************************************************************** */
+/* Optimizer */
+/* ********************************************************************** */
+
+/* Apply one operator to its arguments.
+ * Used for folding; the evaluator has its own copy of this switch.
+ */
+static double
+expr_apply(const OPCODE * op, double x, const double * args)
+{
+  switch (op->type) {
+#undef COMMA
+#undef LIMIT
+#define zz  op->value
+#define slot(K)  x /* never folded */
+#define table(K)  ((const double *)NULL) /* never folded */
+#define aa  args[0]
+#define bb  args[1]
+#define cc  args[2]
+#define SYMBOL(ENUM,PREC,TOK,ARGC,DOC,EVAL) case ENUM: return (double)(EVAL);
+#include "expr-optab.inc"
+  }
+  return 0.0;
+}
+
+/* Fold every x-independent sub-expression into a single OP_NUMBER,
+ * and drop the arms of ?:, &&, || and ?? that a constant decides. A
+ * slot stored a constant is dropped, with each load of it replaced by
+ * the constant, and so is the first argument of OP_THEN, once that is
+ * a number. The code is rewritten in place.
+ * Returns the number of opcodes removed.
+ */
+static size_t
+expr_optimize(OPCODE * code)
+{
+  size_t * starts; /* start index in the output of each stack value */
+  double * slots;  /* the constant stored in each slot, or NAN */
+  size_t in, out, sp, len, nslots;
+
+  for (len = 0; code[len].type != OP_EOF; len++) /**/;
+  nslots = expr_slots(code, len);
+  starts = (size_t *)malloc(sizeof(size_t) * (len + 1));
+  slots = (double *)malloc(sizeof(double) * (nslots + 1));
+  if (!starts || !slots) { /* nothing is folded */
+    free(starts);
+    free(slots);
+    return 0;
+  }
+  for (in = 0; in < nslots; in++) slots[in] = NAN;
+
+  for (in = out = sp = 0; in < len; in++) {
+    OPCODE op;
+    size_t arg[4]; /* argument starts, then the end of the last one */
+    int argc = op_argc(code[in].type);
+    int i, isconst;
+    double args[3];
+
+    if (code[in].type == OP_LOAD && !isnan(slots[(size_t)code[in].value])) {
+      code[in].value = slots[(size_t)code[in].value];
+      code[in].type = OP_NUMBER;
+    }
+    isconst = (code[in].type != OP_X && code[in].type != OP_LOAD &&
+               !op_hasTable(code[in].type));
+
+    opcode_copy(&op, &(code[in]));
+    sp -= (size_t)argc;
+    for (i = 0; i < argc; i++) {
+      arg[i] = starts[sp + (size_t)i];
+      if (isconst && code[arg[i]].type == OP_NUMBER &&
+          arg[i] + 1 == (i + 1 < argc ? starts[sp + (size_t)i + 1] : out)) {
+        args[i] = code[arg[i]].value;
+      } else {
+        isconst = 0;
+      }
+    }
+    arg[argc] = out;
+    starts[sp++] = argc ? arg[0] : out;
+
+    if (isconst) {
+      if (op.type == OP_STORE && !isnan(args[0]))
+        slots[(size_t)op.value] = args[0];
+      else if (op.type == OP_STORE) /* NAN can't mark it; keep the store */
+        isconst = 0;
+    }
+    if (isconst) {
+      if (op.type != OP_NUMBER) {
+        op.value = expr_apply(&op, 0.0, args);
+        op.type = OP_NUMBER;
+      }
+      out = argc ? arg[0] : out;
+      opcode_copy(&(code[out]), &op);
+      out++;
+      continue;
+    }
+
+    /* the first argument alone may decide which argument survives */
+    if (argc >= 2 && code[arg[0]].type == OP_NUMBER && arg[0] + 1 == arg[1]) {
+      double v = code[arg[0]].value;
+      int keep = -1;
+      switch (op.type) {
+        case OP_COND:   keep = v ? 1 : 2; break;
+        case OP_LOGAND: keep = !v ? 0 : 1; break;
+        case OP_LOGOR:  keep = !!v ? 0 : 1; break;
+        case OP_COAL:   keep = !isnan(v) ? 0 : 1; break;
+        case OP_THEN:   keep = 1; break;
+        default: break;
+      }
+      if (keep >= 0) {
+        size_t n = arg[keep + 1] - arg[keep];
+        memmove(&(code[arg[0]]), &(code[arg[keep]]), sizeof(OPCODE) * n);
+        out = arg[0] + n;
+        continue;
+      }
+    }
+    opcode_copy(&(code[out]), &op);
+    out++;
+  }
+  opcode_copy(&(code[out]), &(code[len]));
+  free(starts);
+  free(slots);
+  return len - out;
+}
+
+/* ********************************************************************** */
+
+/* A program as a tree, or with hash-consing a DAG: one node per
+ * opcode, arguments by index.
+ */
+typedef struct expr_dagnode_s {
+  expr_oper_t type;
+  double      value;
+  size_t      kids[3]; /* the nodes of the arguments */
+} DAGNODE;
+
+/* Strength reduction.
+ *
+ * Each rule looks at one operator and at most two of its arguments:
+ * one which must be a number (any number, if k is NAN), and one which
+ * must be a given operator. The first rule to match rewrites the
+ * node, and the rules are tried again until none match.
+ *
+ * Some rewrites round differently in the last bit (a/k to a*(1/k))
+ * or differ at signed zeros and infinities (pow(a,.5) to sqrt(a));
+ * all stay within approx(). EXPR_EXACT skips the pass, and the fma
+ * rules, whose rounding depends on the CPU, only run with EXPR_FMA.
+ */
+enum expr_rewrite_e {
+  RW_DROP,   /* the node becomes 'to' of the untested arguments */
+  RW_NONNEG, /* as RW_DROP, when the other argument can't be negative */
+  RW_PASS,   /* the node becomes its other argument */
+  RW_RECIP,  /* the node becomes 'to', with the number k replaced by 1/k */
+  RW_SCALE,  /* the node becomes to(other) * (1 / to(k)) */
+  RW_FMA     /* the node becomes fma(mul's arguments, other) */
+};
+
+#define RW_ANY  NAN
+
+static const struct expr_rule_s {
+  expr_oper_t op;   /* the operator to rewrite */
+  int         karg; /* the argument which must be a number, or -1 */
+  double      k;    /* its value, or RW_ANY */
+  int         farg; /* the argument which must be operator f, or -1 */
+  expr_oper_t f;
+  expr_oper_t to;   /* the new operator */
+  int         how;  /* RW_* */
+} expr_rules[] = {
+  { OP_POW,    1, 2.0,       -1, OP_EOF,  OP_SQUARE, RW_DROP   },
+  { OP_POW,    1, 0.5,       -1, OP_EOF,  OP_SQRT,   RW_DROP   },
+  { OP_POW,    1, 1.0 / 3.0, -1, OP_EOF,  OP_CBRT,   RW_NONNEG },
+  { OP_POW,    1, 1.0,       -1, OP_EOF,  OP_EOF,    RW_PASS   },
+  { OP_ROOT,   1, 2.0,       -1, OP_EOF,  OP_SQRT,   RW_DROP   },
+  { OP_ROOT,   1, 1.0,       -1, OP_EOF,  OP_EOF,    RW_PASS   },
+  { OP_LOG,    1, RW_ANY,    -1, OP_EOF,  OP_LN,     RW_SCALE  },
+  { OP_DIV,    1, RW_ANY,    -1, OP_EOF,  OP_MUL,    RW_RECIP  },
+  { OP_MUL,    0, 1.0,       -1, OP_EOF,  OP_EOF,    RW_PASS   },
+  { OP_MUL,    1, 1.0,       -1, OP_EOF,  OP_EOF,    RW_PASS   },
+  { OP_MUL,    0, -1.0,      -1, OP_EOF,  OP_NEG,    RW_DROP   },
+  { OP_MUL,    1, -1.0,      -1, OP_EOF,  OP_NEG,    RW_DROP   },
+  { OP_ADD,    0, 0.0,       -1, OP_EOF,  OP_EOF,    RW_PASS   },
+  { OP_ADD,    1, 0.0,       -1, OP_EOF,  OP_EOF,    RW_PASS   },
+  { OP_SUB,    1, 0.0,       -1, OP_EOF,  OP_EOF,    RW_PASS   },
+  { OP_POS,   -1, 0.0,       -1, OP_EOF,  OP_EOF,    RW_PASS   },
+  { OP_ADD,   -1, 0.0,        0, OP_MUL,  OP_FMA,    RW_FMA    },
+  { OP_ADD,   -1, 0.0,        1, OP_MUL,  OP_FMA,    RW_FMA    },
+  { OP_EOF,   -1, 0.0,       -1, OP_EOF,  OP_EOF,    RW_PASS   }
+};
+
+/* Whether fma() runs in hardware; only then is a*b+c worth fusing.
+ */
+static int expr_fma = -1;
+
+static int
+expr_has_fma(void)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  __builtin_cpu_init();
+  return !!__builtin_cpu_supports("fma");
+#elif defined(__aarch64__) || defined(__ARM_FEATURE_FMA)
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/* Only what is obvious from the operator.
+ */
+static int
+rw_nonneg(const DAGNODE * n)
+{
+  switch (n->type) {
+    case OP_NUMBER: return n->value >= 0.0;
+    case OP_ABS: case OP_SQUARE: case OP_EXP: case OP_COSH: case OP_HYPOT:
+      return 1;
+    default: return 0;
+  }
+}
+
+/* Apply the rules to node i until none match.
+ * Returns the number of rewrites.
+ */
+static size_t
+rw_node(DAGNODE * nodes, size_t i, size_t * count, int flags)
+{
+  DAGNODE * n = &(nodes[i]);
+  const struct expr_rule_s * r;
+  size_t done = 0;
+
+again:
+  for (r = expr_rules; r->op != OP_EOF; r++) {
+    const DAGNODE * k, * f;
+    size_t other;
+    double kv;
+
+    /* only the kids of a matching operator are meaningful */
+    if (n->type != r->op) continue;
+    k = r->karg >= 0 ? &(nodes[n->kids[r->karg]]) : NULL;
+    f = r->farg >= 0 ? &(nodes[n->kids[r->farg]]) : NULL;
+    other = n->kids[r->karg >= 0 ? !r->karg : r->farg >= 0 ? !r->farg : 0];
+    if (k && (k->type != OP_NUMBER || (!isnan(r->k) && k->value != r->k)))
+      continue;
+    if (f && f->type != r->f) continue;
+    kv = k ? k->value : 0.0;
+
+    switch (r->how) {
+      case RW_NONNEG:
+        if (!rw_nonneg(&(nodes[other]))) continue;
+        /* fall through */
+      case RW_DROP:
+        n->type = r->to;
+        n->kids[0] = other;
+        break;
+      case RW_PASS:
+        memcpy(n, &(nodes[other]), sizeof(DAGNODE));
+        break;
+      case RW_RECIP:
+        n->type = r->to;
+        nodes[n->kids[r->karg]].value = 1.0 / kv;
+        break;
+      case RW_SCALE: {
+        size_t kn = n->kids[r->karg], m = (*count)++;
+        OPCODE op;
+        op.type = r->to;
+        op.value = 0.0;
+        nodes[m].type = r->to;
+        nodes[m].value = 0.0;
+        nodes[m].kids[0] = other;
+        nodes[kn].value = 1.0 / expr_apply(&op, 0.0, &kv);
+        n->type = OP_MUL;
+        n->kids[0] = m;
+        n->kids[1] = kn;
+        done += rw_node(nodes, m, count, flags);
+        break;
+      }
+      case RW_FMA:
+        if (!(flags & EXPR_FMA) || expr_fma != 1) continue;
+        n->type = r->to;
+        n->kids[2] = n->kids[!r->farg];
+        n->kids[0] = f->kids[0];
+        n->kids[1] = f->kids[1];
+        break;
+    }
+    done++;
+    goto again;
+  }
+  return done;
+}
+
+/* Rewrite the code in place. Only RW_SCALE makes it longer, by one
+ * opcode; if the result won't fit in capacity opcodes, the code is
+ * left alone.
+ * Returns the number of rewrites.
+ */
+static size_t
+expr_rewrite(OPCODE * code, size_t capacity, int flags)
+{
+  OPCODE * res = NULL;
+  DAGNODE * nodes;
+  size_t * stack;
+  size_t i, sp, len, count, done = 0;
+
+  for (len = 0; code[len].type != OP_EOF; len++) /**/;
+  nodes = (DAGNODE *)malloc(sizeof(DAGNODE) * (len * 2 + 1));
+  stack = (size_t *)malloc(sizeof(size_t) * (len * 2 + 1));
+  if (!nodes || !stack) goto done; /* the code keeps its operators */
+
+  /* the tree, in post-order, rewriting from the leaves up */
+  count = len;
+  for (i = sp = 0; i < len; i++) {
+    int argc = op_argc(code[i].type);
+    DAGNODE * n = &(nodes[i]);
+    n->type = code[i].type;
+    n->value = code[i].value;
+    n->kids[0] = n->kids[1] = n->kids[2] = 0;
+    sp -= (size_t)argc;
+    memcpy(n->kids, &(stack[sp]), sizeof(size_t) * (size_t)argc);
+    stack[sp++] = i;
+    done += rw_node(nodes, i, &count, flags);
+  }
+  if (!done) goto done;
+  res = (OPCODE *)malloc(sizeof(OPCODE) * count);
+  if (!res) { done = 0; goto done; }
+
+  /* back to RPN: walk down from the root, writing each node before
+   * its arguments, then reverse; stack[] holds the nodes to visit
+   */
+  sp = 0;
+  stack[sp++] = len - 1;
+  for (i = 0; sp; i++) {
+    DAGNODE * n = &(nodes[stack[--sp]]);
+    int argc = op_argc(n->type);
+    assert(i < count);
+    res[i].type = n->type;
+    res[i].value = n->value;
+    memcpy(&(stack[sp]), n->kids, sizeof(size_t) * (size_t)argc);
+    sp += (size_t)argc;
+  }
+  if (i >= capacity) { done = 0; goto done; }
+  for (len = 0; len < i; len++) opcode_copy(&(code[len]), &(res[i - 1 - len]));
+  code[i].type = OP_EOF;
+  code[i].value = 0.0;
+done:
+  free(res);
+  free(stack);
+  free(nodes);
+  return done;
+}
+
+/* Branches.
+ *
+ * ?:, &&, || and ?? are operators like the others, with every operand
+ * on the stack before they choose one: branch free, and what the
+ * vector kernels want. But when an operand that may not be needed
+ * costs a libm call, expr_branch_mark flags the operator (value 1),
+ * and after sharing expr_branch turns it into jumps around that
+ * operand:
+ *
+ *   c a b ?    becomes   c jfalse(L1) a jump(L2) L1: b L2:
+ *   a b &&     becomes   a jand(L) b L:    and likewise jor and jcoal
+ *
+ * A jump's value is the index of its target, always forward. Folding,
+ * rewriting and sharing all run on the code before, so only expr_depth
+ * and the evaluators ever see a jump.
+ */
+#define EXPR_BRANCH_COST 8
+
+/* Roughly, in vector operations; everything else is a call.
+ */
+static size_t
+op_cost(expr_oper_t type)
+{
+  if (!op_argc(type)) return 0;
+  switch (type) {
+    case OP_POS: case OP_NEG: case OP_ABS: case OP_SIGN: case OP_SQUARE:
+    case OP_SQRT: case OP_D2R: case OP_R2D: case OP_FLOOR: case OP_CEIL:
+    case OP_ROUND: case OP_ISNAN: case OP_ISFINITE: case OP_ISINF:
+    case OP_LOGNOT: case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+    case OP_FMA: case OP_MIN: case OP_MAX: case OP_LT: case OP_GT:
+    case OP_LE: case OP_GE: case OP_EQ: case OP_NE: case OP_LOGAND:
+    case OP_LOGOR: case OP_COAL: case OP_COND: case OP_CLAMP:
+    case OP_LERP: case OP_UNLERP: case OP_STORE: case OP_THEN:
+      return 1;
+    default:
+      return EXPR_BRANCH_COST;
+  }
+}
+
+/* Whether argument J of OPC is one expr_branch jumps around.
+ */
+#define branch_skips(OPC,J) \
+  ((J) > 0 && op_isBranch((OPC)->type) && (OPC)->value != 0.0)
+
+/* Flag the operators worth a branch, keeping those flagged already:
+ * the ?: of expr_dispatch.
+ */
+static void
+expr_branch_mark(OPCODE * code)
+{
+  size_t * cost; /* of each subtree on the stack */
+  size_t i, j, sp, len;
+
+  for (len = 0; code[len].type != OP_EOF; len++) /**/;
+  cost = (size_t *)malloc(sizeof(size_t) * (len + 1));
+  if (!cost) return; /* no new branches; expr_branch keeps the old ones */
+
+  for (i = sp = 0; i < len; i++) {
+    expr_oper_t type = code[i].type;
+    size_t argc = (size_t)op_argc(type), c = op_cost(type), skip = 0;
+    sp -= argc;
+    for (j = 0; j < argc; j++) {
+      c += cost[sp + j];
+      if (j && cost[sp + j] > skip) skip = cost[sp + j];
+    }
+    if (op_isBranch(type))
+      code[i].value = code[i].value != 0.0 || skip >= EXPR_BRANCH_COST;
+    cost[sp++] = c;
+  }
+  free(cost);
+}
+
+/* Lower the flagged operators in place. Each ?: grows the code by an
+ * opcode; if the result won't fit in capacity opcodes, every operator
+ * is left as it is.
+ * Returns the number lowered.
+ */
+static size_t
+expr_branch(OPCODE * code, size_t capacity)
+{
+  OPCODE * res;
+  size_t * starts; /* the first opcode of each subtree */
+  size_t * jump;   /* the jump to insert before each opcode, or none */
+  size_t * to;     /* its target: jfalse's jump, the others' operator */
+  size_t * at;     /* the index of each opcode in res; removed, the next */
+  size_t * jat;    /* the index of each inserted jump in res */
+  size_t * stack;
+  size_t i, j, out, sp, len, done = 0;
+  const size_t none = (size_t)-1;
+
+  for (len = 0; code[len].type != OP_EOF; len++) /**/;
+  res = (OPCODE *)malloc(sizeof(OPCODE) * capacity);
+  starts = (size_t *)malloc(sizeof(size_t) * (len + 1) * 6);
+  if (!res || !starts) goto unmark;
+  jump = starts + len + 1;
+  to = jump + len + 1;
+  at = to + len + 1;
+  jat = at + len + 1;
+  stack = jat + len + 1;
+
+  for (i = 0; i <= len; i++) jump[i] = none;
+  for (i = sp = 0; i < len; i++) {
+    expr_oper_t type = code[i].type;
+    size_t argc = (size_t)op_argc(type);
+    sp -= argc;
+    starts[i] = argc ? starts[stack[sp]] : i;
+    if (branch_skips(&(code[i]), 1)) {
+      size_t a = starts[stack[sp + 1]];
+      assert(jump[a] == none);
+      switch (type) {
+        case OP_COND:
+          j = starts[stack[sp + 2]];
+          assert(jump[j] == none);
+          jump[a] = OP_JFALSE;
+          to[a] = j;
+          jump[j] = OP_JUMP;
+          to[j] = i;
+          break;
+        case OP_LOGAND: jump[a] = OP_JAND; to[a] = i; break;
+        case OP_LOGOR:  jump[a] = OP_JOR;  to[a] = i; break;
+        default:        jump[a] = OP_JCOAL; to[a] = i; break;
+      }
+      done++;
+    }
+    stack[sp++] = i;
+  }
+  if (!done) goto unmark;
+
+  for (i = out = 0; i < len; i++) {
+    if (jump[i] != none) jat[i] = out++;
+    at[i] = out;
+    if (!branch_skips(&(code[i]), 1)) out++;
+  }
+  at[len] = out;
+  if (out >= capacity) { done = 0; goto unmark; }
+
+  for (i = 0; i < len; i++) {
+    if (jump[i] != none) {
+      res[jat[i]].type = (expr_oper_t)jump[i];
+      res[jat[i]].value = (double)(jump[i] == OP_JFALSE ? jat[to[i]] + 1
+                                                        : at[to[i]]);
+    }
+    if (!branch_skips(&(code[i]), 1)) opcode_copy(&(res[at[i]]), &(code[i]));
+  }
+  opcode_copy(&(res[out]), &(code[len]));
+  memcpy(code, res, sizeof(OPCODE) * (out + 1));
+  goto freeall;
+
+unmark:
+  for (i = 0; i < len; i++)
+    if (op_isBranch(code[i].type)) code[i].value = 0.0;
+freeall:
+  free(res);
+  free(starts);
+  return done;
+}
+
+/* Bindings in their arms.
+ *
+ * expr_parse_names computes each binding used more than once ahead of
+ * the body, as a STORE whose value THEN drops, so that it would run on
+ * every sample even where its only uses sit in an arm of ?:, &&, ||
+ * or ?? that expr_branch jumps around. Each such STORE, the last first
+ * since a binding only uses those before it, moves to its first use,
+ * in place of the LOAD there, when every other use follows it in the
+ * same region, as expr_share's regions go; otherwise to the start of
+ * the innermost region around all its uses, as (code STORE) region
+ * THEN. Any operand a jump may skip counts as a region here, whether
+ * or not expr_branch_mark, which runs next and costs the arm with the
+ * binding in it, flags it; a narrower region only makes the placement
+ * safer. A STORE left where it was is fine too, as it runs first.
+ */
+static void
+expr_sink(OPCODE * code)
+{
+  OPCODE * res;
+  size_t * parent, * starts, * reg, * depth, * stack, * argno;
+  unsigned char * drop, * done;
+  size_t i, j, k, r, a, b, s, len, out, sp, first, nslots;
+  const size_t none = (size_t)-1;
+
+  for (len = 0; code[len].type != OP_EOF; len++) /**/;
+  nslots = expr_slots(code, len);
+  if (!len || !nslots) return;
+  res = (OPCODE *)malloc(sizeof(OPCODE) * (len + 1));
+  parent = (size_t *)malloc(sizeof(size_t) * (len + 1) * 6);
+  drop = (unsigned char *)calloc(len + 1 + nslots, 1);
+  if (!res || !parent || !drop) goto done; /* the bindings run first */
+  starts = parent + len + 1;
+  reg = starts + len + 1;
+  depth = reg + len + 1;
+  stack = depth + len + 1;
+  argno = stack + len + 1;
+  done = drop + len + 1;
+
+  for (;;) {
+    for (i = sp = 0; i < len; i++) {
+      size_t argc = (size_t)op_argc(code[i].type);
+      sp -= argc;
+      for (j = 0; j < argc; j++) {
+        parent[stack[sp + j]] = i;
+        argno[stack[sp + j]] = j;
+      }
+      starts[i] = argc ? starts[stack[sp]] : i;
+      stack[sp++] = i;
+    }
+    /* top-down: the innermost region around each node, the depth of
+     * each region's root, and whether each value is dropped by THEN */
+    for (i = len; i--; ) {
+      if (i == len - 1) {
+        reg[i] = i;
+        depth[i] = 0;
+        drop[i] = 0;
+        continue;
+      }
+      r = parent[i];
+      if (argno[i] && op_isBranch(code[r].type)) {
+        reg[i] = i;
+        depth[i] = depth[reg[r]] + 1;
+      } else
+        reg[i] = reg[r];
+      drop[i] = code[r].type == OP_THEN && (!argno[i] || drop[r]);
+    }
+
+    for (i = len; i--; )
+      if (code[i].type == OP_STORE && drop[i] && !done[(size_t)code[i].value])
+        break;
+    if (i == (size_t)-1) break;
+    s = (size_t)code[i].value;
+    done[s] = 1;
+
+    /* the innermost region around the uses, r, and the first use */
+    r = first = none;
+    for (j = i + 1; j < len; j++) {
+      if (code[j].type != OP_LOAD || (size_t)code[j].value != s) continue;
+      if (first == none) {
+        first = j;
+        r = reg[j];
+        continue;
+      }
+      for (a = r, b = reg[j]; a != b; ) {
+        if (depth[a] >= depth[b]) a = reg[parent[a]];
+        else b = reg[parent[b]];
+      }
+      r = a;
+    }
+    if (first == none) continue;
+    for (a = r; depth[a] > depth[reg[i]]; a = reg[parent[a]]) /**/;
+    if (a != reg[i] || (r == reg[i] && reg[first] != r)) continue;
+
+    /* the STORE's subtree and the THEN dropping it go; it comes back
+     * at the first use or around the region */
+    for (k = out = 0; k < len; k++) {
+      if ((k >= starts[i] && k <= i) || k == parent[i]) continue;
+      if (reg[first] == r ? k == first : k == starts[r]) {
+        memcpy(res + out, code + starts[i], sizeof(OPCODE) * (i + 1 - starts[i]));
+        out += i + 1 - starts[i];
+        if (k == first) continue;
+      }
+      opcode_copy(&(res[out]), &(code[k]));
+      out++;
+      if (reg[first] != r && k == r) {
+        res[out].type = OP_THEN;
+        res[out].value = 0.0;
+        out++;
+      }
+    }
+    assert(out == len || out == len - 2);
+    opcode_copy(&(res[out]), &(code[len]));
+    memcpy(code, res, sizeof(OPCODE) * (out + 1));
+    len = out;
+  }
+done:
+  free(res);
+  free(parent);
+  free(drop);
+}
+
+/* Common subexpressions.
+ *
+ * The RPN is read as a DAG, hash-consing identical nodes: a node's
+ * key is its operator, its value if it is a number, and the nodes of
+ * its arguments, so equal subtrees map to one node however deep they
+ * are. Each non-leaf node reached from more than one place gets a
+ * slot. Its first occurrence is followed by OP_STORE, which keeps the
+ * value on the stack, and every later occurrence is replaced, whole
+ * subtree and all, by OP_LOAD.
+ *
+ * An operand a jump may skip (see expr_branch) is a region of its
+ * own: a repeat outside the region of the first occurrence can't load
+ * what may never have been stored, so it becomes the first occurrence
+ * for those after it.
+ *
+ * The code is rewritten through a copy, since a store may run ahead
+ * of the input; the output is never longer, since each OP_STORE
+ * pairs with at least one subtree of two or more opcodes replaced by
+ * a single OP_LOAD. Slots the code uses already, for its bindings,
+ * are kept, and the new ones come after them.
+ * Returns the number of slots; *shared is set to the number of
+ * opcodes no longer evaluated, that is, replaced by loads.
+ */
+#define dag_hasValue(OP)  ((OP) == OP_NUMBER || (OP) == OP_LOAD || \
+                           (OP) == OP_STORE || op_hasTable(OP))
+
+static unsigned long
+dag_hash(const DAGNODE * n)
+{
+  unsigned long h = (unsigned long)n->type * 0x9E3779B1UL;
+  size_t i;
+  if (dag_hasValue(n->type)) {
+    unsigned char b[sizeof(double)];
+    memcpy(b, &(n->value), sizeof(b));
+    for (i = 0; i < sizeof(b); i++) h = (h ^ b[i]) * 0x01000193UL;
+  }
+  for (i = 0; i < (size_t)op_argc(n->type); i++)
+    h = (h ^ (unsigned long)n->kids[i]) * 0x01000193UL;
+  return h;
+}
+
+static int
+dag_same(const DAGNODE * a, const DAGNODE * b)
+{
+  size_t i;
+  if (a->type != b->type) return 0;
+  if (dag_hasValue(a->type) && memcmp(&(a->value), &(b->value), sizeof(double)))
+    return 0;
+  for (i = 0; i < (size_t)op_argc(a->type); i++)
+    if (a->kids[i] != b->kids[i]) return 0;
+  return 1;
+}
+
+static size_t
+expr_share(OPCODE * code, size_t * shared)
+{
+  OPCODE * res;
+  DAGNODE * nodes;
+  size_t * canon;  /* the first node equal to each node */
+  size_t * starts; /* the first opcode of each node's subtree */
+  size_t * refs;   /* uses of each canonical node, then its slot + 1 */
+  size_t * outer;  /* the last replaced subtree starting at each opcode */
+  size_t * parent; /* the node each node is an argument of */
+  size_t * rend;   /* the root of the innermost region around each node */
+  size_t * table, * stack;
+  size_t i, j, out, sp, len, mask, base, nslots;
+  const size_t none = (size_t)-1;
+
+  *shared = 0;
+  for (len = 0; code[len].type != OP_EOF; len++) /**/;
+  nslots = base = expr_slots(code, len);
+  for (mask = 1; mask < len * 2; mask <<= 1) /**/;
+  res = (OPCODE *)malloc(sizeof(OPCODE) * (len + 1));
+  nodes = (DAGNODE *)malloc(sizeof(DAGNODE) * (len + 1));
+  canon = (size_t *)malloc(sizeof(size_t) * (len + 1) * 7 + sizeof(size_t) * mask);
+  if (!res || !nodes || !canon) goto done; /* common subtrees run each time */
+  starts = canon + len + 1;
+  refs = starts + len + 1;
+  outer = refs + len + 1;
+  parent = outer + len + 1;
+  rend = parent + len + 1;
+  stack = rend + len + 1;
+  table = stack + len + 1;
+  mask--;
+
+  /* the regions, top-down; the root is in none */
+  for (i = sp = 0; i < len; i++) {
+    int argc = op_argc(code[i].type);
+    sp -= (size_t)argc;
+    for (j = 0; j < (size_t)argc; j++) {
+      parent[stack[sp + j]] = i;
+      rend[stack[sp + j]] = branch_skips(&(code[i]), j) ? stack[sp + j] : none;
+    }
+    starts[i] = argc ? starts[stack[sp]] : i;
+    stack[sp++] = i;
+  }
+  rend[len - 1] = len;
+  for (i = len - 1; i--; )
+    if (rend[i] == none) rend[i] = rend[parent[i]];
+
+  for (i = 0; i <= mask; i++) table[i] = none;
+  for (i = sp = 0; i < len; i++) {
+    int argc = op_argc(code[i].type);
+    DAGNODE * n = &(nodes[i]);
+    n->type = code[i].type;
+    n->value = code[i].value;
+    n->kids[0] = n->kids[1] = n->kids[2] = 0;
+    sp -= (size_t)argc;
+    for (j = 0; j < (size_t)argc; j++) n->kids[j] = canon[stack[sp + j]];
+    stack[sp++] = i;
+
+    for (j = dag_hash(n) & mask; table[j] != none; j = (j + 1) & mask)
+      if (dag_same(&(nodes[table[j]]), n)) break;
+    if (table[j] == none || i > rend[table[j]]) table[j] = i;
+    canon[i] = table[j];
+    refs[i] = 0;
+    outer[i] = none;
+  }
+
+  /* only edges from canonical nodes count; the others are copies */
+  for (i = 0; i < len; i++) {
+    if (canon[i] != i) continue;
+    for (j = 0; j < (size_t)op_argc(nodes[i].type); j++) refs[nodes[i].kids[j]]++;
+  }
+  for (i = 0; i < len; i++) {
+    if (canon[i] != i) continue;
+    refs[i] = (refs[i] >= 2 && op_argc(nodes[i].type)) ? ++nslots : 0;
+  }
+  if (nslots == base) goto done;
+
+  for (i = 0; i < len; i++)
+    if (canon[i] != i && refs[canon[i]]) outer[starts[i]] = i;
+
+  for (i = out = 0; i < len; ) {
+    if (outer[i] != none) {
+      res[out].type = OP_LOAD;
+      res[out].value = (double)(refs[canon[outer[i]]] - 1);
+      out++;
+      *shared += outer[i] + 1 - i;
+      i = outer[i] + 1;
+      continue;
+    }
+    opcode_copy(&(res[out]), &(code[i]));
+    out++;
+    if (canon[i] == i && refs[i]) {
+      res[out].type = OP_STORE;
+      res[out].value = (double)(refs[i] - 1);
+      out++;
+    }
+    i++;
+  }
+  assert(out <= len);
+  opcode_copy(&(res[out]), &(code[len]));
+  memcpy(code, res, sizeof(OPCODE) * (out + 1));
+done:
+  free(res);
+  free(nodes);
+  free(canon);
+  return nslots;
+}
+
+/* The maximum number of values the program keeps on the stack.
+ */
+static size_t
+expr_depth(const OPCODE * code)
+{
+  size_t depth = 0, max = 1;
+  for (; code->type != OP_EOF; code++) {
+    depth -= (size_t)op_argc(code->type);
+    if (op_pushes(code->type) && ++depth > max) max = depth;
+  }
+  return max;
+}
+
+/* ********************************************************************** */
+/* Bytecode */
+/* ********************************************************************** */
+
+/* The compiler works on OPCODEs; the program it keeps is one byte per
+ * opcode. An opcode with a value is followed by it: OP_NUMBER by the
+ * index of the number in the program's pool of distinct values,
+ * OP_LOAD and OP_STORE by the slot, and OP_LUT and OP_LUTC by the
+ * offset of their table in the pool, all as unsigned base-128
+ * varints, low bits first; a jump by the offset of its target in the
+ * bytecode, as four bytes, low first, so that an offset never changes
+ * the offsets before it. A typical program takes a tenth of the memory
+ * its OPCODEs did, and a long one stays in the cache.
+ */
+#define op_hasValue(OP)  ((OP) == OP_NUMBER || (OP) == OP_LOAD || \
+                          (OP) == OP_STORE || op_hasTable(OP) || op_isJump(OP))
+
+#define BC_JUMPLEN  4
+
+typedef char bc_fits_byte[_OP_MAX < 256 ? 1 : -1];
+
+/* The length of the varint for i.
+ */
+static size_t
+bc_indexlen(size_t i)
+{
+  size_t len = 1;
+  while (i >>= 7) len++;
+  return len;
+}
+
+static unsigned char *
+bc_put_index(unsigned char * p, size_t i)
+{
+  for (; i >= 0x80; i >>= 7) *p++ = (unsigned char)(i | 0x80);
+  *p++ = (unsigned char)i;
+  return p;
+}
+
+/* Read the varint at *pp, and step past it.
+ */
+static size_t
+bc_index(const unsigned char ** pp)
+{
+  const unsigned char * p = *pp;
+  size_t i = 0;
+  int shift = 0;
+  if (*p < 0x80) { /* most are */
+    *pp = p + 1;
+    return *p;
+  }
+  do {
+    i |= (size_t)(*p & 0x7F) << shift;
+    shift += 7;
+  } while (*p++ & 0x80);
+  *pp = p;
+  return i;
+}
+
+/* The value of an opcode of this type at *pp, and step past it.
+ */
+static double
+bc_value(const EXPR * ex, expr_oper_t type, const unsigned char ** pp)
+{
+  const unsigned char * p = *pp;
+  if (type == OP_NUMBER) return ex->pool[bc_index(pp)];
+  if (!op_isJump(type)) return (double)bc_index(pp);
+  *pp = p + BC_JUMPLEN;
+  return (double)((unsigned long)p[0] | (unsigned long)p[1] << 8 |
+                  (unsigned long)p[2] << 16 | (unsigned long)p[3] << 24);
+}
+
+/* A double's bits, for hashing and comparing the pool.
+ */
+static unsigned long long
+bc_bits(double v)
+{
+  unsigned long long u;
+  memcpy(&u, &v, sizeof(u));
+  return u;
+}
+
+/* Lay out code: at[i] is the offset of opcode i, idx[i] the pool
+ * index of an OP_NUMBER, or of the table of an OP_LUT or OP_LUTC,
+ * found at its value among the ntables doubles of tables. pool gets
+ * those tables, in order of first use, then each distinct number
+ * once, bit for bit, in order of first use. Returns the bytecode
+ * length, or 0 when out of memory; pool must hold len values and
+ * the tables.
+ */
+static size_t
+expr_pack_layout(const OPCODE * code, size_t len,
+                 const double * tables, size_t ntables,
+                 size_t * at, size_t * idx, double * pool, size_t * npool)
+{
+  size_t * table, mask, i, h, off = 0;
+
+  *npool = 0;
+  if (ntables) {
+    size_t * moved = (size_t *)malloc(sizeof(size_t) * ntables);
+    if (!moved) return 0;
+    memset(moved, 0xFF, sizeof(size_t) * ntables);
+    for (i = 0; i < len; i++) {
+      size_t t = (size_t)code[i].value;
+      if (!op_hasTable(code[i].type)) continue;
+      if (moved[t] == (size_t)-1) {
+        moved[t] = *npool;
+        memcpy(pool + *npool, tables + t, sizeof(double) * ((size_t)tables[t] + 1));
+        *npool += (size_t)tables[t] + 1;
+      }
+      idx[i] = moved[t];
+    }
+    free(moved);
+  }
+
+  for (mask = 1; mask < len * 2; mask <<= 1) /**/;
+  table = (size_t *)malloc(sizeof(size_t) * mask);
+  if (!table) return 0;
+  memset(table, 0xFF, sizeof(size_t) * mask);
+  mask--;
+
+  for (i = 0; i < len; i++) {
+    expr_oper_t type = code[i].type;
+    at[i] = off++;
+    if (type == OP_NUMBER) {
+      unsigned long long u = bc_bits(code[i].value);
+      for (h = (size_t)((u ^ (u >> 29)) * 0x9E3779B97F4A7C15ull >> 7) & mask;
+           table[h] != (size_t)-1 && bc_bits(pool[table[h]]) != u;
+           h = (h + 1) & mask) /**/;
+      if (table[h] == (size_t)-1) {
+        table[h] = *npool;
+        pool[(*npool)++] = code[i].value;
+      }
+      idx[i] = table[h];
+      off += bc_indexlen(idx[i]);
+    } else if (op_hasTable(type)) {
+      off += bc_indexlen(idx[i]);
+    } else if (op_isJump(type)) {
+      off += BC_JUMPLEN;
+    } else if (op_hasValue(type)) {
+      off += bc_indexlen((size_t)code[i].value);
+    }
+  }
+  at[len] = off++;
+  free(table);
+  return off;
+}
+
+/* Write the bytecode laid out by expr_pack_layout.
+ */
+static void
+expr_pack(const OPCODE * code, size_t len,
+          const size_t * at, const size_t * idx, unsigned char * bc)
+{
+  size_t i;
+  for (i = 0; i <= len; i++) {
+    expr_oper_t type = code[i].type;
+    *bc++ = (unsigned char)type;
+    if (type == OP_NUMBER || op_hasTable(type)) {
+      bc = bc_put_index(bc, idx[i]);
+    } else if (op_isJump(type)) {
+      unsigned long t = (unsigned long)at[(size_t)code[i].value];
+      *bc++ = (unsigned char)t;
+      *bc++ = (unsigned char)(t >> 8);
+      *bc++ = (unsigned char)(t >> 16);
+      *bc++ = (unsigned char)(t >> 24);
+    } else if (op_hasValue(type)) {
+      bc = bc_put_index(bc, (size_t)code[i].value);
+    }
+  }
+}
+
+/* ********************************************************************** */
+/* SIMD */
+/* ********************************************************************** */
+
+/* The block evaluator hands each opcode to a SIMD kernel first, which
+ * runs it across the block two (SSE2) or four (AVX) doubles at a time,
+ * or four or eight floats for EXPR_FLOAT. Kernels only exist for
+ * operators that map onto vector instructions; everything else,
+ * notably the transcendentals, returns 0 and falls back to the scalar
+ * loop over the block.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    !defined(EXPR_NO_SIMD)
+#define EXPR_SIMD 1
+#include <immintrin.h>
+
+typedef int (*expr_simd_fn)(const OPCODE * op, double * dst, size_t len);
+typedef int (*expr_simdf_fn)(const OPCODE * op, float * dst, size_t len);
+
+/* SSE2 has no rounding instructions; round to an integer by adding
+ * and subtracting 2**52, then correct the direction.
+ */
+static __m128d __attribute__((target("sse2")))
+expr_trunc_sse2(__m128d a)
+{
+  __m128d sign = _mm_set1_pd(-0.0);
+  __m128d big = _mm_set1_pd(4503599627370496.0); /* 2**52 */
+  __m128d m = _mm_andnot_pd(sign, a);
+  __m128d n = _mm_sub_pd(_mm_add_pd(m, big), big);
+  __m128d small = _mm_cmplt_pd(m, big); /* false for NaN, Inf and integers */
+  n = _mm_sub_pd(n, _mm_and_pd(_mm_cmpgt_pd(n, m), _mm_set1_pd(1.0)));
+  n = _mm_or_pd(n, _mm_and_pd(a, sign));
+  return _mm_or_pd(_mm_and_pd(small, n), _mm_andnot_pd(small, a));
+}
+
+static __m128d __attribute__((target("sse2")))
+expr_floor_sse2(__m128d a)
+{
+  __m128d t = expr_trunc_sse2(a);
+  return _mm_sub_pd(t, _mm_and_pd(_mm_cmpgt_pd(t, a), _mm_set1_pd(1.0)));
+}
+
+static __m128d __attribute__((target("sse2")))
+expr_ceil_sse2(__m128d a)
+{
+  __m128d t = expr_trunc_sse2(a);
+  __m128d up = _mm_cmplt_pd(t, a);
+  return _mm_or_pd(_mm_and_pd(up, _mm_add_pd(t, _mm_set1_pd(1.0))),
+                   _mm_andnot_pd(up, t));
+}
+
+#define SIMD_FN(NAME)  NAME##_sse2
+#define SIMD_TARGET    __attribute__((target("sse2")))
+#define T              double
+#define V              __m128d
+#define W              2
+#define V_LOAD(P)      _mm_loadu_pd(P)
+#define V_STORE(P,A)   _mm_storeu_pd((P), (A))
+#define V_SET1(K)      _mm_set1_pd(K)
+#define V_ADD(A,B)     _mm_add_pd((A), (B))
+#define V_SUB(A,B)     _mm_sub_pd((A), (B))
+#define V_MUL(A,B)     _mm_mul_pd((A), (B))
+#define V_DIV(A,B)     _mm_div_pd((A), (B))
+#define V_SQRT(A)      _mm_sqrt_pd(A)
+#define V_MIN(A,B)     _mm_min_pd((A), (B))
+#define V_MAX(A,B)     _mm_max_pd((A), (B))
+#define V_AND(A,B)     _mm_and_pd((A), (B))
+#define V_ANDNOT(A,B)  _mm_andnot_pd((A), (B))
+#define V_OR(A,B)      _mm_or_pd((A), (B))
+#define V_XOR(A,B)     _mm_xor_pd((A), (B))
+#define V_LT(A,B)      _mm_cmplt_pd((A), (B))
+#define V_LE(A,B)      _mm_cmple_pd((A), (B))
+#define V_EQ(A,B)      _mm_cmpeq_pd((A), (B))
+#define V_NE(A,B)      _mm_cmpneq_pd((A), (B))
+#define V_ORD(A,B)     _mm_cmpord_pd((A), (B))
+#define V_UNORD(A,B)   _mm_cmpunord_pd((A), (B))
+#define V_BLEND(M,T,F) _mm_or_pd(_mm_and_pd((M), (T)), _mm_andnot_pd((M), (F)))
+#define V_TRUNC(A)     expr_trunc_sse2(A)
+#define V_FLOOR(A)     expr_floor_sse2(A)
+#define V_CEIL(A)      expr_ceil_sse2(A)
+#include "expr-simd.inc"
+
+/* The same, for floats, with 2**23.
+ */
+static __m128 __attribute__((target("sse2")))
+expr_trunc_sse2f(__m128 a)
+{
+  __m128 sign = _mm_set1_ps(-0.0f);
+  __m128 big = _mm_set1_ps(8388608.0f); /* 2**23 */
+  __m128 m = _mm_andnot_ps(sign, a);
+  __m128 n = _mm_sub_ps(_mm_add_ps(m, big), big);
+  __m128 small = _mm_cmplt_ps(m, big);
+  n = _mm_sub_ps(n, _mm_and_ps(_mm_cmpgt_ps(n, m), _mm_set1_ps(1.0f)));
+  n = _mm_or_ps(n, _mm_and_ps(a, sign));
+  return _mm_or_ps(_mm_and_ps(small, n), _mm_andnot_ps(small, a));
+}
+
+static __m128 __attribute__((target("sse2")))
+expr_floor_sse2f(__m128 a)
+{
+  __m128 t = expr_trunc_sse2f(a);
+  return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a), _mm_set1_ps(1.0f)));
+}
+
+static __m128 __attribute__((target("sse2")))
+expr_ceil_sse2f(__m128 a)
+{
+  __m128 t = expr_trunc_sse2f(a);
+  __m128 up = _mm_cmplt_ps(t, a);
+  return _mm_or_ps(_mm_and_ps(up, _mm_add_ps(t, _mm_set1_ps(1.0f))),
+                   _mm_andnot_ps(up, t));
+}
+
+#define SIMD_FN(NAME)  NAME##_sse2f
+#define SIMD_TARGET    __attribute__((target("sse2")))
+#define T              float
+#define V              __m128
+#define W              4
+#define V_LOAD(P)      _mm_loadu_ps(P)
+#define V_STORE(P,A)   _mm_storeu_ps((P), (A))
+#define V_SET1(K)      _mm_set1_ps((float)(K))
+#define V_ADD(A,B)     _mm_add_ps((A), (B))
+#define V_SUB(A,B)     _mm_sub_ps((A), (B))
+#define V_MUL(A,B)     _mm_mul_ps((A), (B))
+#define V_DIV(A,B)     _mm_div_ps((A), (B))
+#define V_SQRT(A)      _mm_sqrt_ps(A)
+#define V_MIN(A,B)     _mm_min_ps((A), (B))
+#define V_MAX(A,B)     _mm_max_ps((A), (B))
+#define V_AND(A,B)     _mm_and_ps((A), (B))
+#define V_ANDNOT(A,B)  _mm_andnot_ps((A), (B))
+#define V_OR(A,B)      _mm_or_ps((A), (B))
+#define V_XOR(A,B)     _mm_xor_ps((A), (B))
+#define V_LT(A,B)      _mm_cmplt_ps((A), (B))
+#define V_LE(A,B)      _mm_cmple_ps((A), (B))
+#define V_EQ(A,B)      _mm_cmpeq_ps((A), (B))
+#define V_NE(A,B)      _mm_cmpneq_ps((A), (B))
+#define V_ORD(A,B)     _mm_cmpord_ps((A), (B))
+#define V_UNORD(A,B)   _mm_cmpunord_ps((A), (B))
+#define V_BLEND(M,T,F) _mm_or_ps(_mm_and_ps((M), (T)), _mm_andnot_ps((M), (F)))
+#define V_TRUNC(A)     expr_trunc_sse2f(A)
+#define V_FLOOR(A)     expr_floor_sse2f(A)
+#define V_CEIL(A)      expr_ceil_sse2f(A)
+#include "expr-simd.inc"
+
+#define SIMD_FN(NAME)  NAME##_avx
+#define SIMD_TARGET    __attribute__((target("avx")))
+#define T              double
+#define V              __m256d
+#define W              4
+#define V_LOAD(P)      _mm256_loadu_pd(P)
+#define V_STORE(P,A)   _mm256_storeu_pd((P), (A))
+#define V_SET1(K)      _mm256_set1_pd(K)
+#define V_ADD(A,B)     _mm256_add_pd((A), (B))
+#define V_SUB(A,B)     _mm256_sub_pd((A), (B))
+#define V_MUL(A,B)     _mm256_mul_pd((A), (B))
+#define V_DIV(A,B)     _mm256_div_pd((A), (B))
+#define V_SQRT(A)      _mm256_sqrt_pd(A)
+#define V_MIN(A,B)     _mm256_min_pd((A), (B))
+#define V_MAX(A,B)     _mm256_max_pd((A), (B))
+#define V_AND(A,B)     _mm256_and_pd((A), (B))
+#define V_ANDNOT(A,B)  _mm256_andnot_pd((A), (B))
+#define V_OR(A,B)      _mm256_or_pd((A), (B))
+#define V_XOR(A,B)     _mm256_xor_pd((A), (B))
+#define V_LT(A,B)      _mm256_cmp_pd((A), (B), _CMP_LT_OQ)
+#define V_LE(A,B)      _mm256_cmp_pd((A), (B), _CMP_LE_OQ)
+#define V_EQ(A,B)      _mm256_cmp_pd((A), (B), _CMP_EQ_OQ)
+#define V_NE(A,B)      _mm256_cmp_pd((A), (B), _CMP_NEQ_UQ)
+#define V_ORD(A,B)     _mm256_cmp_pd((A), (B), _CMP_ORD_Q)
+#define V_UNORD(A,B)   _mm256_cmp_pd((A), (B), _CMP_UNORD_Q)
+#define V_BLEND(M,T,F) _mm256_blendv_pd((F), (T), (M))
+#define V_TRUNC(A)     _mm256_round_pd((A), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC)
+#define V_FLOOR(A)     _mm256_round_pd((A), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)
+#define V_CEIL(A)      _mm256_round_pd((A), _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC)
+#include "expr-simd.inc"
+
+#define SIMD_FN(NAME)  NAME##_avxf
+#define SIMD_TARGET    __attribute__((target("avx")))
+#define T              float
+#define V              __m256
+#define W              8
+#define V_LOAD(P)      _mm256_loadu_ps(P)
+#define V_STORE(P,A)   _mm256_storeu_ps((P), (A))
+#define V_SET1(K)      _mm256_set1_ps((float)(K))
+#define V_ADD(A,B)     _mm256_add_ps((A), (B))
+#define V_SUB(A,B)     _mm256_sub_ps((A), (B))
+#define V_MUL(A,B)     _mm256_mul_ps((A), (B))
+#define V_DIV(A,B)     _mm256_div_ps((A), (B))
+#define V_SQRT(A)      _mm256_sqrt_ps(A)
+#define V_MIN(A,B)     _mm256_min_ps((A), (B))
+#define V_MAX(A,B)     _mm256_max_ps((A), (B))
+#define V_AND(A,B)     _mm256_and_ps((A), (B))
+#define V_ANDNOT(A,B)  _mm256_andnot_ps((A), (B))
+#define V_OR(A,B)      _mm256_or_ps((A), (B))
+#define V_XOR(A,B)     _mm256_xor_ps((A), (B))
+#define V_LT(A,B)      _mm256_cmp_ps((A), (B), _CMP_LT_OQ)
+#define V_LE(A,B)      _mm256_cmp_ps((A), (B), _CMP_LE_OQ)
+#define V_EQ(A,B)      _mm256_cmp_ps((A), (B), _CMP_EQ_OQ)
+#define V_NE(A,B)      _mm256_cmp_ps((A), (B), _CMP_NEQ_UQ)
+#define V_ORD(A,B)     _mm256_cmp_ps((A), (B), _CMP_ORD_Q)
+#define V_UNORD(A,B)   _mm256_cmp_ps((A), (B), _CMP_UNORD_Q)
+#define V_BLEND(M,T,F) _mm256_blendv_ps((F), (T), (M))
+#define V_TRUNC(A)     _mm256_round_ps((A), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC)
+#define V_FLOOR(A)     _mm256_round_ps((A), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC)
+#define V_CEIL(A)      _mm256_round_ps((A), _MM_FROUND_TO_POS_INF | _MM_FROUND_NO_EXC)
+#include "expr-simd.inc"
+
+/* With FMA, the AVX kernel gains one operator; see expr_rewrite.
+ */
+static int __attribute__((target("avx,fma")))
+expr_simd_fma(const OPCODE * op, double * dst, size_t len)
+{
+  size_t i;
+  if (op->type != OP_FMA) return expr_simd_avx(op, dst, len);
+  for (i = 0; i < len; i += 4) {
+    __m256d a = _mm256_loadu_pd(dst + i);
+    __m256d b = _mm256_loadu_pd(dst + i + EXPR_BLOCK);
+    __m256d c = _mm256_loadu_pd(dst + i + EXPR_BLOCK * 2);
+    _mm256_storeu_pd(dst + i, _mm256_fmadd_pd(a, b, c));
+  }
+  return 1;
+}
+
+static int __attribute__((target("avx,fma")))
+expr_simd_fmaf(const OPCODE * op, float * dst, size_t len)
+{
+  size_t i;
+  if (op->type != OP_FMA) return expr_simd_avxf(op, dst, len);
+  for (i = 0; i < len; i += 8) {
+    __m256 a = _mm256_loadu_ps(dst + i);
+    __m256 b = _mm256_loadu_ps(dst + i + EXPR_BLOCK);
+    __m256 c = _mm256_loadu_ps(dst + i + EXPR_BLOCK * 2);
+    _mm256_storeu_ps(dst + i, _mm256_fmadd_ps(a, b, c));
+  }
+  return 1;
+}
+
+/* The kernels for this CPU, chosen once from CPUID.
+ */
+static expr_simd_fn expr_simd = NULL;
+static expr_simdf_fn expr_simdf = NULL;
+
+static void
+expr_simd_init(void)
+{
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("fma")) {
+    expr_simd = expr_simd_fma;
+    expr_simdf = expr_simd_fmaf;
+  } else if (__builtin_cpu_supports("avx")) {
+    expr_simd = expr_simd_avx;
+    expr_simdf = expr_simd_avxf;
+  } else if (__builtin_cpu_supports("sse2")) {
+    expr_simd = expr_simd_sse2;
+    expr_simdf = expr_simd_sse2f;
+  }
+}
+
+#endif /* EXPR_SIMD */
+
+/* ********************************************************************** */
+/* Threaded Evaluator */
+/* ********************************************************************** */
+
+/* With GCC's labels-as-values, each handler finds the next one by
+ * indexing a table of them with the next byte of the bytecode, so the
+ * evaluator runs from the same compact code as the switch. Each
+ * handler knows its own operand count and whether a value follows,
+ * so it adjusts the stack by a constant and jumps straight to the
+ * next handler: no bounds check, and one indirect branch per opcode
+ * for the predictor to learn.
+ */
+#if defined(__GNUC__) && !defined(EXPR_NO_THREADED)
+#define EXPR_THREADED 1
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+static int
+expr_eval_threaded(const EXPR * ex, EXPR_CTX * ctx, double x, double * rv)
+{
+  static const void * const labels[] = {
+#undef COMMA
+#undef LIMIT
+#define SYMBOL(ENUM,PREC,TOK,ARGC,DOC,EVAL)  &&L_##ENUM,
+#include "expr-optab.inc"
+  };
+  const unsigned char * pc = ex->code;
+  double * dst = ctx->stack;
+  double value = 0.0;
+  size_t at = 0; /* a slot, table or jump target, kept out of doubles */
+
+  goto *labels[*pc++];
+
+#undef COMMA
+#undef LIMIT
+#define zz  value
+#define slot(K)  ctx->slots[at]
+#define table(K)  (ex->pool + at)
+#define aa  dst[0]
+#define bb  dst[1]
+#define cc  dst[2]
+#define SYMBOL(ENUM,PREC,TOK,ARGC,DOC,EVAL) \
+  L_##ENUM: \
+    if (ENUM == OP_EOF) goto done; \
+    if (ENUM == OP_NUMBER) value = ex->pool[bc_index(&pc)]; \
+    else if (op_isJump(ENUM)) { \
+      at = (size_t)pc[0] | (size_t)pc[1] << 8 | \
+           (size_t)pc[2] << 16 | (size_t)pc[3] << 24; \
+      pc += BC_JUMPLEN; \
+    } else if (op_hasValue(ENUM)) at = bc_index(&pc); \
+    dst -= ARGC; \
+    if (op_isJump(ENUM)) { \
+      if ((EVAL) != 0) { \
+        dst += op_jumpKeeps(ENUM); \
+        pc = ex->code + at; \
+      } \
+    } else { \
+      dst[0] = (double)(EVAL); \
+      dst++; \
+    } \
+    goto *labels[*pc++];
+#include "expr-optab.inc"
+
+done:
+  assert((dst - ctx->stack) == 1);
+  *rv = ctx->stack[0];
+  return 0;
+}
+
+#pragma GCC diagnostic pop
+
+#endif /* EXPR_THREADED */
+
+/* ********************************************************************** */
+/* Register VM */
+/* ********************************************************************** */
+
+/* The register VM keeps the top of the stack in a local, the
+ * accumulator, and the values below it in registers. A value's
+ * register is its stack position, so allocation is one linear pass
+ * over the RPN, and register 0 is a scratch slot for the first push.
+ *
+ * Each instruction is an operator plus a form saying where its
+ * operands are. A number or x directly before a binary or ternary
+ * operator is its last operand, and is folded into that operator's
+ * instruction, so "x * 2 + 1" never touches a register at all; but
+ * not when a jump lands on the operator, with its operand elsewhere.
+ * A jump tests the accumulator, and a jump which pops reloads it
+ * from the register below.
+ */
+enum expr_regform_e {
+  R_PUSH,  /* spill the accumulator to reg, then acc = op() */
+  R_ACC,   /* the last operand is the accumulator, the others from reg */
+  R_IMM,   /* as R_ACC, with value appended as the last operand */
+  R_X,     /* as R_ACC, with x appended as the last operand */
+  R_FORMS
+};
+
+#define REG_CODE(TYPE,FORM)  ((int)(TYPE) * R_FORMS + (FORM))
+#define REG_EOF              REG_CODE(OP_EOF, R_PUSH)
+
+typedef struct expr_regop_s {
+#ifdef EXPR_THREADED
+  const void * addr;  /* the handler for code */
+#endif
+  int    code;  /* REG_CODE(operator, form) */
+  int    reg;   /* register of the first operand, or the spill register */
+  double value;
+} REGOP;
+
+static int expr_eval_register(const EXPR * ex, EXPR_CTX * ctx, double x, double * rv);
+
+#ifdef EXPR_THREADED
+/* Indexed by REG_CODE; exported by expr_init.
+ */
+static const void * const * expr_reg_labels = NULL;
+#endif
+
+/* Lower the RPN for expr_eval_register. If widths is not NULL, each
+ * operator's width (see expr_widths) moves to its instruction's index.
+ * Returns NULL when out of memory; expr_eval then uses the stack VM.
+ */
+static REGOP *
+expr_lower(const OPCODE * code, unsigned char * widths)
+{
+  REGOP * rc;
+  size_t * at; /* first whether each opcode is a jump target, then its index in rc */
+  size_t in, out, len;
+  int depth = 0;
+
+  for (len = 0; code[len].type != OP_EOF; len++) /**/;
+  rc = (REGOP *)malloc(sizeof(REGOP) * (len + 1));
+  at = (size_t *)calloc(len + 1, sizeof(size_t));
+  if (!rc || !at) {
+    free(rc);
+    free(at);
+    return NULL;
+  }
+  for (in = 0; in < len; in++)
+    if (op_isJump(code[in].type)) at[(size_t)code[in].value] = 1;
+
+  for (in = out = 0; in < len; in++, out++) {
+    expr_oper_t type = code[in].type;
+    int argc = op_argc(type);
+    at[in] = out;
+    rc[out].value = code[in].value;
+    if (op_isJump(type)) {
+      /* the value below the condition is in register depth - 1 */
+      rc[out].code = REG_CODE(type, R_ACC);
+      rc[out].reg = --depth;
+    } else if ((type == OP_NUMBER || type == OP_X) && in + 1 < len &&
+        op_argc(code[in + 1].type) >= 2 && !at[in + 1]) {
+      argc = op_argc(code[in + 1].type);
+      depth++;
+      rc[out].code = REG_CODE(code[in + 1].type, type == OP_X ? R_X : R_IMM);
+      rc[out].reg = depth - argc + 1;
+      depth -= argc - 1;
+      in++;
+    } else if (!argc) {
+      rc[out].code = REG_CODE(type, R_PUSH);
+      rc[out].reg = depth++;
+    } else {
+      rc[out].code = REG_CODE(type, R_ACC);
+      rc[out].reg = depth - argc + 1;
+      depth -= argc - 1;
+    }
+    if (widths) widths[out] = widths[in];
+  }
+  assert(depth == 1);
+  at[len] = out;
+  rc[out].code = REG_EOF;
+  rc[out].reg = 0;
+  rc[out].value = 0.0;
+  for (in = 0; in < out; in++)
+    if (op_isJump(rc[in].code / R_FORMS))
+      rc[in].value = (double)at[(size_t)rc[in].value];
+  free(at);
+
+#ifdef EXPR_THREADED
+  for (in = 0; in <= out; in++) rc[in].addr = expr_reg_labels[rc[in].code];
+#endif
+  return rc;
+}
+
+/* The operands of the fused forms: the accumulator moves down one
+ * place to make room for the appended LAST operand.
+ */
+#define REG_FUSED(ARGC,LAST) \
+  a_ = (ARGC) == 2 ? acc : (ARGC) == 3 ? r[op->reg] : 0.0; \
+  b_ = (ARGC) == 2 ? (LAST) : (ARGC) == 3 ? acc : 0.0; \
+  c_ = (ARGC) == 3 ? (LAST) : 0.0
+
+/* Dispatch is threaded where the stack VM's is, and a switch if not.
+ */
+#ifdef EXPR_THREADED
+#define REG_CASE(ENUM,FORM)  L_##ENUM##_##FORM
+#define REG_NEXT             op++; goto *op->addr
+#define REG_JUMP             op = (const REGOP *)ex->regs + (size_t)op->value; \
+                             goto *op->addr
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#else
+#define REG_CASE(ENUM,FORM)  case REG_CODE(ENUM, FORM)
+#define REG_NEXT             continue
+#define REG_JUMP             op = (const REGOP *)ex->regs + (size_t)op->value - 1; \
+                             continue
+#endif
+
+/* Called with a NULL ex, only fills in expr_reg_labels.
+ */
+static int
+expr_eval_register(const EXPR * ex, EXPR_CTX * ctx, double x, double * rv)
+{
+  const REGOP * op;
+  double * r;
+  double acc = 0.0, a_ = 0.0, b_ = 0.0, c_ = 0.0;
+
+#ifdef EXPR_THREADED
+  static const void * const labels[] = {
+#undef COMMA
+#undef LIMIT
+#define SYMBOL(ENUM,PREC,TOK,ARGC,DOC,EVAL) \
+    &&L_##ENUM##_R_PUSH, &&L_##ENUM##_R_ACC, &&L_##ENUM##_R_IMM, &&L_##ENUM##_R_X,
+#include "expr-optab.inc"
+  };
+
+  if (!ex) {
+    expr_reg_labels = labels;
+    return 0;
+  }
+#endif
+
+  op = (const REGOP *)ex->regs;
+  r = ctx->stack;
+#ifdef EXPR_THREADED
+  goto *op->addr;
+#else
+  for (;; op++) switch (op->code) {
+#endif
+
+#undef COMMA
+#undef LIMIT
+#define zz  op->value
+#define slot(K)  ctx->slots[(size_t)(K)]
+#define table(K)  (ex->pool + (size_t)(K))
+#define aa  a_
+#define bb  b_
+#define cc  c_
+#define SYMBOL(ENUM,PREC,TOK,ARGC,DOC,EVAL) \
+    REG_CASE(ENUM, R_PUSH): \
+      if (ENUM == OP_EOF) goto done; \
+      r[op->reg] = acc; \
+      acc = (double)(EVAL); \
+      REG_NEXT; \
+    REG_CASE(ENUM, R_ACC): \
+      a_ = (ARGC) == 1 ? acc : (ARGC) >= 2 ? r[op->reg] : 0.0; \
+      b_ = (ARGC) == 2 ? acc : (ARGC) == 3 ? r[op->reg + 1] : 0.0; \
+      c_ = acc; \
+      if (op_isJump(ENUM)) { \
+        if ((EVAL) != 0) { \
+          if (!op_jumpKeeps(ENUM)) acc = r[op->reg]; \
+          REG_JUMP; \
+        } \
+        acc = r[op->reg]; \
+        REG_NEXT; \
+      } \
+      acc = (double)(EVAL); \
+      REG_NEXT; \
+    REG_CASE(ENUM, R_IMM): \
+      REG_FUSED(ARGC, op->value); \
+      acc = (double)(EVAL); \
+      REG_NEXT; \
+    REG_CASE(ENUM, R_X): \
+      REG_FUSED(ARGC, x); \
+      acc = (double)(EVAL); \
+      REG_NEXT;
+#include "expr-optab.inc"
+
+#ifndef EXPR_THREADED
+  }
+#endif
+done:
+  *rv = acc;
+  return 0;
+}
+
+#ifdef EXPR_THREADED
+#pragma GCC diagnostic pop
+#endif
+#undef REG_FUSED
+#undef REG_CASE
+#undef REG_NEXT
+#undef REG_JUMP
+
+/* ********************************************************************** */
+/* JIT */
+/* ********************************************************************** */
+
+/* The JIT turns the register VM's code into an x86-64 function,
+ * double f(double x), in a page of its own. Its frame holds x and the
+ * registers, and the accumulator lives in xmm0. Each instruction
+ * loads its operands into xmm0, xmm1 and xmm2; the plain arithmetic
+ * then runs inline on SSE2, and everything else calls a small C
+ * function per operator, which for the transcendentals is a tail call
+ * into libm. So results are bit-exact with the interpreters. Jumps
+ * are rel32, patched once the code for their targets is out.
+ *
+ * Any failure, including a system which refuses executable pages,
+ * just leaves ex->jit NULL, and the interpreters run instead.
+ */
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__unix__) && \
+    !defined(EXPR_NO_JIT)
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(MAP_ANONYMOUS) || defined(MAP_ANON)
+#define EXPR_JIT 1
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+#endif
+
+/* The C code generator needs a compiler and dlopen(); see expr_cc.
+ */
+#if defined(__unix__) && !defined(EXPR_NO_CC)
+#define EXPR_CC 1
+#endif
+
+#if defined(EXPR_JIT) || defined(EXPR_CC)
+
+typedef double (*expr_op_fn)(double a, double b, double c);
+
+/* The operators, as functions for native code to call.
+ */
+#undef COMMA
+#undef LIMIT
+#define x   0.0
+#define zz  0.0
+#define slot(K)  a /* native code keeps the slots itself */
+#define table(K)  ((const double *)NULL) /* the JIT calls lut_linear itself */
+#define aa  a
+#define bb  b
+#define cc  c
+#define SYMBOL(ENUM,PREC,TOK,ARGC,DOC,EVAL) \
+static double \
+expr_op_##ENUM(double a, double b, double c) \
+{ \
+  (void)a; (void)b; (void)c; \
+  return (double)(EVAL); \
+}
+#include "expr-optab.inc"
+#undef x
+
+static const expr_op_fn expr_op_fns[] = {
+#undef COMMA
+#undef LIMIT
+#define SYMBOL(ENUM,PREC,TOK,ARGC,DOC,EVAL)  expr_op_##ENUM,
+#include "expr-optab.inc"
+};
+
+#endif /* EXPR_JIT || EXPR_CC */
+
+#ifdef EXPR_JIT
+
+typedef double (*expr_jit_fn)(double x);
+
+typedef struct expr_jitbuf_s {
+  unsigned char * mem;  /* start of the mapping: the constants, then code */
+  unsigned char * p;    /* the next byte of code */
+  unsigned char * end;  /* end of the mapping */
+  double        * pool; /* the next free constant */
+} JITBUF;
+
+#define JIT_XMM0  0
+#define JIT_XMM1  1
+#define JIT_XMM2  2
+
+static void
+jit_bytes(JITBUF * jb, const char * bytes, size_t n)
+{
+  memcpy(jb->p, bytes, n);
+  jb->p += n;
+}
+
+static void
+jit_u32(JITBUF * jb, unsigned long v)
+{
+  int i;
+  for (i = 0; i < 4; i++) *(jb->p++) = (unsigned char)(v >> (8 * i));
+}
+
+/* OP xmm, [rsp + disp]; OP is the SSE2 prefix and opcode, three bytes
+ * or, with a REX prefix, four. xmm may be a general register instead,
+ * for the conversions.
+ */
+static void
+jit_frame(JITBUF * jb, const char * op, int xmm, size_t disp)
+{
+  jit_bytes(jb, op, strlen(op));
+  *(jb->p++) = (unsigned char)(0x84 | (xmm << 3));
+  *(jb->p++) = 0x24;
+  jit_u32(jb, (unsigned long)disp);
+}
+
+/* OP xmm, [rip + to constant].
+ */
+static void
+jit_const(JITBUF * jb, const char * op, int xmm, const void * k)
+{
+  jit_bytes(jb, op, strlen(op));
+  *(jb->p++) = (unsigned char)(0x05 | (xmm << 3));
+  jit_u32(jb, (unsigned long)((const unsigned char *)k - (jb->p + 4)));
+}
+
+/* OP xmm, xmm.
+ */
+static void
+jit_reg(JITBUF * jb, const char * op, int dst, int src)
+{
+  jit_bytes(jb, op, strlen(op));
+  *(jb->p++) = (unsigned char)(0xC0 | (dst << 3) | src);
+}
+
+static const double *
+jit_number(JITBUF * jb, double v)
+{
+  *(jb->pool) = v;
+  return jb->pool++;
+}
+
+#define SSE_MOVSD_LOAD   "\xF2\x0F\x10"
+#define SSE_MOVSD_STORE  "\xF2\x0F\x11"
+#define SSE_MOVAPD       "\x66\x0F\x28"
+#define SSE_ADDSD        "\xF2\x0F\x58"
+#define SSE_MULSD        "\xF2\x0F\x59"
+#define SSE_SUBSD        "\xF2\x0F\x5C"
+#define SSE_DIVSD        "\xF2\x0F\x5E"
+#define SSE_SQRTSD       "\xF2\x0F\x51"
+#define SSE_ANDPD        "\x66\x0F\x54"
+#define SSE_XORPD        "\x66\x0F\x57"
+#define SSE_UCOMISD      "\x66\x0F\x2E"
+#define SSE_CVTTSD2SI32  "\xF2\x0F\x2C"      /* to a 32-bit register */
+#define SSE_CVTTSD2SI    "\xF2\x48\x0F\x2C"  /* to a 64-bit register */
+#define SSE_CVTSI2SD     "\xF2\x48\x0F\x2A"  /* from a 64-bit register */
+
+#define JIT_RAX   0
+#define JIT_RCX   1
+
+/* The frame: x, the registers, then the slots. Offsets are from rsp.
+ */
+#define JIT_X        0
+#define JIT_REG(R)   (8 * ((size_t)(R) + 1))
+#define JIT_SLOT(K)  JIT_REG(depth + 1 + (size_t)(K))
+
+/* Integers.
+ *
+ * The bitwise and integer operators convert their operands to long
+ * and their result back to double, on every use. The width of an
+ * opcode says its value is an integer in [-2^w, 2^w), for w up to
+ * EXPR_INTBITS, and so exact both as a long and as a double; or it
+ * is EXPR_NOTINT. Where one integer operator's exact result is the
+ * next one's accumulator operand, the JIT leaves it in rax and skips
+ * both conversions, which then change nothing.
+ */
+#define EXPR_INTBITS  53
+#define EXPR_NOTINT   64
+#define EXPR_NONNEG   0x80 /* or'd in while typing: and never negative */
+
+/* The operators the JIT runs on integer registers: all of those of
+ * expr-optab.inc but >>>, whose unsigned conversion is another matter.
+ */
+#define op_isInt(OP) ((OP) == OP_BITAND || (OP) == OP_BITOR || \
+                      (OP) == OP_BITXOR || (OP) == OP_SHL || (OP) == OP_SHR || \
+                      (OP) == OP_IDIV || (OP) == OP_IMOD || (OP) == OP_BITNOT)
+
+static unsigned char
+width_number(double v)
+{
+  unsigned char w = 0;
+  double bound = 1.0;
+  if (v != floor(v) || !(fabs(v) < 9007199254740992.0)) return EXPR_NOTINT;
+  while (!(v >= -bound && v < bound)) { bound *= 2.0; w++; }
+  return (unsigned char)(w | (v >= 0.0 ? EXPR_NONNEG : 0));
+}
+
+/* Type the RPN: the width of each opcode's value, or EXPR_NOTINT for
+ * the jumps. A join, where a jump that keeps the top lands, takes the
+ * wider of the values that may arrive. Returns NULL if out of memory.
+ */
+static unsigned char *
+expr_widths(const OPCODE * code)
+{
+  unsigned char * w, * stack, * slots, * joins;
+  size_t i, sp = 0, len;
+
+  for (len = 0; code[len].type != OP_EOF; len++) /**/;
+  w = (unsigned char *)malloc(4 * (len + 1));
+  if (!w) return NULL;
+  stack = w + len + 1;
+  slots = stack + len + 1;
+  joins = slots + len + 1; /* 1 + what jumps here, or 0 */
+  memset(joins, 0, len + 1);
+
+#define WIDTH(V)   ((unsigned)(V) & ~(unsigned)EXPR_NONNEG)
+#define NONNEG(V)  (((V) & EXPR_NONNEG) != 0)
+#define WMAX(A,B)   ((A) > (B) ? (A) : (B))
+#define WMIN(A,B)   ((A) < (B) ? (A) : (B))
+#define ASLONG(V)  (WIDTH(V) <= EXPR_INTBITS ? WIDTH(V) : 63) /* (long int)(V) */
+#define MERGE(A,B) (WMAX(WIDTH(A), WIDTH(B)) | ((A) & (B) & EXPR_NONNEG))
+
+  for (i = 0; i < len; i++) {
+    expr_oper_t type = code[i].type;
+    size_t argc = (size_t)op_argc(type);
+    unsigned a, b, c, rw = EXPR_NOTINT;
+    int rn = 0;
+
+    if (joins[i] && sp)
+      stack[sp - 1] = (unsigned char)MERGE(stack[sp - 1], joins[i] - 1u);
+    sp -= argc;
+    a = argc > 0 ? stack[sp] : EXPR_NOTINT;
+    b = argc > 1 ? stack[sp + 1] : EXPR_NOTINT;
+    c = argc > 2 ? stack[sp + 2] : EXPR_NOTINT;
+    switch (type) {
+      case OP_NUMBER:
+        a = width_number(code[i].value);
+        rw = WIDTH(a); rn = NONNEG(a);
+        break;
+      case OP_LOAD:
+        a = slots[(size_t)code[i].value];
+        rw = WIDTH(a); rn = NONNEG(a);
+        break;
+      case OP_STORE:
+        slots[(size_t)code[i].value] = (unsigned char)a;
+        rw = WIDTH(a); rn = NONNEG(a);
+        break;
+      case OP_LT: case OP_GT: case OP_LE: case OP_GE: case OP_EQ: case OP_NE:
+      case OP_APPROXLE: case OP_APPROXGE: case OP_APPROXEQ: case OP_APPROXNE:
+      case OP_LOGNOT: case OP_ISNAN: case OP_ISINF: case OP_ISFINITE:
+      case OP_ISEVEN: case OP_ISODD: case OP_ORDERED:
+        rw = 1; rn = 1;
+        break;
+      case OP_SIGN:   rw = 1; break;
+      case OP_BITNOT: rw = 31; break;
+      case OP_BITAND:
+        /* within [0, either operand which is never negative] */
+        rw = WMAX(ASLONG(a), ASLONG(b));
+        if (NONNEG(a)) rw = WMIN(rw, WIDTH(a));
+        if (NONNEG(b)) rw = WMIN(rw, WIDTH(b));
+        rn = NONNEG(a) || NONNEG(b);
+        break;
+      case OP_BITOR: case OP_BITXOR:
+        rw = WMAX(ASLONG(a), ASLONG(b));
+        rn = NONNEG(a) && NONNEG(b);
+        break;
+      case OP_SHL:
+        rw = ASLONG(a) + 31;
+        if (code[i - 1].type == OP_NUMBER && !joins[i] &&
+            code[i - 1].value >= 0.0 && code[i - 1].value < 4294967296.0)
+          rw = ASLONG(a) + ((unsigned)code[i - 1].value & 0x1F);
+        break;
+      case OP_SHR:    rw = ASLONG(a); rn = NONNEG(a); break;
+      case OP_IDIV:   rw = ASLONG(a); break;
+      case OP_IMOD:   rw = WMIN(ASLONG(a), ASLONG(b)); rn = NONNEG(a); break;
+      case OP_POS:    rw = WIDTH(a); rn = NONNEG(a); break;
+      case OP_NEG:    rw = WIDTH(a) + 1; break;
+      case OP_ABS:    rw = WIDTH(a) + 1; rn = 1; break;
+      case OP_SQUARE: rw = 2 * WIDTH(a); rn = 1; break;
+      case OP_ADD: case OP_SUB: rw = WMAX(WIDTH(a), WIDTH(b)) + 1; break;
+      case OP_MUL:    rw = WIDTH(a) + WIDTH(b); break;
+      case OP_MIN: case OP_MAX: case OP_LOGAND: case OP_LOGOR: case OP_COAL:
+        rw = WMAX(WIDTH(a), WIDTH(b)); rn = NONNEG(a) && NONNEG(b);
+        break;
+      case OP_COND:
+        rw = WMAX(WIDTH(b), WIDTH(c)); rn = NONNEG(b) && NONNEG(c);
+        break;
+      case OP_JUMP: case OP_JAND: case OP_JOR: case OP_JCOAL: {
+        size_t to = (size_t)code[i].value;
+        joins[to] = (unsigned char)(1 + (joins[to] ? MERGE(a, joins[to] - 1u) : a));
+        break;
+      }
+      default: break;
+    }
+    if (rw > EXPR_INTBITS || op_isJump(type)) w[i] = EXPR_NOTINT;
+    else w[i] = (unsigned char)(rw | (rn ? EXPR_NONNEG : 0));
+    if (op_pushes(type)) stack[sp++] = w[i];
+  }
+  for (i = 0; i < len; i++) w[i] = (unsigned char)WIDTH(w[i]);
+  w[len] = EXPR_NOTINT;
+#undef MERGE
+#undef ASLONG
+#undef WMIN
+#undef WMAX
+#undef NONNEG
+#undef WIDTH
+  return w;
+}
+
+/* Load the fused last operand of op into xmm.
+ */
+static void
+jit_last(JITBUF * jb, const REGOP * op, int form, int xmm)
+{
+  if (form == R_X)
+    jit_frame(jb, SSE_MOVSD_LOAD, xmm, JIT_X);
+  else
+    jit_const(jb, SSE_MOVSD_LOAD, xmm, jit_number(jb, op->value));
+}
+
+/* Compile the register VM's code, whose tables are in pool, and the
+ * width of each instruction's value, or NULL for none known.
+ * Returns the mapping, with the function at its start, or NULL.
+ */
+static void *
+expr_jit(const REGOP * code, const unsigned char * widths,
+         const double * pool, size_t depth, size_t nslots, size_t * size)
+{
+  static const unsigned long long masks[6] = {
+    0x8000000000000000ULL, 0x8000000000000000ULL, /* sign */
+    0x7FFFFFFFFFFFFFFFULL, 0x7FFFFFFFFFFFFFFFULL, /* magnitude */
+    0, 0                                          /* zero */
+  };
+  const double * signmask, * absmask, * zero;
+  const REGOP * op;
+  JITBUF jb;
+  size_t * at;    /* the offset of each instruction's code */
+  size_t * fixes; /* pairs of a rel32's offset and its target */
+  size_t * lands; /* whether a jump lands on each instruction */
+  size_t i, nfixes = 0, len, frame, page;
+  int inrax = 0;  /* the accumulator is in rax, not xmm0 */
+
+  for (len = 0; code[len].code != REG_EOF; len++) /**/;
+  if (depth + nslots > 0xFFFFFF) return NULL; /* keep displacements small */
+  at = (size_t *)malloc(sizeof(size_t) * (len + 1) * 6);
+  if (!at) return NULL;
+  fixes = at + len + 1;
+  lands = fixes + 4 * (len + 1);
+  memset(lands, 0, sizeof(size_t) * (len + 1));
+  for (i = 0; i < len; i++)
+    if (op_isJump(code[i].code / R_FORMS)) lands[(size_t)code[i].value] = 1;
+
+  /* code, then at most one number per instruction, then the masks */
+  page = (size_t)sysconf(_SC_PAGESIZE);
+  *size = 64 * (len + 1) + 32; /* no instruction needs more than 64 bytes */
+  *size += 8 * (len + 2) + sizeof(masks);
+  *size = (*size + page - 1) / page * page;
+
+  jb.mem = (unsigned char *)mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jb.mem == (unsigned char *)MAP_FAILED) {
+    free(at);
+    return NULL;
+  }
+
+  jb.end = jb.mem + *size - sizeof(masks);
+  memcpy(jb.end, masks, sizeof(masks));
+  signmask = (const double *)(void *)jb.end;
+  absmask = (const double *)(void *)(jb.end + 16);
+  zero = (const double *)(void *)(jb.end + 32);
+  jb.pool = (double *)(void *)(jb.end - 8 * (len + 2));
+  jb.end = (unsigned char *)jb.pool;
+  jb.p = jb.mem;
+
+  /* keep rsp 16-byte aligned for the calls */
+  frame = JIT_SLOT(nslots);
+  if (frame % 16 == 0) frame += 8;
+  jit_bytes(&jb, "\x48\x81\xEC", 3);              /* sub rsp, frame */
+  jit_u32(&jb, (unsigned long)frame);
+  jit_frame(&jb, SSE_MOVSD_STORE, JIT_XMM0, JIT_X);
+
+  for (op = code; op->code != REG_EOF; op++) {
+    expr_oper_t type = (expr_oper_t)(op->code / R_FORMS);
+    int form = op->code % R_FORMS;
+    int argc = op_argc(type);
+
+    at[op - code] = (size_t)(jb.p - jb.mem);
+
+    /* an integer operator, on rax and rcx */
+    if (op_isInt(type)) {
+      const REGOP * next = op + 1;
+      expr_oper_t nt = (expr_oper_t)(next->code / R_FORMS);
+      unsigned w = widths ? widths[op - code] : EXPR_NOTINT;
+      if (form == R_ACC && argc == 2) {
+        if (inrax) jit_bytes(&jb, "\x48\x89\xC1", 3);  /* mov rcx, rax */
+        else jit_reg(&jb, SSE_CVTTSD2SI, JIT_RCX, JIT_XMM0);
+        jit_frame(&jb, SSE_CVTTSD2SI, JIT_RAX, JIT_REG(op->reg));
+      } else {
+        if (!inrax)
+          jit_reg(&jb, argc == 1 ? SSE_CVTTSD2SI32 : SSE_CVTTSD2SI,
+                  JIT_RAX, JIT_XMM0);
+        if (form == R_X)
+          jit_frame(&jb, SSE_CVTTSD2SI, JIT_RCX, JIT_X);
+        else if (form == R_IMM)
+          jit_const(&jb, SSE_CVTTSD2SI, JIT_RCX, jit_number(&jb, op->value));
+      }
+      /* as their EVALs have it, even where those swap | and ^ */
+      switch (type) {
+        case OP_BITAND: jit_bytes(&jb, "\x48\x21\xC8", 3); break; /* and rax, rcx */
+        case OP_BITXOR: jit_bytes(&jb, "\x48\x09\xC8", 3); break; /* or rax, rcx */
+        case OP_BITOR:  jit_bytes(&jb, "\x48\x31\xC8", 3); break; /* xor rax, rcx */
+        case OP_SHL:
+          jit_bytes(&jb, "\x83\xE1\x1F", 3);             /* and ecx, 31 */
+          jit_bytes(&jb, "\x48\xD3\xE0", 3);             /* shl rax, cl */
+          break;
+        case OP_SHR:
+          jit_bytes(&jb, "\x83\xE1\x1F", 3);             /* and ecx, 31 */
+          jit_bytes(&jb, "\x48\xD3\xF8", 3);             /* sar rax, cl */
+          break;
+        case OP_IDIV:
+          jit_bytes(&jb, "\x48\x99\x48\xF7\xF9", 5);     /* cqo; idiv rcx */
+          break;
+        case OP_IMOD:
+          jit_bytes(&jb, "\x48\x99\x48\xF7\xF9", 5);     /* cqo; idiv rcx */
+          jit_bytes(&jb, "\x48\x89\xD0", 3);             /* mov rax, rdx */
+          break;
+        default: /* OP_BITNOT, on an int */
+          jit_bytes(&jb, "\xF7\xD0\x48\x98", 4);         /* not eax; cdqe */
+          break;
+      }
+      /* the next one takes it as it is, if that converts it exactly */
+      inrax = w <= EXPR_INTBITS && op_isInt(nt) && next->code % R_FORMS != R_PUSH &&
+              !lands[op - code + 1] && (nt != OP_BITNOT || w <= 31);
+      if (!inrax) jit_reg(&jb, SSE_CVTSI2SD, JIT_XMM0, JIT_RAX);
+      continue;
+    }
+
+    /* the operands, into xmm0, xmm1 and xmm2 */
+    if (form == R_PUSH) {
+      jit_frame(&jb, SSE_MOVSD_STORE, JIT_XMM0, JIT_REG(op->reg));
+      if (type == OP_NUMBER) {
+        jit_const(&jb, SSE_MOVSD_LOAD, JIT_XMM0, jit_number(&jb, op->value));
+        continue;
+      }
+      if (type == OP_X) {
+        jit_frame(&jb, SSE_MOVSD_LOAD, JIT_XMM0, JIT_X);
+        continue;
+      }
+      if (type == OP_LOAD) {
+        jit_frame(&jb, SSE_MOVSD_LOAD, JIT_XMM0, JIT_SLOT(op->value));
+        continue;
+      }
+    } else if (form == R_ACC) {
+      if (argc >= 2) {
+        jit_reg(&jb, SSE_MOVAPD, argc - 1, JIT_XMM0);
+        jit_frame(&jb, SSE_MOVSD_LOAD, JIT_XMM0, JIT_REG(op->reg));
+      }
+      if (argc == 3)
+        jit_frame(&jb, SSE_MOVSD_LOAD, JIT_XMM1, JIT_REG(op->reg + 1));
+    } else {
+      if (argc == 3) {
+        jit_reg(&jb, SSE_MOVAPD, JIT_XMM1, JIT_XMM0);
+        jit_frame(&jb, SSE_MOVSD_LOAD, JIT_XMM0, JIT_REG(op->reg));
+      }
+      jit_last(&jb, op, form, argc - 1);
+    }
+
+    /* the operator */
+    switch (type) {
+      case OP_POS:    break;
+      case OP_STORE:
+        jit_frame(&jb, SSE_MOVSD_STORE, JIT_XMM0, JIT_SLOT(op->value));
+        break;
+      case OP_NEG:    jit_const(&jb, SSE_XORPD, JIT_XMM0, signmask); break;
+      case OP_ABS:    jit_const(&jb, SSE_ANDPD, JIT_XMM0, absmask); break;
+      case OP_SQRT:   jit_reg(&jb, SSE_SQRTSD, JIT_XMM0, JIT_XMM0); break;
+      case OP_SQUARE: jit_reg(&jb, SSE_MULSD, JIT_XMM0, JIT_XMM0); break;
+      case OP_ADD:    jit_reg(&jb, SSE_ADDSD, JIT_XMM0, JIT_XMM1); break;
+      case OP_SUB:    jit_reg(&jb, SSE_SUBSD, JIT_XMM0, JIT_XMM1); break;
+      case OP_MUL:    jit_reg(&jb, SSE_MULSD, JIT_XMM0, JIT_XMM1); break;
+      case OP_DIV:    jit_reg(&jb, SSE_DIVSD, JIT_XMM0, JIT_XMM1); break;
+      case OP_D2R:
+        jit_const(&jb, SSE_MULSD, JIT_XMM0, jit_number(&jb, M_DEG_TO_RAD));
+        break;
+      case OP_R2D:
+        jit_const(&jb, SSE_MULSD, JIT_XMM0, jit_number(&jb, M_RAD_TO_DEG));
+        break;
+      case OP_FMA:
+        if (expr_fma != 1) goto call;
+        jit_bytes(&jb, "\xC4\xE2\xF1\xA9\xC2", 5); /* vfmadd213sd xmm0, xmm1, xmm2 */
+        break;
+      case OP_LUT: case OP_LUTC: case OP_POLY: {
+        double (*fn)(const double *, double) = type == OP_LUT ? lut_linear :
+          type == OP_LUTC ? lut_cubic : poly_piecewise;
+        const double * t = pool + (size_t)op->value;
+        jit_bytes(&jb, "\x48\xBF", 2);             /* mov rdi, table */
+        memcpy(jb.p, &t, 8);
+        jb.p += 8;
+        jit_bytes(&jb, "\x48\xB8", 2);             /* mov rax, fn */
+        memcpy(jb.p, &fn, 8);
+        jb.p += 8;
+        jit_bytes(&jb, "\xFF\xD0", 2);             /* call rax */
+        break;
+      }
+
+      /* unordered, as with NaN, sets ZF just as equal does */
+#define JIT_JUMP(OP,N) do { \
+    jit_bytes(&jb, (OP), (N)); \
+    fixes[nfixes++] = (size_t)(jb.p - jb.mem); \
+    fixes[nfixes++] = (size_t)op->value; \
+    jit_u32(&jb, 0); \
+  } while (0)
+      case OP_JUMP:
+        JIT_JUMP("\xE9", 1);                            /* jmp */
+        break;
+      case OP_JFALSE:
+        jit_const(&jb, SSE_UCOMISD, JIT_XMM0, zero);
+        jit_frame(&jb, SSE_MOVSD_LOAD, JIT_XMM0, JIT_REG(op->reg));
+        jit_bytes(&jb, "\x7A\x06", 2);                 /* jp over the je */
+        JIT_JUMP("\x0F\x84", 2);                       /* je */
+        break;
+      case OP_JAND:
+        jit_const(&jb, SSE_UCOMISD, JIT_XMM0, zero);
+        jit_bytes(&jb, "\x7A\x06", 2);                 /* jp over the je */
+        JIT_JUMP("\x0F\x84", 2);                       /* je */
+        jit_frame(&jb, SSE_MOVSD_LOAD, JIT_XMM0, JIT_REG(op->reg));
+        break;
+      case OP_JOR:
+        jit_const(&jb, SSE_UCOMISD, JIT_XMM0, zero);
+        JIT_JUMP("\x0F\x85", 2);                       /* jne */
+        JIT_JUMP("\x0F\x8A", 2);                       /* jp */
+        jit_frame(&jb, SSE_MOVSD_LOAD, JIT_XMM0, JIT_REG(op->reg));
+        break;
+      case OP_JCOAL:
+        jit_reg(&jb, SSE_UCOMISD, JIT_XMM0, JIT_XMM0);
+        JIT_JUMP("\x0F\x8B", 2);                       /* jnp */
+        jit_frame(&jb, SSE_MOVSD_LOAD, JIT_XMM0, JIT_REG(op->reg));
+        break;
+#undef JIT_JUMP
+
+      default: call: {
+        expr_op_fn fn = expr_op_fns[type];
+        jit_bytes(&jb, "\x48\xB8", 2);             /* mov rax, fn */
+        memcpy(jb.p, &fn, 8);
+        jb.p += 8;
+        jit_bytes(&jb, "\xFF\xD0", 2);             /* call rax */
+        break;
+      }
+    }
+    assert(jb.p + 64 <= jb.end);
+  }
+
+  at[len] = (size_t)(jb.p - jb.mem);
+  jit_bytes(&jb, "\x48\x81\xC4", 3);              /* add rsp, frame */
+  jit_u32(&jb, (unsigned long)frame);
+  jit_bytes(&jb, "\xC3", 1);                      /* ret */
+
+  for (i = 0; i < nfixes; i += 2) {
+    unsigned char * p = jb.p;
+    jb.p = jb.mem + fixes[i];
+    jit_u32(&jb, (unsigned long)(at[fixes[i + 1]] - (fixes[i] + 4)));
+    jb.p = p;
+  }
+  free(at);
+
+  if (mprotect(jb.mem, *size, PROT_READ | PROT_EXEC)) {
+    munmap(jb.mem, *size);
+    return NULL;
+  }
+  return jb.mem;
+}
+
+#define expr_jit_call(EX,X)  (((expr_jit_fn)(size_t)(EX)->jit)(X))
+
+#undef SSE_MOVSD_LOAD
+#undef SSE_MOVSD_STORE
+#undef SSE_MOVAPD
+#undef SSE_ADDSD
+#undef SSE_MULSD
+#undef SSE_SUBSD
+#undef SSE_DIVSD
+#undef SSE_SQRTSD
+#undef SSE_ANDPD
+#undef SSE_XORPD
+#undef SSE_UCOMISD
+#undef SSE_CVTTSD2SI32
+#undef SSE_CVTTSD2SI
+#undef SSE_CVTSI2SD
+
+#endif /* EXPR_JIT */
+
+/* ********************************************************************** */
+/* C Code Generator */
+/* ********************************************************************** */
+
+/* The portable alternative to the JIT: the program is written out as
+ * straight-line C, one local per stack slot and one statement per
+ * opcode, with each operator spelled by its EVAL text from
+ * expr-optab.inc. The system compiler turns it into a shared object,
+ * which is loaded with dlopen().
+ *
+ * Objects are cached in expr_cc_dir under a hash of the generated
+ * source, the compiler command and the host CPU, so a program is only
+ * compiled the first time it is seen, and an object built with
+ * -march=native on one machine is never loaded on another. Operators which need helpers from
+ * expr-math.c call back into expr_op_fns, and the compiler is told
+ * not to contract a*b+c, so results are bit-exact with the
+ * interpreters.
+ *
+ * Without a cache directory, for a program with a table, which the
+ * object has no way to reach, or when anything fails, ex->cc stays
+ * NULL and the other evaluators run instead.
+ */
+#ifdef EXPR_CC
+#include <dlfcn.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#define EXPR_CC_CPUID
+#endif
+
+#ifndef EXPR_CC_COMMAND
+#ifdef EXPR_CC_CPUID
+#define EXPR_CC_COMMAND \
+  "cc -O3 -march=native -ffp-contract=off -fPIC -shared -w"
+#else
+#define EXPR_CC_COMMAND \
+  "cc -O3 -ffp-contract=off -fPIC -shared -w"
+#endif
+#endif
+
+typedef double (*expr_cc_fn)(double x, const expr_op_fn * ops);
+typedef void (*expr_cc_fn_n)(const double * xs, double * out, size_t n,
+                             const expr_op_fn * ops);
+
+static char * expr_cc_dir = NULL;
+static unsigned long expr_cc_hits = 0;   /* loaded from the cache */
+static unsigned long expr_cc_misses = 0; /* compiled */
+
+#ifdef EXPR_THREADS
+static pthread_mutex_t expr_cc_lock = PTHREAD_MUTEX_INITIALIZER;
+#define expr_cc_count(N)  do { \
+    pthread_mutex_lock(&expr_cc_lock); \
+    (N)++; \
+    pthread_mutex_unlock(&expr_cc_lock); \
+  } while (0)
+#else
+#define expr_cc_count(N)  ((N)++)
+#endif
+
+static const char * const expr_cc_names[] = {
+#undef COMMA
+#undef LIMIT
+#define SYMBOL(ENUM,PREC,TOK,ARGC,DOC,EVAL)  #ENUM,
+#include "expr-optab.inc"
+};
+
+static const char * const expr_cc_evals[] = {
+#undef COMMA
+#undef LIMIT
+#define SYMBOL(ENUM,PREC,TOK,ARGC,DOC,EVAL)  #EVAL,
+#include "expr-optab.inc"
+};
+
+/* Operators whose EVAL text uses something only the host has.
+ */
+static int
+expr_cc_hosted(expr_oper_t type)
+{
+  const char * e = expr_cc_evals[type];
+  return op_isConst(type) || strstr(e, "approx") ||
+         strstr(e, "quadratic") || strstr(e, "trianglewave");
+}
+
+typedef struct expr_ccbuf_s {
+  char * text;
+  size_t len;
+  size_t size;
+  int    failed;
+} CCBUF;
+
+static void
+cc_printf(CCBUF * cb, const char * fmt, ...)
+{
+  va_list ap;
+  int n;
+  while (!cb->failed) {
+    va_start(ap, fmt);
+    n = vsnprintf(cb->text + cb->len, cb->size - cb->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+      cb->failed = 1;
+    } else if (cb->len + (size_t)n < cb->size) {
+      cb->len += (size_t)n;
+      return;
+    } else {
+      size_t size = (cb->len + (size_t)n + 1) * 2;
+      char * text = (char *)realloc(cb->text, size);
+      if (!text) cb->failed = 1;
+      else { cb->text = text; cb->size = size; }
+    }
+  }
+}
+
+/* Exactly, as hex floats.
+ */
+static void
+cc_number(CCBUF * cb, double v)
+{
+  if (isnan(v))      cc_printf(cb, "NAN");
+  else if (isinf(v)) cc_printf(cb, v < 0.0 ? "(-INFINITY)" : "INFINITY");
+  else               cc_printf(cb, "(%a)", v);
+}
+
+/* The C translation of the program, or NULL when out of memory.
+ */
+static char *
+expr_cc_source(const OPCODE * code, size_t depth, size_t nslots)
+{
+  char used[_OP_MAX + 1];
+  char * target; /* whether each opcode is a jump target */
+  const OPCODE * op;
+  CCBUF cb;
+  size_t i, sp, len;
+
+  cb.len = 0;
+  cb.size = 4096;
+  cb.failed = 0;
+  cb.text = (char *)malloc(cb.size);
+  for (len = 0; code[len].type != OP_EOF; len++) /**/;
+  target = (char *)calloc(len + 1, 1);
+  if (!cb.text || !target) {
+    free(cb.text);
+    free(target);
+    return NULL;
+  }
+  for (i = 0; i < len; i++)
+    if (op_isJump(code[i].type)) target[(size_t)code[i].value] = 1;
+
+  cc_printf(&cb, "/* generated by expr.c */\n"
+                 "#define _DEFAULT_SOURCE 1\n"
+                 "#define _XOPEN_SOURCE 600\n"
+                 "#include <math.h>\n"
+                 "#include <stddef.h>\n\n"
+                 "typedef double (*expr_op_fn)(double, double, double);\n\n"
+                 "#define M_DEG_TO_RAD %a\n"
+                 "#define M_RAD_TO_DEG %a\n",
+            M_DEG_TO_RAD, M_RAD_TO_DEG);
+
+  memset(used, 0, sizeof(used));
+  for (op = code; op->type != OP_EOF; op++) used[op->type] = 1;
+  for (i = 0; i <= _OP_MAX; i++) {
+    if (!used[i] || i == OP_NUMBER || i == OP_X ||
+        i == OP_LOAD || i == OP_STORE) continue;
+    if (expr_cc_hosted((expr_oper_t)i))
+      cc_printf(&cb, "#define %s(aa,bb,cc) (ops[%lu]((aa), (bb), (cc)))\n",
+                expr_cc_names[i], (unsigned long)i);
+    else
+      cc_printf(&cb, "#define %s(aa,bb,cc) ((double)(%s))\n",
+                expr_cc_names[i], expr_cc_evals[i]);
+  }
+
+  cc_printf(&cb, "\nstatic double\neval1(double x, const expr_op_fn * ops)\n"
+                 "{\n  double s0");
+  for (i = 1; i < depth; i++) cc_printf(&cb, ", s%lu", (unsigned long)i);
+  for (i = 0; i < nslots; i++) cc_printf(&cb, ", t%lu", (unsigned long)i);
+  cc_printf(&cb, ";\n  (void)ops;\n");
+
+  /* a jump's condition and the value at its target share a local */
+  for (op = code, sp = 0; op->type != OP_EOF; op++, sp++) {
+    int argc = op_argc(op->type);
+    sp -= (size_t)argc;
+    if (target[op - code]) cc_printf(&cb, "L%lu:\n", (unsigned long)(op - code));
+    if (op_isJump(op->type)) {
+      cc_printf(&cb, "  if (%s(s%lu, 0.0, 0.0)) goto L%lu;\n",
+                expr_cc_names[op->type], (unsigned long)sp,
+                (unsigned long)op->value);
+      sp--;
+      continue;
+    }
+    cc_printf(&cb, "  s%lu = ", (unsigned long)sp);
+    if (op->type == OP_NUMBER) {
+      cc_number(&cb, op->value);
+    } else if (op->type == OP_X) {
+      cc_printf(&cb, "x");
+    } else if (op->type == OP_LOAD) {
+      cc_printf(&cb, "t%lu", (unsigned long)op->value);
+    } else if (op->type == OP_STORE) {
+      cc_printf(&cb, "t%lu = s%lu", (unsigned long)op->value, (unsigned long)sp);
+    } else {
+      cc_printf(&cb, "%s(", expr_cc_names[op->type]);
+      for (i = 0; i < 3; i++) {
+        if (i) cc_printf(&cb, ", ");
+        if (i < (size_t)argc) cc_printf(&cb, "s%lu", (unsigned long)(sp + i));
+        else cc_printf(&cb, "0.0");
+      }
+      cc_printf(&cb, ")");
+    }
+    cc_printf(&cb, ";\n");
+  }
+  assert(sp == 1);
+  if (target[len]) cc_printf(&cb, "L%lu:\n", (unsigned long)len);
+  free(target);
+
+  cc_printf(&cb, "  return s0;\n}\n\n"
+                 "double\nexpr_cc_eval(double x, const expr_op_fn * ops)\n"
+                 "{\n  return eval1(x, ops);\n}\n\n"
+                 "void\nexpr_cc_eval_n(const double * xs, double * out, "
+                 "size_t n, const expr_op_fn * ops)\n"
+                 "{\n  size_t i;\n"
+                 "  for (i = 0; i < n; i++) out[i] = eval1(xs[i], ops);\n}\n");
+
+  if (cb.failed) {
+    free(cb.text);
+    return NULL;
+  }
+  return cb.text;
+}
+
+/* FNV-1a.
+ */
+static unsigned long long
+expr_cc_hash(unsigned long long h, const char * s)
+{
+  for (; *s; s++) {
+    h ^= (unsigned char)*s;
+    h *= 0x100000001B3ULL;
+  }
+  return h;
+}
+
+/* The host CPU, as far as -march=native can see it: the vendor and
+ * the feature words of cpuid leaves 1 and 7. Elsewhere the default
+ * command targets the baseline of the architecture, and this is empty.
+ */
+static const char *
+expr_cc_cpu(char * cpu, size_t size)
+{
+#ifdef EXPR_CC_CPUID
+  unsigned int r[12] = { 0 };
+#endif
+
+  cpu[0] = '\0';
+#ifdef EXPR_CC_CPUID
+  __get_cpuid(0, &r[0], &r[1], &r[3], &r[2]); /* vendor in ebx,edx,ecx */
+  __get_cpuid(1, &r[4], &r[5], &r[6], &r[7]);
+  __get_cpuid_count(7, 0, &r[8], &r[9], &r[10], &r[11]);
+  snprintf(cpu, size, "%.12s %x %x %x %x %x %x",
+           (const char *)&r[1], r[4], r[6], r[7], r[9], r[10], r[11]);
+#endif
+  return cpu;
+}
+
+/* Load the program from the cache, compiling it first on a miss.
+ * Returns the dlopen() handle, or NULL.
+ */
+static void *
+expr_cc(const OPCODE * code, size_t depth, size_t nslots)
+{
+  char * src, * cmd;
+  char * path[3]; /* the object, the source, the object being built */
+  char cpu[128];
+  unsigned long long h;
+  void * so = NULL;
+  size_t len;
+  FILE * fp;
+  int i, fd;
+
+  if (!expr_cc_dir || strchr(expr_cc_dir, '\'')) return NULL;
+  for (len = 0; code[len].type != OP_EOF; len++)
+    if (op_hasTable(code[len].type)) return NULL;
+  src = expr_cc_source(code, depth, nslots);
+  if (!src) return NULL;
+  h = expr_cc_hash(expr_cc_hash(0xCBF29CE484222325ULL, src), EXPR_CC_COMMAND);
+  h = expr_cc_hash(h, expr_cc_cpu(cpu, sizeof(cpu)));
+
+  len = strlen(expr_cc_dir) + 64;
+  cmd = (char *)malloc(strlen(EXPR_CC_COMMAND) + 3 * len + 64);
+  for (i = 0; i < 3; i++) path[i] = (char *)malloc(len);
+  if (!cmd || !path[0] || !path[1] || !path[2]) goto done;
+  snprintf(path[0], len, "%s/expr-%016llx.so", expr_cc_dir, h);
+  snprintf(path[1], len, "%s/expr-%016llx.XXXXXX.c", expr_cc_dir, h);
+
+  if ((so = dlopen(path[0], RTLD_NOW | RTLD_LOCAL)) != NULL) {
+    expr_cc_count(expr_cc_hits);
+    goto done;
+  }
+
+  /* build under a private name, then rename, so that concurrent
+   * builds of the same program, by other processes or threads,
+   * never see a partial object
+   */
+  if ((fd = mkstemps(path[1], 2)) < 0) goto done;
+  strcpy(path[2], path[1]);
+  strcpy(path[2] + strlen(path[2]) - 1, "so");
+  fp = fdopen(fd, "w");
+  if (!fp) {
+    close(fd);
+    goto cleanup;
+  }
+  i = fputs(src, fp) < 0;
+  if (fclose(fp) || i) goto cleanup;
+  sprintf(cmd, "%s -o '%s' '%s' -lm >/dev/null 2>&1",
+          EXPR_CC_COMMAND, path[2], path[1]);
+  if (system(cmd) != 0 || rename(path[2], path[0])) goto cleanup;
+  expr_cc_count(expr_cc_misses);
+  so = dlopen(path[0], RTLD_NOW | RTLD_LOCAL);
+
+cleanup:
+  remove(path[1]);
+  remove(path[2]);
+done:
+  for (i = 0; i < 3; i++) free(path[i]);
+  free(cmd);
+  free(src);
+  return so;
+}
+
+#define expr_cc_call(EX,X) \
+  (((expr_cc_fn)(size_t)(EX)->cc)((X), expr_op_fns))
+#define expr_cc_call_n(EX,XS,OUT,N) \
+  (((expr_cc_fn_n)(size_t)(EX)->ccn)((XS), (OUT), (N), expr_op_fns))
+
+#endif /* EXPR_CC */
+
+void
+expr_set_cache_dir(const char * dir)
+{
+#ifdef EXPR_CC
+  free(expr_cc_dir);
+  expr_cc_dir = NULL;
+  if (dir && *dir) {
+    expr_cc_dir = (char *)malloc(strlen(dir) + 1);
+    if (expr_cc_dir) strcpy(expr_cc_dir, dir);
+  }
+#else
+  (void)dir;
+#endif
+}
+
+/* ********************************************************************** */
+/* Evaluator */
+/* ********************************************************************** */
+
+/* The portable evaluator; where the threaded one runs instead, only
+ * the tests compare against it.
+ */
+#if !defined(EXPR_THREADED) || defined(TEST)
+static int
+expr_eval_switch(const EXPR * ex, EXPR_CTX * ctx, double x, double * rv)
+{
+  const unsigned char * pc = ex->code;
+  double * dst = ctx->stack;
+  double value = 0.0;
+  expr_oper_t type;
+
+  while ((type = (expr_oper_t)*pc++) != OP_EOF) {
+    dst -= op_argc(type);
+    switch (type) {
+#undef COMMA
+#undef LIMIT
+#define zz  value
+#define slot(K)  ctx->slots[(size_t)(K)]
+#define table(K)  (ex->pool + (size_t)(K))
+#define aa  dst[0]
+#define bb  dst[1]
+#define cc  dst[2]
+#define SYMBOL(ENUM,PREC,TOK,ARGC,DOC,EVAL) case ENUM: \
+      if (op_hasValue(ENUM)) value = bc_value(ex, ENUM, &pc); \
+      if (!op_isJump(ENUM)) { dst[0]=(double)(EVAL); break; } \
+      if ((EVAL) != 0) { \
+        pc = ex->code + (size_t)zz; \
+        if (op_jumpKeeps(ENUM)) break; \
+      } \
+      dst--; break;
+#include "expr-optab.inc"
+    }
+    dst++;
+  }
+  assert((dst - ctx->stack) == 1);
+  *rv = ctx->stack[0];
+  return 0;
+}
+#endif
+
+/* Whether ctx is big enough for ex.
+ */
+#define expr_ctx_fits(CTX,EX) \
+  ((CTX)->depth >= (EX)->depth && (CTX)->nslots >= (EX)->nslots)
+
+int
+expr_eval(const EXPR * ex, double x, double * rv)
+{
+  if (!ex) return -1;
+  return expr_eval_ctx(ex, ex->ctx, x, rv);
+}
+
+/* EXPR_FAST: set flush-to-zero and denormals-are-zero for the length
+ * of an evaluation, and put back the caller's MXCSR after. Elsewhere
+ * denormals are left as they are.
+ */
+#if defined(__GNUC__) && defined(__SSE2__)
+#include <xmmintrin.h>
+#define EXPR_MXCSR_FTZ_DAZ  0x8040u
+#define expr_fast_enter(EX,CSR)  do { \
+    if ((EX)->tier & EXPR_FAST) { \
+      (CSR) = _mm_getcsr(); \
+      _mm_setcsr((CSR) | EXPR_MXCSR_FTZ_DAZ); \
+    } \
+  } while (0)
+#define expr_fast_leave(EX,CSR)  do { \
+    if ((EX)->tier & EXPR_FAST) _mm_setcsr(CSR); \
+  } while (0)
+#else
+#define expr_fast_enter(EX,CSR)  ((void)(CSR))
+#define expr_fast_leave(EX,CSR)  ((void)(CSR))
+#endif
+
+/* One sample, on whichever VM ex was built for.
+ */
+static int
+expr_eval1(const EXPR * ex, EXPR_CTX * ctx, double x, double * rv)
+{
+#ifdef EXPR_CC
+  if (ex->cc) {
+    *rv = expr_cc_call(ex, x);
+    return 0;
+  }
+#endif
+#ifdef EXPR_JIT
+  if (ex->jit) {
+    *rv = expr_jit_call(ex, x);
+    return 0;
+  }
+#endif
+  if (ex->regs) return expr_eval_register(ex, ctx, x, rv);
+#ifdef EXPR_THREADED
+  return expr_eval_threaded(ex, ctx, x, rv);
+#else
+  return expr_eval_switch(ex, ctx, x, rv);
+#endif
+}
+
+int
+expr_eval_ctx(const EXPR * ex, EXPR_CTX * ctx, double x, double * rv)
+{
+  unsigned int csr = 0;
+  int r;
+  if (!ex || !ctx || !rv || !expr_ctx_fits(ctx, ex)) return -1;
+  expr_fast_enter(ex, csr);
+  r = expr_eval1(ex, ctx, x, rv);
+  expr_fast_leave(ex, csr);
+  return r;
+}
+
+/* Each stack slot holds EXPR_BLOCK samples, and each opcode runs
+ * across all of them before moving to the next opcode. A jump is
+ * taken when every sample takes it, and not when none does; a block
+ * whose samples disagree runs a sample at a time instead.
+ */
+int
+expr_eval_n(const EXPR * ex, const double * xs, double * out, size_t n)
+{
+  if (!ex) return -1;
+  return expr_eval_n_ctx(ex, ex->ctx, xs, out, n);
+}
+
+/* The batch kernels of expr-math.c, for an opcode with no vector
+ * kernel: trianglewave is exact, while sin, cos and tanh are off by a
+ * few ulps, so only EXPR_FAST takes those.
+ * Returns 0 when the opcode has none.
+ */
+static int
+expr_vmath(const EXPR * ex, expr_oper_t type, double * dst, size_t len)
+{
+  int fast = ex->tier & EXPR_FAST;
+  switch (type) {
+    case OP_TRIWAVE:         vtrianglewave(dst, dst, len); return 1;
+    case OP_SIN:  if (fast) { vsin(dst, dst, len); return 1; } break;
+    case OP_COS:  if (fast) { vcos(dst, dst, len); return 1; } break;
+    case OP_TANH: if (fast) { vtanh(dst, dst, len); return 1; } break;
+    default: break;
+  }
+  return 0;
+}
+
+/* expr_vmath for a block of floats, through doubles, where the SIMD
+ * kernels don't take trianglewave. The float libm beats the double
+ * kernels and the conversions at sin, cos and tanh, so it keeps those.
+ */
+static int
+expr_vmathf(const EXPR * ex, expr_oper_t type, float * dst, size_t len)
+{
+  double v[EXPR_BLOCK];
+  size_t i;
+  if (type != OP_TRIWAVE) return 0;
+  for (i = 0; i < len; i++) v[i] = (double)dst[i];
+  expr_vmath(ex, type, v, len);
+  for (i = 0; i < len; i++) dst[i] = (float)v[i];
+  return 1;
+}
+
+static void
+expr_eval_block(const EXPR * ex, EXPR_CTX * ctx,
+                const double * xs, double * out, size_t n)
+{
+  const unsigned char * pc;
+  OPCODE cur;
+  const OPCODE * op = &cur;
+  double * dst;
+  size_t i, k, len;
+
+#ifdef EXPR_CC
+  if (ex->ccn) {
+    expr_cc_call_n(ex, xs, out, n);
+    return;
+  }
+#endif
+#ifdef EXPR_JIT
+  if (ex->jit) {
+    for (i = 0; i < n; i++) out[i] = expr_jit_call(ex, xs[i]);
+    return;
+  }
+#endif
+
+  for (; n; n -= len, xs += len, out += len) {
+    len = n < EXPR_BLOCK ? n : EXPR_BLOCK;
+    for (pc = ex->code, dst = ctx->block;
+         (cur.type = (expr_oper_t)*pc++) != OP_EOF;
+         dst += EXPR_BLOCK) {
+      cur.value = op_hasValue(cur.type) ? bc_value(ex, cur.type, &pc) : 0.0;
+      dst -= EXPR_BLOCK * op_argc(cur.type);
+      if (op_isJump(cur.type)) {
+        size_t taken = 0;
+        for (i = 0; i < len; i++) taken += expr_apply(op, 0.0, dst + i) != 0.0;
+        if (taken && taken < len) break;
+        if (!taken || !op_jumpKeeps(cur.type)) dst -= EXPR_BLOCK;
+        if (taken) pc = ex->code + (size_t)cur.value;
+        continue;
+      }
+#ifdef EXPR_SIMD
+      if (expr_simd && expr_simd(op, dst, len)) continue;
+#endif
+      if (expr_vmath(ex, op->type, dst, len)) continue;
+      switch (op->type) {
+#undef COMMA
+#undef LIMIT
+#define x   xs[i]
+#define zz  op->value
+#define slot(K)  ctx->blockslots[(size_t)(K) * EXPR_BLOCK + i]
+#define table(K)  (ex->pool + (size_t)(K))
+#define aa  dst[i]
+#define bb  dst[i + EXPR_BLOCK]
+#define cc  dst[i + EXPR_BLOCK * 2]
+#define SYMBOL(ENUM,PREC,TOK,ARGC,DOC,EVAL) \
+      case ENUM: for (i = 0; i < len; i++) dst[i] = (double)(EVAL); break;
+#include "expr-optab.inc"
+#undef x
+      }
+    }
+    if (cur.type != OP_EOF) {
+      for (i = 0; i < len; i++) {
+        /* the slots expr_eval_grid filled, at this sample */
+        for (k = ex->nslots - ex->ngens; k < ex->nslots; k++)
+          ctx->slots[k] = ctx->blockslots[k * EXPR_BLOCK + i];
+        expr_eval1(ex, ctx, xs[i], &(out[i]));
+      }
+      continue;
+    }
+    assert((dst - ctx->block) == EXPR_BLOCK);
+    memcpy(out, ctx->block, sizeof(double) * len);
+  }
+}
+
+/* The same for EXPR_FLOAT, with the block and its slots read as floats;
+ * they take half the room. The scalar loop computes each operator as
+ * usual, calling the float libm, and rounds the result. Blocks which
+ * split at a jump run in double.
+ */
+static void
+expr_eval_blockf(const EXPR * ex, EXPR_CTX * ctx,
+                 const double * xs, double * out, size_t n)
+{
+  const unsigned char * pc;
+  OPCODE cur;
+  const OPCODE * op = &cur;
+  float * block = (float *)(void *)ctx->block;
+  float * blockslots = (float *)(void *)ctx->blockslots;
+  float * dst;
+  double arg;
+  size_t i, k, len;
+
+  for (; n; n -= len, xs += len, out += len) {
+    len = n < EXPR_BLOCK ? n : EXPR_BLOCK;
+    for (pc = ex->code, dst = block;
+         (cur.type = (expr_oper_t)*pc++) != OP_EOF;
+         dst += EXPR_BLOCK) {
+      cur.value = op_hasValue(cur.type) ? bc_value(ex, cur.type, &pc) : 0.0;
+      dst -= EXPR_BLOCK * op_argc(cur.type);
+      if (op_isJump(cur.type)) {
+        size_t taken = 0;
+        for (i = 0; i < len; i++) {
+          arg = (double)dst[i];
+          taken += expr_apply(op, 0.0, &arg) != 0.0;
+        }
+        if (taken && taken < len) break;
+        if (!taken || !op_jumpKeeps(cur.type)) dst -= EXPR_BLOCK;
+        if (taken) pc = ex->code + (size_t)cur.value;
+        continue;
+      }
+#ifdef EXPR_SIMD
+      if (expr_simdf && expr_simdf(op, dst, len)) continue;
+#endif
+      if (expr_vmathf(ex, op->type, dst, len)) continue;
+      switch (op->type) {
+#undef COMMA
+#undef LIMIT
+#define FAST1(F,A)    ((double)F##f((float)(A)))
+#define FAST2(F,A,B)  ((double)F##f((float)(A), (float)(B)))
+#define exp(A)     FAST1(exp, A)
+#define expm1(A)   FAST1(expm1, A)
+#define log(A)     FAST1(log, A)
+#define log2(A)    FAST1(log2, A)
+#define log10(A)   FAST1(log10, A)
+#define log1p(A)   FAST1(log1p, A)
+#define sin(A)     FAST1(sin, A)
+#define cos(A)     FAST1(cos, A)
+#define tan(A)     FAST1(tan, A)
+#define asin(A)    FAST1(asin, A)
+#define acos(A)    FAST1(acos, A)
+#define atan(A)    FAST1(atan, A)
+#define sinh(A)    FAST1(sinh, A)
+#define cosh(A)    FAST1(cosh, A)
+#define tanh(A)    FAST1(tanh, A)
+#define asinh(A)   FAST1(asinh, A)
+#define acosh(A)   FAST1(acosh, A)
+#define atanh(A)   FAST1(atanh, A)
+#define cbrt(A)    FAST1(cbrt, A)
+#define erf(A)     FAST1(erf, A)
+#define pow(A,B)   FAST2(pow, A, B)
+#define atan2(A,B) FAST2(atan2, A, B)
+#define hypot(A,B) FAST2(hypot, A, B)
+#define x   xs[i]
+#define zz  op->value
+#define slot(K)  blockslots[(size_t)(K) * EXPR_BLOCK + i]
+#define table(K)  (ex->pool + (size_t)(K))
+#define aa  dst[i]
+#define bb  dst[i + EXPR_BLOCK]
+#define cc  dst[i + EXPR_BLOCK * 2]
+#define SYMBOL(ENUM,PREC,TOK,ARGC,DOC,EVAL) \
+      case ENUM: for (i = 0; i < len; i++) dst[i] = (float)(EVAL); break;
+#include "expr-optab.inc"
+#undef x
+#undef FAST1
+#undef FAST2
+#undef exp
+#undef expm1
+#undef log
+#undef log2
+#undef log10
+#undef log1p
+#undef sin
+#undef cos
+#undef tan
+#undef asin
+#undef acos
+#undef atan
+#undef sinh
+#undef cosh
+#undef tanh
+#undef asinh
+#undef acosh
+#undef atanh
+#undef cbrt
+#undef erf
+#undef pow
+#undef atan2
+#undef hypot
+      }
+    }
+    if (cur.type != OP_EOF) {
+      for (i = 0; i < len; i++) {
+        for (k = ex->nslots - ex->ngens; k < ex->nslots; k++)
+          ctx->slots[k] = (double)blockslots[k * EXPR_BLOCK + i];
+        expr_eval1(ex, ctx, xs[i], &(out[i]));
+      }
+      continue;
+    }
+    assert((dst - block) == EXPR_BLOCK);
+    for (i = 0; i < len; i++) out[i] = (double)block[i];
+  }
+}
+
+int
+expr_eval_n_ctx(const EXPR * ex, EXPR_CTX * ctx,
+                const double * xs, double * out, size_t n)
+{
+  unsigned int csr = 0;
+  if (!ex || !ctx || !xs || !out || !expr_ctx_fits(ctx, ex)) return -1;
+  expr_fast_enter(ex, csr);
+  if (ex->tier & EXPR_FLOAT) expr_eval_blockf(ex, ctx, xs, out, n);
+  else expr_eval_block(ex, ctx, xs, out, n);
+  expr_fast_leave(ex, csr);
+  return 0;
+}
+
+/* ********************************************************************** */
+/* Grids */
+/* ********************************************************************** */
+
+/* expr_eval_grid samples x at i / (n - 1), as a LUT does, and there a
+ * subtree which is a polynomial in x of low degree, or a wave
+ * a + b*sin(p + w*x) or a + b*cos(p + w*x), needn't be computed from
+ * scratch at each sample: a polynomial advances by its forward
+ * differences, additions only (a linear one by a single addition), and
+ * a wave by rotating its sine and cosine through the step in angle.
+ * Each is seeded afresh at every block of EXPR_BLOCK samples, which
+ * keeps the drift to a few ulps of a polynomial's terms, or of a
+ * wave's angle: sin(x*1000) may be 1e-13 off, hundreds of its ulps.
+ *
+ * expr_grid finds the largest such subtrees, once sharing is done,
+ * which save a libm call; the vector kernels beat the recurrences at
+ * the cheaper ones. If there are any, it copies the code with each of
+ * them a load from a slot of its own, past the shared ones. The copy
+ * is built with the program, and expr_eval_grid fills those slots
+ * before it runs each block. A subtree anywhere under an operator
+ * which steps, such as floor or <, or the condition of ?:, or under
+ * one defined on only part of the line, such as sqrt or acos, even
+ * through a shared slot, is left alone, so that a rounding never moves
+ * a sample across the step or out of the domain, to NaN; and so is a
+ * polynomial whose coefficients cancel by more than EXPR_GRID_CANCEL.
+ */
+#define EXPR_GRID_DEGREE  4
+#define EXPR_GRID_CANCEL  1e4
+
+/* An option of expr_finish's alone: no copy for expr_eval_grid.
+ */
+#define EXPR_NO_GRID  0x10000
+
+enum expr_grid_e { GRID_NONE, GRID_POLY, GRID_SIN, GRID_COS };
+
+typedef struct expr_gridgen_s {
+  int    kind;       /* an expr_grid_e */
+  int    degree;     /* of a GRID_POLY */
+  double c[EXPR_GRID_DEGREE + 1]; /* its coefficients, or a wave's a, b, p and w */
+} GRIDGEN;
+
+/* Operators whose result jumps as an argument moves, by a little.
+ */
+static int
+grid_steps(expr_oper_t type)
+{
+  switch (type) {
+    case OP_FLOOR: case OP_CEIL: case OP_ROUND: case OP_SIGN:
+    case OP_ISEVEN: case OP_ISODD: case OP_MOD: case OP_USHR:
+    case OP_LT: case OP_GT: case OP_LE: case OP_GE: case OP_APPROXLE:
+    case OP_APPROXGE: case OP_EQ: case OP_NE: case OP_APPROXEQ:
+    case OP_APPROXNE: case OP_LOGNOT: case OP_LOGAND: case OP_LOGOR:
+    case OP_COAL: case OP_COND: case OP_ORDERED: case OP_JN: case OP_YN:
+    case OP_IDIV: case OP_IMOD: case OP_BITNOT: case OP_SHL: case OP_SHR:
+    case OP_BITAND: case OP_BITXOR: case OP_BITOR:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/* Whether argument j of the operator at p is only defined on part of
+ * the line, so that a drift across its edge, such as sqrt's at 0,
+ * gives NaN: a pow's base only when the exponent isn't a whole number.
+ */
+static int
+grid_bounded(const OPCODE * p, size_t j)
+{
+  switch (p->type) {
+    case OP_POW: case OP_ROOT:
+      return !j && !(p[-1].type == OP_NUMBER && p[-1].value == floor(p[-1].value));
+    case OP_SQRT: case OP_LN: case OP_LOG: case OP_LOG2: case OP_LOG10:
+    case OP_LN1P: case OP_ASIN: case OP_ACOS: case OP_ASEC: case OP_ACSC:
+    case OP_ACOSH: case OP_ATANH: case OP_ASECH: case OP_ACOTH:
+    case OP_TGAMMA: case OP_LGAMMA: case OP_Y0: case OP_Y1:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static double
+grid_horner(const GRIDGEN * g, double x)
+{
+  double v = g->c[g->degree];
+  int k;
+  for (k = g->degree; k--; ) v = v * x + g->c[k];
+  return v;
+}
+
+/* g times k; a wave's amplitude and offset.
+ */
+static void
+grid_scale(GRIDGEN * g, double k)
+{
+  int j, n = g->kind == GRID_POLY ? g->degree + 1 : 2;
+  for (j = 0; j < n; j++) g->c[j] *= k;
+}
+
+/* g plus sign times a; a wave takes only a number.
+ */
+static void
+grid_add(GRIDGEN * g, const GRIDGEN * a, double sign)
+{
+  GRIDGEN t;
+  int j;
+  if (g->kind == GRID_POLY && a->kind == GRID_POLY) {
+    for (j = 0; j <= a->degree; j++) g->c[j] += sign * a->c[j];
+    if (a->degree > g->degree) g->degree = a->degree;
+  } else if (g->kind == GRID_POLY && !g->degree && a->kind != GRID_NONE) {
+    t = *a;
+    grid_scale(&t, sign);
+    t.c[0] += g->c[0];
+    *g = t;
+  } else if (g->kind != GRID_NONE && a->kind == GRID_POLY && !a->degree) {
+    g->c[0] += sign * a->c[0];
+  } else
+    g->kind = GRID_NONE;
+}
+
+/* a times b, into g.
+ */
+static void
+grid_mul(GRIDGEN * g, const GRIDGEN * a, const GRIDGEN * b)
+{
+  int i, j;
+  if (a->kind == GRID_POLY && b->kind == GRID_POLY &&
+      a->degree + b->degree <= EXPR_GRID_DEGREE) {
+    memset(g, 0, sizeof(*g));
+    g->kind = GRID_POLY;
+    g->degree = a->degree + b->degree;
+    for (i = 0; i <= a->degree; i++)
+      for (j = 0; j <= b->degree; j++) g->c[i + j] += a->c[i] * b->c[j];
+  } else if (b->kind == GRID_POLY && !b->degree && a->kind != GRID_NONE) {
+    *g = *a;
+    grid_scale(g, b->c[0]);
+  } else if (a->kind == GRID_POLY && !a->degree && b->kind != GRID_NONE) {
+    *g = *b;
+    grid_scale(g, a->c[0]);
+  } else
+    g->kind = GRID_NONE;
+}
+
+/* What op makes of its arguments args, into g.
+ */
+static void
+grid_node(const OPCODE * op, const GRIDGEN * args, GRIDGEN * g)
+{
+  const GRIDGEN * a = &(args[0]), * b = &(args[1]);
+  GRIDGEN t;
+  double k, big = 0.0, most = 0.0;
+  int j, n = 4;
+
+  memset(g, 0, sizeof(*g));
+  g->kind = GRID_POLY;
+  switch (op->type) {
+    case OP_X:      g->degree = 1; g->c[1] = 1.0; break;
+    case OP_NUMBER: g->c[0] = op->value; break;
+    case OP_POS:    *g = *a; break;
+    case OP_NEG:    *g = *a; grid_scale(g, -1.0); break;
+    case OP_D2R:    *g = *a; grid_scale(g, M_DEG_TO_RAD); break;
+    case OP_R2D:    *g = *a; grid_scale(g, M_RAD_TO_DEG); break;
+    case OP_ADD:    *g = *a; grid_add(g, b, 1.0); break;
+    case OP_SUB:    *g = *a; grid_add(g, b, -1.0); break;
+    case OP_MUL:    grid_mul(g, a, b); break;
+    case OP_SQUARE: grid_mul(g, a, a); break;
+    case OP_FMA:    grid_mul(g, a, b); grid_add(g, &(args[2]), 1.0); break;
+    case OP_DIV:
+      if (b->kind != GRID_POLY || b->degree || b->c[0] == 0.0) {
+        g->kind = GRID_NONE;
+        break;
+      }
+      *g = *a;
+      grid_scale(g, 1.0 / b->c[0]);
+      break;
+    case OP_POW:
+      k = b->c[0];
+      if (b->kind != GRID_POLY || b->degree || !(k >= 0.0) ||
+          k > EXPR_GRID_DEGREE || k != floor(k)) {
+        g->kind = GRID_NONE;
+        break;
+      }
+      for (g->c[0] = 1.0; k > 0.0; k--) {
+        t = *g;
+        grid_mul(g, &t, a);
+      }
+      break;
+    case OP_SIN: case OP_COS:
+      if (a->kind != GRID_POLY || a->degree > 1) {
+        g->kind = GRID_NONE;
+        break;
+      }
+      g->kind = op->type == OP_SIN ? GRID_SIN : GRID_COS;
+      g->c[0] = 0.0;
+      g->c[1] = 1.0;
+      g->c[2] = a->c[0];
+      g->c[3] = a->c[1];
+      break;
+    default:
+      if (op_isConst(op->type)) g->c[0] = expr_apply(op, 0.0, NULL);
+      else g->kind = GRID_NONE;
+      break;
+  }
+  if (g->kind == GRID_NONE) return;
+
+  if (g->kind == GRID_POLY) n = g->degree + 1;
+  for (j = 0; j < n; j++) {
+    if (!isfinite(g->c[j])) {
+      g->kind = GRID_NONE;
+      return;
+    }
+    big += fabs(g->c[j]);
+  }
+  /* a nonzero polynomial of degree 4 or less isn't 0 at all 5 points */
+  if (g->kind == GRID_POLY && g->degree) {
+    for (j = 0; j <= EXPR_GRID_DEGREE; j++) {
+      k = fabs(grid_horner(g, (double)j / EXPR_GRID_DEGREE));
+      if (k > most) most = k;
+    }
+    if (!(big <= most * EXPR_GRID_CANCEL)) g->kind = GRID_NONE;
+  }
+}
+
+/* The copy of code, shared and not yet branched, with capacity
+ * opcodes, that expr_eval_grid runs; its generators, for the slots
+ * from nslots on, are in *gens and *ngens. Returns NULL when there
+ * are none, or when out of memory.
+ */
+static OPCODE *
+expr_grid(const OPCODE * code, size_t capacity, size_t nslots,
+          GRIDGEN ** gens, size_t * ngens)
+{
+  OPCODE * res = NULL;
+  GRIDGEN * nodes, args[3];
+  size_t * starts; /* the first opcode of each subtree */
+  size_t * parent; /* the node each node is an argument of */
+  size_t * cost;   /* of each subtree, as op_cost has it */
+  size_t * outer;  /* the generated subtree starting at each opcode */
+  size_t * argno;  /* which argument of its parent each node is */
+  size_t * stack;
+  unsigned char * steps; /* whether a step or a domain's edge lies
+                          * above each node, then under a load of
+                          * each slot */
+  size_t i, j, p, sp, out, len, n = 0;
+  const size_t none = (size_t)-1;
+
+  *gens = NULL;
+  *ngens = 0;
+  for (len = 0; code[len].type != OP_EOF; len++) /**/;
+  nodes = (GRIDGEN *)malloc(sizeof(GRIDGEN) * (len + 1));
+  starts = (size_t *)malloc(sizeof(size_t) * (len + 1) * 6);
+  steps = (unsigned char *)calloc(len + nslots + 1, 1);
+  if (!nodes || !starts || !steps) goto done;
+  parent = starts + len + 1;
+  cost = parent + len + 1;
+  outer = cost + len + 1;
+  argno = outer + len + 1;
+  stack = argno + len + 1;
+
+  for (i = sp = 0; i < len; i++) {
+    size_t argc = (size_t)op_argc(code[i].type);
+    sp -= argc;
+    cost[i] = op_cost(code[i].type);
+    for (j = 0; j < argc; j++) {
+      parent[stack[sp + j]] = i;
+      argno[stack[sp + j]] = j;
+      cost[i] += cost[stack[sp + j]];
+      args[j] = nodes[stack[sp + j]];
+    }
+    grid_node(&(code[i]), args, &(nodes[i]));
+    starts[i] = argc ? starts[stack[sp]] : i;
+    outer[i] = none;
+    stack[sp++] = i;
+  }
+  parent[len - 1] = none;
+
+  /* parents, and loads, come after what they take */
+  for (i = len; i--; ) {
+    p = parent[i];
+    steps[i] = p != none && (steps[p] || grid_bounded(&(code[p]), argno[i]) ||
+                             (grid_steps(code[p].type) &&
+                              !(code[p].type == OP_COND && argno[i])));
+    if (code[i].type == OP_LOAD && steps[i])
+      steps[len + (size_t)code[i].value] = 1;
+    if (code[i].type == OP_STORE && steps[len + (size_t)code[i].value])
+      steps[i] = 1;
+  }
+
+  for (i = 0; i < len; i++) {
+    p = parent[i];
+    if (nodes[i].kind == GRID_NONE || cost[i] < EXPR_BRANCH_COST ||
+        (p != none && nodes[p].kind != GRID_NONE) || steps[i])
+      continue;
+    outer[starts[i]] = i;
+    n++;
+  }
+  if (!n) goto done;
+
+  res = (OPCODE *)malloc(sizeof(OPCODE) * capacity);
+  *gens = (GRIDGEN *)malloc(sizeof(GRIDGEN) * n);
+  if (!res || !*gens) {
+    free(res);
+    free(*gens);
+    res = NULL;
+    *gens = NULL;
+    goto done;
+  }
+  for (i = out = 0; i < len; out++) {
+    if (outer[i] != none) {
+      res[out].type = OP_LOAD;
+      res[out].value = (double)(nslots + *ngens);
+      (*gens)[(*ngens)++] = nodes[outer[i]];
+      i = outer[i] + 1;
+    } else {
+      opcode_copy(&(res[out]), &(code[i]));
+      i++;
+    }
+  }
+  opcode_copy(&(res[out]), &(code[len]));
+done:
+  free(nodes);
+  free(starts);
+  free(steps);
+  return res;
+}
+
+/* k! S(m,k), with S the Stirling numbers of the second kind: the k-th
+ * forward difference at 0 of a polynomial in j is the sum over m of
+ * these times its coefficient of j to the m.
+ */
+static const double grid_stirling[EXPR_GRID_DEGREE + 1][EXPR_GRID_DEGREE + 1] = {
+  { 1 },
+  { 0, 1 },
+  { 0, 1, 2 },
+  { 0, 1, 6, 6 },
+  { 0, 1, 14, 36, 24 }
+};
+
+/* The values of g at samples from to from + len - 1 of the grid,
+ * into dst, seeded afresh. The differences come from the coefficients
+ * in the sample number, not from subtracting nearby values, which
+ * would cancel most of their digits.
+ */
+static void
+grid_fill(const GRIDGEN * g, size_t from, size_t len, double div,
+          double * dst)
+{
+  double a[EXPR_GRID_DEGREE + 1], v[EXPR_GRID_DEGREE + 1], h, s, c, sd, cd, t;
+  size_t i;
+  int j, k, m, d = g->degree;
+
+  if (g->kind == GRID_POLY) {
+    /* shift to the first sample, then scale to a step of 1 */
+    t = (double)from / div;
+    memcpy(a, g->c, sizeof(a));
+    for (k = 0; k < d; k++)
+      for (j = d - 1; j >= k; j--) a[j] += t * a[j + 1];
+    for (k = 1, h = 1.0; k <= d; k++) a[k] *= (h /= div);
+    v[0] = grid_horner(g, t);
+    for (k = 1; k <= d; k++)
+      for (v[k] = 0.0, m = k; m <= d; m++) v[k] += grid_stirling[m][k] * a[m];
+    for (i = 0; i < len; i++) {
+      dst[i] = v[0];
+      for (k = 0; k < d; k++) v[k] += v[k + 1];
+    }
+    return;
+  }
+  t = g->c[2] + g->c[3] * ((double)from / div);
+  s = sin(t);
+  c = cos(t);
+  sd = sin(g->c[3] / div);
+  cd = cos(g->c[3] / div);
+  for (i = 0; i < len; i++) {
+    dst[i] = g->c[0] + g->c[1] * (g->kind == GRID_SIN ? s : c);
+    t = s * cd + c * sd;
+    c = c * cd - s * sd;
+    s = t;
+  }
+}
+
+int
+expr_eval_grid(const EXPR * ex, double * out, size_t n)
+{
+  const GRIDGEN * gens;
+  EXPR_CTX * ctx;
+  double div = n > 1 ? (double)(n - 1) : 1.0, v[EXPR_BLOCK];
+  size_t i, j, k, len, first;
+  float * slotsf;
+
+  if (!ex || !out) return -1;
+  for (i = 0; i < n; i++) out[i] = (double)i / div;
+  if (!ex->grid) return expr_eval_n(ex, out, out, n);
+
+  ex = ex->grid;
+  ctx = ex->ctx;
+  gens = (const GRIDGEN *)ex->gens;
+  first = ex->nslots - ex->ngens;
+  slotsf = (float *)(void *)ctx->blockslots;
+  for (i = 0; i < n; i += len) {
+    len = n - i < EXPR_BLOCK ? n - i : EXPR_BLOCK;
+    for (k = 0; k < ex->ngens; k++) {
+      if (!(ex->tier & EXPR_FLOAT)) {
+        grid_fill(&(gens[k]), i, len, div,
+                  ctx->blockslots + (first + k) * EXPR_BLOCK);
+        continue;
+      }
+      grid_fill(&(gens[k]), i, len, div, v);
+      for (j = 0; j < len; j++)
+        slotsf[(first + k) * EXPR_BLOCK + j] = (float)v[j];
+    }
+    expr_eval_n_ctx(ex, ctx, out + i, out + i, len);
+  }
+  return 0;
+}
+
+/* ********************************************************************** */
+/* Fitting */
+/* ********************************************************************** */
+
+/* expr_new_fit replaces a curve on [0,1] with piecewise polynomials.
+ * On each piece the curve is interpolated at EXPR_FIT_DEGREE + 1
+ * Chebyshev nodes, and the interpolant cut to the lowest degree whose
+ * error at EXPR_FIT_CHECK evenly spaced points is within the maximum.
+ * This is Chebyshev interpolation, not a minimax fit, and the error is
+ * only measured at those points, so between them it may run over.
+ * A piece which no degree fits is halved, at most EXPR_FIT_DEPTH
+ * times. A piece still unfitted then, or on which the curve isn't
+ * finite, keeps the original code, as does x outside [0,1]:
+ *
+ *   poly(x) ?? original
+ *
+ * where OP_POLY's table holds the pieces in the form poly_piecewise
+ * takes, and gives NAN where there is no piece. expr_branch jumps
+ * around the original where it costs enough.
+ */
+#define EXPR_FIT_DEGREE  12
+#define EXPR_FIT_DEPTH   6
+#define EXPR_FIT_CHECK   64
+
+typedef struct expr_fitpiece_s {
+  double a, b;       /* the piece, [a, b) */
+  int    degree;     /* of its polynomial, or -1 when unfitted */
+  double c[EXPR_FIT_DEGREE + 1]; /* the coefficients, in x - (a + b) / 2 */
+} FITPIECE;
+
+static EXPR * expr_finish(EXPR * info, OPCODE * code, size_t capacity, int flags);
+
+/* As poly_piecewise evaluates it.
+ */
+static double
+fit_horner(const FITPIECE * p, double x)
+{
+  double u = x - (p->a + p->b) / 2, v = p->c[p->degree];
+  int k;
+  for (k = p->degree - 1; k >= 0; k--) v = v * u + p->c[k];
+  return v;
+}
+
+/* Fit f on [a, b) to within maxerr at the check points, or leave p
+ * unfitted.
+ * Returns the error at the check points of the fit, or of the highest
+ * degree tried.
+ */
+static double
+fit_piece(const EXPR * f, double a, double b, double maxerr, FITPIECE * p)
+{
+  enum { N = EXPR_FIT_DEGREE + 1, M = EXPR_FIT_CHECK + 1 };
+  double xs[M], ys[M], cheb[N];
+  double t[N], tprev[N], tnext[N]; /* T_k, T_k-1 and T_k+1 in (x - mid)/h */
+  double mono[N], mid = (a + b) / 2, h = (b - a) / 2, err = INFINITY;
+  int i, j, k, m;
+
+  p->a = a;
+  p->b = b;
+  p->degree = -1;
+
+  for (j = 0; j < N; j++) xs[j] = mid + h * cos(M_PI * (j + 0.5) / N);
+  expr_eval_n(f, xs, ys, N);
+  for (j = 0; j < N; j++) if (!isfinite(ys[j])) return INFINITY;
+  for (k = 0; k < N; k++) {
+    double c = 0.0;
+    for (j = 0; j < N; j++) c += ys[j] * cos(M_PI * k * (j + 0.5) / N);
+    cheb[k] = c * (k ? 2.0 : 1.0) / N;
+  }
+
+  /* the check points; the last piece's include 1 itself */
+  for (m = 0; m < EXPR_FIT_CHECK; m++) xs[m] = a + (b - a) * m / EXPR_FIT_CHECK;
+  if (b == 1.0) xs[m++] = 1.0;
+  expr_eval_n(f, xs, ys, (size_t)m);
+  for (j = 0; j < m; j++) if (!isfinite(ys[j])) return INFINITY;
+
+  memset(t, 0, sizeof(t));
+  memset(tprev, 0, sizeof(tprev));
+  memset(mono, 0, sizeof(mono));
+  t[0] = 1.0;
+  for (k = 0; k < N; k++) {
+    double scale = 1.0;
+    for (i = 0; i <= k; i++) mono[i] += cheb[k] * t[i];
+    /* in x - mid: the coefficient of u**i is that of ((x - mid)/h)**i / h**i */
+    p->degree = k;
+    for (i = 0; i <= k; i++, scale /= h) p->c[i] = mono[i] * scale;
+    for (err = 0.0, j = 0; j < m; j++) {
+      double e = fabs(fit_horner(p, xs[j]) - ys[j]);
+      if (!(e <= err)) err = e;
+    }
+    if (err <= maxerr) return err;
+    /* T_1 = t, and T_k+1 = 2 t T_k - T_k-1 */
+    for (i = 0; i < N; i++)
+      tnext[i] = (i ? (k ? 2.0 : 1.0) * t[i - 1] : 0.0) - tprev[i];
+    memcpy(tprev, t, sizeof(t));
+    memcpy(t, tnext, sizeof(t));
+  }
+  p->degree = -1;
+  return err;
+}
+
+/* Fit f on [0,1], halving pieces as needed; pieces, in order, has room
+ * for 1 << EXPR_FIT_DEPTH. Returns how many there are; *err is the
+ * largest error of the fitted ones, and *fitted their number.
+ */
+static size_t
+fit_pieces(const EXPR * f, double maxerr, FITPIECE * pieces,
+           size_t * fitted, double * err)
+{
+  double lo[EXPR_FIT_DEPTH + 2], hi[EXPR_FIT_DEPTH + 2];
+  int depth[EXPR_FIT_DEPTH + 2];
+  size_t n = 0, sp = 0;
+
+  *fitted = 0;
+  *err = 0.0;
+  lo[sp] = 0.0;
+  hi[sp] = 1.0;
+  depth[sp++] = 0;
+  while (sp) {
+    double a, b, e;
+    int d;
+    --sp;
+    a = lo[sp];
+    b = hi[sp];
+    d = depth[sp];
+    e = fit_piece(f, a, b, maxerr, &(pieces[n]));
+    if (pieces[n].degree < 0 && d < EXPR_FIT_DEPTH) {
+      /* the right half after the left */
+      lo[sp] = (a + b) / 2; hi[sp] = b; depth[sp++] = d + 1;
+      lo[sp] = a; hi[sp] = (a + b) / 2; depth[sp++] = d + 1;
+      continue;
+    }
+    if (pieces[n].degree >= 0) {
+      ++*fitted;
+      if (e > *err) *err = e;
+    }
+    n++;
+  }
+  return n;
+}
+
+/* Append the table of the n pieces to info's pool, its length first,
+ * as OP_LUT's are. Returns where, or -1 when out of memory.
+ */
+static long
+fit_table(EXPR * info, const FITPIECE * pieces, size_t n)
+{
+  size_t cells = (size_t)1 << EXPR_FIT_DEPTH, len = 2 + cells, i, j, k;
+  double * t;
+  long at = (long)info->npool;
+
+  for (i = 0; i < n; i++)
+    if (pieces[i].degree >= 0) len += 3 + (size_t)pieces[i].degree;
+  t = (double *)realloc(info->pool, sizeof(double) * (info->npool + len));
+  if (!t) return -1;
+  info->pool = t;
+  t += info->npool;
+  info->npool += len;
+
+  t[0] = (double)(len - 1);
+  t[1] = (double)cells;
+  for (i = 0, k = 2 + cells; i < n; i++) {
+    const FITPIECE * p = &(pieces[i]);
+    size_t c0 = (size_t)(p->a * (double)cells), c1 = (size_t)(p->b * (double)cells);
+    for (j = c0; j < c1; j++) t[2 + j] = p->degree < 0 ? 0.0 : (double)k;
+    if (p->degree < 0) continue;
+    t[k++] = (p->a + p->b) / 2;
+    t[k++] = (double)p->degree;
+    for (j = 0; j <= (size_t)p->degree; j++) t[k++] = p->c[j];
+  }
+  return at;
+}
+
+/* Replace *code, parsed and folded, with its fit, within maxerr at the
+ * check points, and count the pieces in info. The code is left alone when nothing fits,
+ * or when out of memory.
+ */
+static void
+expr_fit(EXPR * info, OPCODE ** code, size_t * capacity, int flags,
+         double maxerr)
+{
+  FITPIECE * pieces;
+  OPCODE * tmp, * res;
+  EXPR finfo = *info, * f;
+  double err;
+  size_t len, n, fitted;
+  long at;
+
+  for (len = 0; (*code)[len].type != OP_EOF; len++) /**/;
+  if (!(tmp = (OPCODE *)malloc(sizeof(OPCODE) * *capacity))) return;
+  memcpy(tmp, *code, sizeof(OPCODE) * (len + 1));
+  f = expr_finish(&finfo, tmp, *capacity,
+                  (flags & (EXPR_EXACT | EXPR_FMA)) | EXPR_NO_GRID);
+  free(tmp);
+  if (!f) return;
+
+  pieces = (FITPIECE *)malloc(sizeof(FITPIECE) << EXPR_FIT_DEPTH);
+  res = (OPCODE *)malloc(sizeof(OPCODE) * (*capacity + 3));
+  if (pieces && res && (n = fit_pieces(f, maxerr, pieces, &fitted, &err)) &&
+      fitted && (at = fit_table(info, pieces, n)) >= 0) {
+    res[0].type = OP_X;
+    res[0].value = 0.0;
+    res[1].type = OP_POLY;
+    res[1].value = (double)at;
+    memcpy(res + 2, *code, sizeof(OPCODE) * len);
+    res[len + 2].type = OP_COAL;
+    res[len + 2].value = 0.0;
+    opcode_copy(&(res[len + 3]), &((*code)[len]));
+    free(*code);
+    *code = res;
+    *capacity += 3;
+    res = NULL;
+    info->fitted = fitted;
+    info->fiterr = err;
+  }
+  if (res) free(res);
+  if (pieces) free(pieces);
+  expr_delete(f);
+}
+
+/* ********************************************************************** */
+/* Constructor */
+/* ********************************************************************** */
+
+/* Set up what all programs share: the CPU's features, and the label
+ * tables of the threaded evaluators.
+ */
+static void
+expr_init(void)
+{
+#ifdef EXPR_SIMD
+  expr_simd_init();
+#endif
+  expr_fma = expr_has_fma();
+  tok_build();
+#ifdef EXPR_THREADED
+  expr_eval_register(NULL, NULL, 0.0, NULL);
+#endif
+}
+
+#ifdef EXPR_THREADS
+static pthread_once_t expr_once = PTHREAD_ONCE_INIT;
+#define expr_init_once()  pthread_once(&expr_once, expr_init)
+#else
+static int expr_ready = 0;
+#define expr_init_once()  do { \
+    if (!expr_ready) { expr_init(); expr_ready = 1; } \
+  } while (0)
+#endif
+
+/* Point ctx at the doubles which follow it, expr_ctx_size of them.
+ */
+static void
+expr_ctx_layout(EXPR_CTX * ctx, size_t depth, size_t nslots)
+{
+  ctx->depth = depth;
+  ctx->nslots = nslots;
+  ctx->stack = (double *)(void *)(ctx + 1);
+  ctx->slots = ctx->stack + depth + 1;
+  ctx->block = ctx->slots + nslots;
+  ctx->blockslots = ctx->block + EXPR_BLOCK * depth;
+}
+
+static EXPR_CTX *
+expr_ctx_alloc(size_t depth, size_t nslots)
+{
+  /* zeroed so vector kernels never read uninitialized lanes */
+  EXPR_CTX * ctx = (EXPR_CTX *)calloc(1, sizeof(EXPR_CTX) +
+                     sizeof(double) * expr_ctx_size(depth, nslots));
+  if (!ctx) return NULL;
+  expr_ctx_layout(ctx, depth, nslots);
+  return ctx;
+}
+
+EXPR_CTX *
+expr_ctx_new(const EXPR * ex)
+{
+  if (!ex) return NULL;
+  return expr_ctx_alloc(ex->depth, ex->nslots);
+}
+
+void
+expr_ctx_delete(EXPR_CTX * ctx)
+{
+  if (ctx) free(ctx);
+}
+
+EXPR *
+expr_new(const char * src)
+{
+  return expr_new_with(src, 0);
+}
+
+EXPR *
+expr_new_with(const char * src, int flags)
+{
+  return expr_new_ex(src, flags, error_handler, error_handler_ctxt);
+}
+
+/* The back end: pack code into the program's single allocation (the
+ * EXPR, its context and that context's buffers, the pool, then the
+ * bytecode), and translate it for the evaluators flags asks for. The
+ * OPCODEs are only needed while compiling, and by the translators.
+ * info has the compiler's counts, and in its pool the tables that
+ * code's OP_LUTs refer to; those are moved to the program's pool.
+ * Returns NULL when out of memory.
+ */
+static EXPR *
+expr_build(const EXPR * info, OPCODE * code, int flags)
+{
+  EXPR * ex = NULL;
+  size_t * at, * idx, len, size, codelen, npool, i;
+  double * pool;
+  unsigned char * widths = NULL;
+
+  for (len = 0; code[len].type != OP_EOF; len++) /**/;
+  at = (size_t *)malloc(sizeof(size_t) * (len + 1));
+  idx = (size_t *)malloc(sizeof(size_t) * (len + 1));
+  pool = (double *)malloc(sizeof(double) * (len + 1 + info->npool));
+  assert(at && idx && pool);
+  if (!at || !idx || !pool) goto done;
+  codelen = expr_pack_layout(code, len, info->pool, info->npool,
+                             at, idx, pool, &npool);
+  if (!codelen) goto done;
+  for (i = 0; i < len; i++)
+    if (op_hasTable(code[i].type)) code[i].value = (double)idx[i];
+
+  size = sizeof(EXPR) + sizeof(EXPR_CTX) +
+    sizeof(double) * (expr_ctx_size(info->depth, info->nslots) + npool);
+  ex = (EXPR *)calloc(1, size + codelen);
+  assert(ex);
+  if (!ex) goto done;
+  ex->folded = info->folded;
+  ex->rewritten = info->rewritten;
+  ex->shared = info->shared;
+  ex->nslots = info->nslots;
+  ex->branches = info->branches;
+  ex->depth = info->depth;
+  ex->fitted = info->fitted;
+  ex->fiterr = info->fiterr;
+  ex->exact = flags & (EXPR_EXACT | EXPR_FMA);
+  ex->tier = flags & (EXPR_FLOAT | EXPR_FAST);
+  ex->ctx = (EXPR_CTX *)(void *)(ex + 1);
+  expr_ctx_layout(ex->ctx, ex->depth, ex->nslots);
+  ex->pool = ex->ctx->blockslots + EXPR_BLOCK * ex->nslots;
+  ex->npool = npool;
+  memcpy(ex->pool, pool, sizeof(double) * npool);
+  ex->code = (unsigned char *)ex + size;
+  ex->codelen = codelen;
+  expr_pack(code, len, at, idx, ex->code);
+
+#ifdef EXPR_JIT
+  if (flags & EXPR_VM_JIT) widths = expr_widths(code);
+#endif
+  if (flags & (EXPR_VM_REGISTER | EXPR_VM_JIT))
+    ex->regs = expr_lower(code, widths);
+#ifdef EXPR_JIT
+  if ((flags & EXPR_VM_JIT) && ex->regs)
+    ex->jit = expr_jit((const REGOP *)ex->regs, widths, ex->pool, ex->depth,
+                       ex->nslots, &(ex->jitsize));
+#endif
+#ifdef EXPR_CC
+  if ((flags & EXPR_VM_CC) && (ex->ccso = expr_cc(code, ex->depth, ex->nslots)) != NULL) {
+    ex->cc = dlsym(ex->ccso, "expr_cc_eval");
+    ex->ccn = dlsym(ex->ccso, "expr_cc_eval_n");
+    if (!ex->cc || !ex->ccn) ex->cc = ex->ccn = NULL;
+  }
+#endif
+
+done:
+  if (widths) free(widths);
+  if (pool) free(pool);
+  if (idx) free(idx);
+  if (at) free(at);
+  return ex;
+}
+
+EXPR *
+expr_new_ex(const char * src, int flags,
+            void (*handle)(const char *, void *), void * ctxt)
+{
+  return expr_new_lib(src, flags, NULL, handle, ctxt);
+}
+
+EXPR_LIB *
+expr_lib_new(const char * const * srcs,
+             void (*handle)(const char *, void *), void * ctxt)
+{
+  EXPR_LIB * lib;
+  size_t i, n;
+
+  expr_init_once();
+  if (!handle) handle = default_error_handler;
+
+  for (n = 0; srcs && srcs[n]; n++) /**/;
+  lib = (EXPR_LIB *)calloc(1, sizeof(EXPR_LIB));
+  if (!lib) return NULL;
+  for (lib->nslots = 8; lib->nslots < 2 * n; lib->nslots *= 2) /**/;
+  lib->funcs = (EXPRFUNC *)calloc(n ? n : 1, sizeof(EXPRFUNC));
+  lib->slots = (size_t *)calloc(lib->nslots, sizeof(size_t));
+  if (!lib->funcs || !lib->slots) goto fail;
+
+  for (i = 0; i < n; i++) {
+    EXPRFUNC * f = &(lib->funcs[lib->nfuncs]);
+    int argc = lib_header(srcs[i], NULL) - 1;
+    size_t k;
+    if (argc < 0) continue; /* an expression, not a definition */
+    f->text = (char *)malloc(strlen(srcs[i]) + 1);
+    f->params = (EXPRBIND *)calloc(argc ? (size_t)argc : 1, sizeof(EXPRBIND));
+    lib->nfuncs++;
+    if (!f->text || !f->params) goto fail;
+    strcpy(f->text, srcs[i]);
+    lib_header(f->text, f);
+    if (tok_ident(f->name, f->len) == OP_EOF &&
+        lib_find(lib, f->name, f->len) == (size_t)-1) {
+      for (k = tok_hash(f->name, f->len) & (lib->nslots - 1); lib->slots[k];
+           k = (k + 1) & (lib->nslots - 1)) /**/;
+      if (lib_check(lib, f, handle, ctxt)) f->state = LIB_FAILED;
+      lib->slots[k] = lib->nfuncs;
+    } else {
+      lib_check(lib, f, handle, ctxt);
+      f->state = LIB_FAILED;
+    }
+  }
+
+  /* in any order: each compiles what it calls first */
+  for (i = 0; i < lib->nfuncs; i++)
+    if (lib->funcs[i].state == LIB_PENDING)
+      lib_compile(lib, &(lib->funcs[i]), handle, ctxt);
+  return lib;
+
+fail:
+  expr_lib_delete(lib);
+  return NULL; /* no error printing on out-of-mem */
+}
+
+void
+expr_lib_delete(EXPR_LIB * lib)
+{
+  size_t i;
+  if (!lib) return;
+  for (i = 0; i < lib->nfuncs; i++) {
+    if (lib->funcs[i].text) free(lib->funcs[i].text);
+    if (lib->funcs[i].params) free(lib->funcs[i].params);
+    if (lib->funcs[i].code) free(lib->funcs[i].code);
+    if (lib->funcs[i].pool) free(lib->funcs[i].pool);
+  }
+  if (lib->funcs) free(lib->funcs);
+  if (lib->slots) free(lib->slots);
+  free(lib);
+}
+
+/* Parse src, which may be a definition of one parameter or none, to
+ * be compiled as its body with the parameter standing for x. *pool
+ * is as for expr_parse, and stays NULL if src is not parsed.
+ */
+static int
+expr_parse_lib(const char * src, OPCODE ** out, size_t * outlen,
+               double ** pool, size_t * npool,
+               void (*handle)(const char *, void *), void * ctxt,
+               const EXPR_LIB * lib)
+{
+  EXPRFUNC def;
+  EXPRBIND param;
+  size_t i;
+  /* only compiled while it is built, by expr_lib_new */
+  EXPR_LIB * lib0 = (EXPR_LIB *)lib;
+
+  if (lib_header(src, NULL) == 0)
+    return expr_parse(src, out, outlen, pool, npool, handle, ctxt, lib0, NULL);
+
+  memset(&def, 0, sizeof(def));
+  def.text = (char *)src;
+  def.params = &param;
+  if (lib_header(src, NULL) > 2) {
+    EXPRSTATE pex0;
+    tok_init(&pex0, src, NULL, 0);
+    pex0.handler = handle;
+    pex0.ctxt = ctxt;
+    pex0.curoffs = 1;
+    return expr_error(&pex0, "a curve takes at most 1 arg, found %d",
+                      lib_header(src, NULL) - 1);
+  }
+  lib_header(src, &def);
+  if (expr_parse(src, out, outlen, pool, npool, handle, ctxt, lib0, &def))
+    return -1;
+  for (i = 0; (*out)[i].type != OP_EOF; i++)
+    if ((*out)[i].type == OP_PARAM) {
+      (*out)[i].type = OP_X;
+      (*out)[i].value = 0.0;
+    }
+  return 0;
+}
+
+/* The passes after parsing and folding, and the back end; and the
+ * copy for expr_eval_grid. The copy runs on the block evaluators,
+ * where expr_eval_n runs the program itself unless the JIT or cc take
+ * it a sample at a time; those can't read the generated slots, so a
+ * program for them, as one with EXPR_EXACT, gets no copy, and
+ * expr_eval_grid gives the same samples as its expr_eval_n.
+ */
+static EXPR *
+expr_finish(EXPR * info, OPCODE * code, size_t capacity, int flags)
+{
+  EXPR ginfo, * ex;
+  OPCODE * grid = NULL;
+  GRIDGEN * gens = NULL;
+  size_t ngens = 0;
+
+  if (!(flags & EXPR_EXACT)) {
+    info->rewritten = expr_rewrite(code, capacity, flags);
+  }
+  expr_sink(code);
+  expr_branch_mark(code);
+  info->nslots = expr_share(code, &(info->shared));
+  if (!(flags & (EXPR_EXACT | EXPR_NO_GRID)) &&
+      ((flags & EXPR_FLOAT) || !(flags & (EXPR_VM_JIT | EXPR_VM_CC))))
+    grid = expr_grid(code, capacity, info->nslots, &gens, &ngens);
+  info->branches = expr_branch(code, capacity);
+  info->depth = expr_depth(code);
+  ex = expr_build(info, code, flags);
+  if (grid) {
+    ginfo = *info;
+    ginfo.nslots += ngens;
+    ginfo.branches = expr_branch(grid, capacity);
+    ginfo.depth = expr_depth(grid);
+    if (ex && (ex->grid = expr_build(&ginfo, grid,
+                                     flags & (EXPR_FLOAT | EXPR_FAST)))) {
+      ex->grid->gens = gens;
+      ex->grid->ngens = ngens;
+      gens = NULL;
+    }
+    free(grid);
+    free(gens);
+  }
+  return ex;
+}
+
+/* maxerr, when positive, fits the curve; see expr_fit.
+ */
+static EXPR *
+expr_compile(const char * src, int flags, const EXPR_LIB * lib, double maxerr,
+             void (*handle)(const char *, void *), void * ctxt)
+{
+  EXPR info, * ex = NULL;
+  OPCODE * code;
+  size_t srclen, capacity;
+
+  expr_init_once();
+  if (!handle) handle = default_error_handler;
+
+  if (!src || !*src) src = "x";
+
+  /* worst case: opcode count == srclen + eof
+   * worst case: func(every, token, gets, pushed, onto, the, stack)
+   * let-bound names may grow it; see expr_reserve
+   */
+  srclen = strlen(src) + 1;
+
+  if (srclen >= (size_t)(INT_MAX / sizeof(OPCODE)))
+    return NULL; /* don't worry too much: 32-bits -> ~536M opcodes */
+
+  capacity = srclen;
+  code = (OPCODE *)malloc(sizeof(OPCODE) * capacity);
+  assert(code);
+  if (!code) return NULL;
+
+  memset(&info, 0, sizeof(info));
+  if (!expr_parse_lib(src, &code, &capacity, &(info.pool), &(info.npool),
+                      handle, ctxt, lib)) {
+    info.folded = expr_optimize(code);
+    if (maxerr > 0.0) expr_fit(&info, &code, &capacity, flags, maxerr);
+    ex = expr_finish(&info, code, capacity, flags);
+  }
+  if (info.pool) free(info.pool);
+  free(code);
+  return ex; /* no error printing on out-of-mem */
+}
+
+EXPR *
+expr_new_lib(const char * src, int flags, const EXPR_LIB * lib,
+             void (*handle)(const char *, void *), void * ctxt)
+{
+  return expr_compile(src, flags, lib, 0.0, handle, ctxt);
+}
+
+EXPR *
+expr_new_fit(const char * src, int flags, const EXPR_LIB * lib,
+             double maxerr, double * err,
+             void (*handle)(const char *, void *), void * ctxt)
+{
+  EXPR * ex;
+  if (!(maxerr > 0.0)) return NULL;
+  ex = expr_compile(src, flags, lib, maxerr, handle, ctxt);
+  if (ex && err) *err = ex->fiterr;
+  return ex;
+}
+
+void
+expr_delete(EXPR * ex)
+{
+  if (ex) {
+#ifdef EXPR_CC
+    if (ex->ccso) dlclose(ex->ccso);
+#endif
+#ifdef EXPR_JIT
+    if (ex->jit) munmap(ex->jit, ex->jitsize);
+#endif
+    if (ex->regs) free(ex->regs);
+    if (ex->gens) free(ex->gens);
+    expr_delete(ex->grid);
+    free(ex);
+  }
+}
+
+/* ********************************************************************** */
+/* Serialization */
+/* ********************************************************************** */
+
+/* The format, every number little-endian:
+ *   "expr", the format version, and a hash of the operator table, 4
+ *     bytes each; a program from another build's table is refused
+ *   the flags it was compiled with, the counts of struct EXPR_s from
+ *     folded to fitted, then npool and codelen, 4 bytes each
+ *   fiterr, as the pool's numbers are
+ *   the pool, each number's IEEE 754 bits in 8 bytes
+ *   the bytecode
+ *   an FNV-1a hash of all of the above, 4 bytes
+ * Loading checks everything an evaluator relies on: that each opcode
+ * exists, each index, slot and table is in range, each jump lands forward on
+ * an opcode where the stack is as deep as on falling through, and the
+ * stack stays within the depth. That protects against stale or
+ * damaged data; the hash makes damage unlikely to get that far.
+ */
+#define EXPR_SERIAL_VERSION  2
+#define EXPR_SERIAL_HEAD     (4 * 15)
+
+static void
+ser_put(unsigned char * p, unsigned long v)
+{
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+  p[2] = (unsigned char)(v >> 16);
+  p[3] = (unsigned char)(v >> 24);
+}
+
+static unsigned long
+ser_get(const unsigned char * p)
+{
+  return (unsigned long)p[0] | (unsigned long)p[1] << 8 |
+         (unsigned long)p[2] << 16 | (unsigned long)p[3] << 24;
+}
+
+static unsigned long
+ser_hash(unsigned long h, const unsigned char * p, size_t len)
+{
+  for (; len; len--, p++) h = ((h ^ *p) * 0x01000193UL) & 0xFFFFFFFFUL;
+  return h;
+}
+
+/* Changes when an operator is added, removed, renumbered or renamed.
+ */
+static unsigned long
+ser_optab_hash(void)
+{
+  unsigned long h = 0x811C9DC5UL;
+  unsigned char argc;
+  int t;
+  for (t = _OP_MIN; t <= _OP_MAX; t++) {
+    h = ser_hash(h, (const unsigned char *)op_name(t), strlen(op_name(t)) + 1);
+    argc = (unsigned char)op_argc(t);
+    h = ser_hash(h, &argc, 1);
+  }
+  return h;
+}
+
+/* The varint at p, if it ends before end, else NULL.
+ */
+static const unsigned char *
+ser_index(const unsigned char * p, const unsigned char * end, size_t * i)
+{
+  int shift = 0;
+  *i = 0;
+  do {
+    if (p == end || shift >= (int)(sizeof(size_t) * 8)) return NULL;
+    *i |= (size_t)(*p & 0x7F) << shift;
+    shift += 7;
+  } while (*p++ & 0x80);
+  return p;
+}
+
+size_t
+expr_serialize(const EXPR * ex, void * buf, size_t len)
+{
+  unsigned char * p = (unsigned char *)buf;
+  size_t size, i;
+  unsigned long long u;
+
+  if (!ex) return 0;
+  if (ex->codelen > 0xFFFFFFFFUL || ex->npool > 0xFFFFFFFFUL / 8 ||
+      ex->folded > 0xFFFFFFFFUL || ex->rewritten > 0xFFFFFFFFUL)
+    return 0; /* the others are no bigger than codelen */
+  size = EXPR_SERIAL_HEAD + ex->npool * 8 + ex->codelen + 4;
+  if (!p || len < size) return size;
+
+  memcpy(p, "expr", 4);
+  ser_put(p + 4, EXPR_SERIAL_VERSION);
+  ser_put(p + 8, ser_optab_hash());
+  ser_put(p + 12, (unsigned long)ex->exact);
+  ser_put(p + 16, (unsigned long)ex->folded);
+  ser_put(p + 20, (unsigned long)ex->rewritten);
+  ser_put(p + 24, (unsigned long)ex->shared);
+  ser_put(p + 28, (unsigned long)ex->nslots);
+  ser_put(p + 32, (unsigned long)ex->branches);
+  ser_put(p + 36, (unsigned long)ex->depth);
+  ser_put(p + 40, (unsigned long)ex->fitted);
+  ser_put(p + 44, (unsigned long)ex->npool);
+  ser_put(p + 48, (unsigned long)ex->codelen);
+  u = bc_bits(ex->fiterr);
+  ser_put(p + 52, (unsigned long)(u & 0xFFFFFFFFUL));
+  ser_put(p + 56, (unsigned long)(u >> 32));
+  p += EXPR_SERIAL_HEAD;
+  for (i = 0; i < ex->npool; i++, p += 8) {
+    u = bc_bits(ex->pool[i]);
+    ser_put(p, (unsigned long)(u & 0xFFFFFFFFUL));
+    ser_put(p + 4, (unsigned long)(u >> 32));
+  }
+  memcpy(p, ex->code, ex->codelen);
+  p += ex->codelen;
+  ser_put(p, ser_hash(0x811C9DC5UL, (const unsigned char *)buf, size - 4));
+  return size;
+}
+
+/* Check the bytecode, and turn it back into OPCODEs with jumps to
+ * opcode indices. Returns 0 when it is not something expr_build made.
+ */
+static int
+ser_decode(const EXPR * info, const double * pool, size_t npool,
+           const unsigned char * bc, size_t codelen, OPCODE * code)
+{
+  const unsigned char * p = bc, * end = bc + codelen;
+  size_t * index, * want, n = 0, depth = 0, i;
+  const size_t none = (size_t)-1;
+  int ok = 0;
+
+  index = (size_t *)malloc(sizeof(size_t) * codelen * 2);
+  if (!index) return 0;
+  want = index + codelen;
+  for (i = 0; i < codelen * 2; i++) index[i] = none;
+
+  while (p < end) {
+    size_t off = (size_t)(p - bc), argc;
+    expr_oper_t type = (expr_oper_t)*p++;
+    if (type > _OP_MAX) goto done;
+    if (want[off] != none && want[off] != depth) goto done;
+    index[off] = n;
+    code[n].type = type;
+    code[n].value = 0.0;
+    argc = (size_t)op_argc(type);
+    if (depth < argc) goto done;
+    depth -= argc;
+    if (type == OP_NUMBER) {
+      if (!(p = ser_index(p, end, &i)) || i >= npool) goto done;
+      code[n].value = pool[i];
+    } else if (op_hasTable(type)) {
+      if (!(p = ser_index(p, end, &i)) || i >= npool ||
+          !(pool[i] >= 1.0 && pool[i] <= (double)(npool - i - 1)) ||
+          pool[i] != floor(pool[i]))
+        goto done;
+      code[n].value = (double)i;
+    } else if (op_isJump(type)) {
+      if (end - p < BC_JUMPLEN) goto done;
+      i = (size_t)ser_get(p);
+      p += BC_JUMPLEN;
+      if (i <= off || i >= codelen) goto done;
+      if (want[i] != none && want[i] != depth + op_jumpKeeps(type)) goto done;
+      want[i] = depth + op_jumpKeeps(type);
+      code[n].value = (double)i;
+    } else if (op_hasValue(type)) {
+      if (!(p = ser_index(p, end, &i)) || i >= info->nslots) goto done;
+      code[n].value = (double)i;
+    }
+    n++;
+    if (type == OP_EOF) {
+      if (p != end || depth != 1) goto done;
+      break;
+    }
+    if (op_pushes(type) && ++depth > info->depth) goto done;
+  }
+  if (!n || code[n - 1].type != OP_EOF) goto done;
+  for (i = 0; i < n; i++) {
+    if (op_isJump(code[i].type)) {
+      size_t to = index[(size_t)code[i].value];
+      if (to == none) goto done;
+      code[i].value = (double)to;
+    }
+  }
+  ok = 1;
+done:
+  free(index);
+  return ok;
+}
+
+EXPR *
+expr_deserialize(const void * buf, size_t len, int flags)
+{
+  const unsigned char * p = (const unsigned char *)buf;
+  EXPR info, * ex = NULL;
+  OPCODE * code = NULL;
+  double * pool = NULL;
+  size_t npool, codelen, i;
+  unsigned long long u;
+
+  expr_init_once();
+  if (!p || len < EXPR_SERIAL_HEAD + 4) return NULL;
+  if (memcmp(p, "expr", 4) || ser_get(p + 4) != EXPR_SERIAL_VERSION ||
+      ser_get(p + 8) != ser_optab_hash() ||
+      ser_get(p + 12) != (unsigned long)(flags & (EXPR_EXACT | EXPR_FMA)) ||
+      ser_get(p + len - 4) != ser_hash(0x811C9DC5UL, p, len - 4))
+    return NULL;
+
+  memset(&info, 0, sizeof(info));
+  info.folded = (size_t)ser_get(p + 16);
+  info.rewritten = (size_t)ser_get(p + 20);
+  info.shared = (size_t)ser_get(p + 24);
+  info.nslots = (size_t)ser_get(p + 28);
+  info.branches = (size_t)ser_get(p + 32);
+  info.depth = (size_t)ser_get(p + 36);
+  info.fitted = (size_t)ser_get(p + 40);
+  npool = (size_t)ser_get(p + 44);
+  codelen = (size_t)ser_get(p + 48);
+  u = (unsigned long long)ser_get(p + 52) |
+      (unsigned long long)ser_get(p + 56) << 32;
+  memcpy(&(info.fiterr), &u, sizeof(u));
+  if (npool > len / 8 || codelen > len ||
+      len != EXPR_SERIAL_HEAD + npool * 8 + codelen + 4 ||
+      info.depth > codelen || info.nslots > codelen || info.fitted > codelen)
+    return NULL;
+
+  pool = (double *)malloc(sizeof(double) * (npool + 1));
+  code = (OPCODE *)malloc(sizeof(OPCODE) * (codelen + 1));
+  if (pool && code) {
+    p += EXPR_SERIAL_HEAD;
+    for (i = 0; i < npool; i++, p += 8) {
+      u = (unsigned long long)ser_get(p) |
+          (unsigned long long)ser_get(p + 4) << 32;
+      memcpy(&(pool[i]), &u, sizeof(u));
+    }
+    info.pool = pool;
+    info.npool = npool;
+    if (ser_decode(&info, pool, npool, p, codelen, code))
+      ex = expr_build(&info, code, flags);
+  }
+  if (pool) free(pool);
+  if (code) free(code);
+  return ex;
+}
+
+/* ********************************************************************** */
+/* Debugging */
+/* ********************************************************************** */
+
+static void
+print_opcode(FILE * out, const OPCODE * opc)
+{
+  if (opc->type == OP_NUMBER) {
+    fprintf(out, "(%.23g)", opc->value);
+  } else if (opc->type == OP_LOAD || opc->type == OP_STORE) {
+    fprintf(out, "%s%lu", op_name(opc->type), (unsigned long)opc->value);
+  } else if (op_isJump(opc->type)) {
+    fprintf(out, "%s@%lu", op_name(opc->type), (unsigned long)opc->value);
+  } else if (op_hasTable(opc->type)) {
+    fprintf(out, "%s[%lu]", op_name(opc->type), (unsigned long)opc->value);
+  } else
+    fprintf(out, "%s", op_name(opc->type));
+}
+
+void
+expr_dump(const EXPR * ex, FILE * out)
+{
+  const unsigned char * pc;
+  OPCODE op;
+  size_t n = 0;
+  if (!ex) return;
+  for (pc = ex->code; ; n++) {
+    op.type = (expr_oper_t)*pc++;
+    op.value = op_hasValue(op.type) ? bc_value(ex, op.type, &pc) : 0.0;
+    print_opcode(out, &op);
+    if (op.type == OP_EOF) break;
+    fprintf(out, " ");
+  }
+  fprintf(out, "\n  %lu opcodes in %lu bytes with %lu numbers, "
+          "%lu removed by folding, %lu rewrites, "
+          "%lu shared through %lu slots, %lu branches\n",
+          (unsigned long)n, (unsigned long)ex->codelen,
+          (unsigned long)ex->npool, (unsigned long)ex->folded,
+          (unsigned long)ex->rewritten, (unsigned long)ex->shared,
+          (unsigned long)ex->nslots, (unsigned long)ex->branches);
+  if (ex->fitted)
+    fprintf(out, "  %lu pieces fitted, error %g at the check points\n",
+            (unsigned long)ex->fitted, ex->fiterr);
+  if (ex->grid)
+    fprintf(out, "  %lu subtrees run incrementally on a grid\n",
+            (unsigned long)ex->grid->ngens);
+  fflush(out);
+}
+
+/* ********************************************************************** */
+/* Test */
+/* ********************************************************************** */
+
+#ifdef TEST
+
+#include <time.h>
+
+struct test_s {
+  double rv;
+  char * src;
+} tests[] = {
+  { 0.5, "x" },
+  { 1.0/M_PHI, "1/PHI" },
+  { M_PHI, "PHI" },
+  { M_E, "E" },
+  { M_GAMMA, "GAMMA" },
+  { 55.0*5.0, "55*5" },
+  { 1.0+ +2e3, "1++2e3" },
+  { 1.0?2.0:3.0, "1?2:3" },
+  { 1.0+2.0?3.0+4.0:5.0+6.0, "1+2?3+4:5+6" },
+  { 0.0?1.0:2.0 ? 3.0?4.0:5.0 : 6.0?7.0:8.0, "0?1:2 ? 3?4:5 : 6?7:8" },
+  { 5.0+0.5*7.0, "5+x*7" },
+  { 5.0*0.5+7.0, "5*x+7" },
+  { +5+-3- -3+ +3-+3, "+5+-3--3++3-+3" },
+  { ~-!-3, "~-!-3" },
+  { 5>>3>=2, "5>>3>=2" },
+  { 1.5875015614538918, "log((5 * 9),(4 + 7))" },
+  { 0.9163138199826525, "log(5 ? 9 : 8,4 + 7)" },
+  { -(-2.0+5.0/3.0), "abs(-2+5/3)" },
+  { 0.0, "0 && x" },
+  { M_TAU, "TAU || x" },
+  { -0.0, "-0" },
+  { INFINITY, "1/0" },
+  { 4.0, "atanh(5)??4" },
+  { 1.0, "5>4>=3>>2" },
+  { 1.0, "5<4<=3<<2" },
+  { 0.0, "5==4!=3==!2" },
+  { 3.0, "6^5 && 4&3 || 2|1" },
+  { 7.0, "7 || 6|5 && 4&3" },
+  { 5.0, "root(5*5, 2)" },
+  { 0.75, "a = x*x; a + a*2" },
+  { 2.5, "a = x; a = a + 1; b = a*2; b - a + 1" },
+  { 1.0, "s = sin(x*PI); s*s" },
+  { 0.5, "unused = sin(x); x" },
+  { 6.0, "k = 2*2; k*x + k" },
+  { -0.25, "a = x*x; b = a + a; c = b*b; x < .5 ? 0 : c + b*1.5 - 1.25" },
+  { 0.75, "a = x*3; x < .25 ? 0 : x < .75 ? a*a - a : a" },
+  { 1.0, "a = x*x*4; (x < .25 ? a : 0) + a" },
+  { 7.0, "root(7*7*7, 3) == 7 ? 44 : cbrt(7*7*7)" },
+  { 9.0, "root(9*9*9*9, 4)" },
+  { 0.47942553860420300027328*2.0, "sin(x)+sin(x)" },
+  { 2.0*2.0+2.0-1.0, "(x*2+1)*(x*2+1)+(x*2+1)-x*2" },
+  { 0.87758256189037271611628, "x<.25 ? sin(x*3)+1 : cos(x)" },
+  { 0.87758256189037271611628, "x<.25 ? sin(x) : x<.75 ? cos(x) : tan(x)" },
+  { 0.99749498660405443094172, "(x<.25 ? sin(x*3)+1 : 0) + sin(x*3)" },
+  { 0.99749498660405443094172, "x>.25 && sin(x*3) || tan(x)" },
+  { 1.0471975511965977461542, "asin(x*3) ?? acos(x)" },
+  { 2.0, "lut([0, 2, 4], x)" },
+  { 1.0, "lut([-1, +3], x)" },
+  { 1.125, "lutc([0, 1, 1, 0], x)" },
+  { 3.5, "lut([0, 1], x) + lut([2, 4], x)" },
+  { 4.0, "a = lut([0, 4], x); a*a" },
+  { 2.0, "select(x*4, 0, 1, 2, 3)" },
+  { 3.0, "select(9, 0, 1, 2, 3)" },
+  { 0.0, "select(-1, 0, 1, 2)" },
+  { 0.25, "piecewise(x, .25, 0, .75, x/2, 1)" },
+  { 126.0/255.0, "((x*255)&(x*255<<1))/255" },
+  { 10.0, "~(x*8) & 7 << 1" },
+  { 4.0, "((x*255 & 255) << 2 >> 1) // 3 %% 5" },
+  { 2.0, "x*6 ^ 3 | 1" },
+  { 0.0, NULL }
+};
+
+void
+test_parse(void)
+{
+  double rv = 0.0;
+  EXPR * ex;
+  size_t i;
+  int err;
+  for (i = 0; tests[i].src; i++) {
+
+    printf("parsing '%s'...\n", tests[i].src); fflush(stdout);
+    ex = expr_new(tests[i].src);
+    if (!ex) {
+      printf("parse failed.\n"); fflush(stdout);
+      continue;
+    }
+    printf("parsed. evaling...\n"); fflush(stdout);
+
+    err = expr_eval(ex, 0.5, &rv);
+    printf("eval'ed\n"); fflush(stdout);
+
+    if (err || rv != tests[i].rv) {
+      fprintf(stdout, "    failed: \"%s\": %.23g should be %.23g\n",
+              tests[i].src, rv, tests[i].rv); fflush(stdout);
+
+      fprintf(stdout, "    ");
+      expr_dump(ex, stdout);
+    }
+    expr_delete(ex);
+  }
+}
+
+char * corpus[] = {
+#define EXPRLIT(ex)  ex ,
+#include "expr-defs.inc"
+#undef EXPRLIT
+  NULL
+};
+
+#define same(a,b)  ((a) == (b) || (isnan(a) && isnan(b)))
+
+void
+test_eval_n1(const char * src)
+{
+  double xs[301], ys[301], rv = 0.0;
+  EXPR * ex;
+  size_t i;
+  for (i = 0; i < 301; i++) xs[i] = ((double)i - 50.0) / 200.0;
+  ex = expr_new(src);
+  if (!ex) return;
+  expr_eval_n(ex, xs, ys, 301);
+  for (i = 0; i < 301; i++) {
+    expr_eval(ex, xs[i], &rv);
+    if (!same(rv, ys[i])) {
+      printf("    failed: \"%s\": eval_n(%g) %.23g should be %.23g\n",
+             src, xs[i], ys[i], rv);
+      break;
+    }
+  }
+  expr_delete(ex);
+}
+
+void
+test_eval_n(void)
+{
+  size_t i;
+  for (i = 0; tests[i].src; i++) test_eval_n1(tests[i].src);
+  for (i = 0; corpus[i]; i++) test_eval_n1(corpus[i]);
+  fflush(stdout);
+}
+
+/* EXPR_FLOAT follows double to within float rounding on smooth
+ * curves, and EXPR_FAST flushes denormals without leaving MXCSR
+ * changed; report the speed of each tier's expr_eval_n over the
+ * corpus.
+ */
+static const struct {
+  const char * src;
+  double eps;   /* the largest error allowed, relative above 1 */
+} tiers[] = {
+  { "x*x", 1e-7 },
+  { "sqrt(x)", 1e-7 },
+  { "1 - (1 - x)*(1 - x)", 1e-6 },
+  { "sin(x*PI/2)", 1e-6 },
+  { "exp(-x*8)", 1e-6 },
+  { "pow(x, 1/2.2)", 1e-6 },
+  { "lerp(x, 0.2, 0.8)", 1e-7 },
+  { "x < 0.5 ? 2*x*x : 1 - 2*(1-x)*(1-x)", 1e-6 },
+  { "lut([0, .25, 1], x)", 1e-6 },
+  { "s = sin(x*TAU); s*s + x", 1e-6 },
+  { NULL, 0.0 }
+};
+
+void
+test_tier(void)
+{
+  static const int flags[] = { 0, EXPR_FLOAT, EXPR_FAST, EXPR_FLOAT | EXPR_FAST };
+  static const char * const names[] = { "double", "float", "fast", "float fast" };
+  EXPR * exs[sizeof(corpus) / sizeof(corpus[0])];
+  double xs[256], ys[256], yt[256];
+  volatile double tiny = 1e-310;
+  clock_t t0, tt[4];
+  size_t i, j, n;
+  int k, pass;
+
+  for (j = 0; j < 256; j++) xs[j] = (double)j / 255.0;
+  for (i = 0; tiers[i].src; i++) {
+    EXPR * ex = expr_new(tiers[i].src);
+    for (k = 1; k < 4; k++) {
+      EXPR * et = expr_new_with(tiers[i].src, flags[k]);
+      if (!ex || !et) {
+        printf("    failed: %s \"%s\" didn't compile\n", names[k], tiers[i].src);
+        expr_delete(et);
+        continue;
+      }
+      expr_eval_n(ex, xs, ys, 256);
+      expr_eval_n(et, xs, yt, 256);
+      for (j = 0; j < 256; j++) {
+        if (fabs(yt[j] - ys[j]) > tiers[i].eps * fmax(1.0, fabs(ys[j]))) {
+          printf("    failed: %s \"%s\"(%g): %.17g should be %.17g\n",
+                 names[k], tiers[i].src, xs[j], yt[j], ys[j]);
+          break;
+        }
+      }
+      expr_delete(et);
+    }
+    expr_delete(ex);
+  }
+
+#if defined(__GNUC__) && defined(__SSE2__)
+  for (k = 0; k < 4; k++) {
+    EXPR * ex = expr_new_with("x * 1e-300 * 1e-10", flags[k]);
+    double rv = -1.0;
+    if (expr_eval(ex, 0.5, &rv) || (rv == 0.0) != !!(flags[k] & EXPR_FAST))
+      printf("    failed: %s \"x * 1e-300 * 1e-10\"(0.5): %g\n", names[k], rv);
+    rv = -1.0;
+    if (expr_eval_n(ex, xs + 128, &rv, 1) ||
+        (rv == 0.0) != !!(flags[k] & (EXPR_FAST | EXPR_FLOAT)))
+      printf("    failed: %s eval_n \"x * 1e-300 * 1e-10\": %g\n", names[k], rv);
+    expr_delete(ex);
+  }
+  if (tiny * 0.5 == 0.0)
+    printf("    failed: EXPR_FAST left denormals flushed\n");
+#else
+  (void)tiny;
+#endif
+
+  for (k = 0; k < 4; k++) {
+    for (i = 0, n = 0; corpus[i]; i++)
+      if ((exs[n] = expr_new_with(corpus[i], flags[k])) != NULL) n++;
+    tt[k] = 0;
+    for (pass = 0; pass < 20; pass++) {
+      t0 = clock();
+      for (i = 0; i < n; i++) expr_eval_n(exs[i], xs, yt, 256);
+      tt[k] += clock() - t0;
+    }
+    for (i = 0; i < n; i++) expr_delete(exs[i]);
+    if (k && tt[0] && tt[k])
+      printf("tier %s: %.2fx double\n", names[k], (double)tt[0] / (double)tt[k]);
+  }
+  fflush(stdout);
+}
+
+/* expr_eval_grid follows expr_eval_n in double on the grid, to within
+ * eps of the curve's scale, or float rounding with EXPR_FLOAT, for an
+ * 8-bit and a 16-bit LUT; and runs incrementally where expected. A
+ * wave drifts by a few ulps of its angle, not of its value, so a fast
+ * one, such as sin(x*1000), gets a wider eps.
+ * Report its speed over the corpus, and that of the preview's
+ * EXPR_FLOAT | EXPR_FAST against double.
+ */
+static const struct {
+  const char * src;
+  int grid;     /* whether some subtree runs incrementally */
+  double eps;   /* in double */
+} grids[] = {
+  { "sin(x*PI)", 1, 1e-14 },
+  { "sin(3*x*PI-PI/2)/2+.5", 1, 1e-14 },
+  { "((sin(x*(8*PI)) + sin(x*(4*PI)) + sin(x*(4*PI)))/5)+.5", 1, 1e-14 },
+  { "-cos(x*PI/2)+1", 1, 1e-14 },
+  { "pow(x,3)", 1, 1e-14 },
+  { "pow(x*2 - 1, 4)*x + cos(x*TAU*40)", 1, 2e-13 },
+  { "x < .5 ? sin(x*7) : cos(x*3)", 1, 1e-14 },
+  { "floor(x*x*8)/8 + sin(x*2)", 1, 1e-14 },
+  { "sin(x*1000) * lut([0, 1], x)", 1, 5e-13 },
+  { "((x*255)&(x*255<<1))/255", 0, 0.0 },
+  { "x*x*3 - x + 1", 0, 0.0 },
+  { "log(x+1,2)", 0, 0.0 },
+  { NULL, 0, 0.0 }
+};
+
+/* Curves whose generators would sit under a step, or at the edge of
+ * a domain: expr_eval_grid must give expr_eval_n's samples exactly.
+ */
+static const char * const grid_stepped[] = {
+  "floor(sin(x*PI)*4)",
+  "sin(x*TAU) < 0",
+  "sin(x*TAU)>=0?1:0",
+  "s = sin(x*TAU)*2; floor(s) + (s < 0)",
+  "acos(cos(x*PI*3))/PI",
+  "sqrt(pow(x,3)-pow(x,4))",
+  "asin(cos(x*PI*7))",
+  NULL
+};
+
+void
+test_grid(void)
+{
+  static const int flags[] = { 0, EXPR_FLOAT };
+  static const size_t sizes[] = { 256, 65536, 100, 1 };
+  static double xs[65536], ys[65536], yg[65536];
+  EXPR * exs[sizeof(corpus) / sizeof(corpus[0])];
+  clock_t t0, tg = 0, tn = 0;
+  size_t i, j, s, n, len;
+  unsigned char * a;
+  int k, pass;
+
+  for (i = 0; grids[i].src; i++) {
+    EXPR * ed = expr_new(grids[i].src);
+    for (k = 0; k < 2; k++) {
+      EXPR * ex = expr_new_with(grids[i].src, flags[k]);
+      if (!ed || !ex || !ex->grid != !grids[i].grid) {
+        printf("    failed: grid \"%s\": %s\n", grids[i].src,
+               !ex ? "didn't compile" : ex->grid ? "incremental" : "not incremental");
+        expr_delete(ex);
+        continue;
+      }
+      for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        n = sizes[s];
+        for (j = 0; j < n; j++) xs[j] = n > 1 ? (double)j / (double)(n - 1) : 0.0;
+        expr_eval_n(ed, xs, ys, n);
+        expr_eval_grid(ex, yg, n);
+        for (j = 0; j < n; j++) {
+          double eps = k ? 1e-6 : grids[i].eps;
+          if (!(fabs(yg[j] - ys[j]) <= eps * fmax(1.0, fabs(ys[j])))) {
+            printf("    failed: grid %d \"%s\"(%lu/%lu): %.17g should be %.17g\n",
+                   flags[k], grids[i].src, (unsigned long)j,
+                   (unsigned long)n, yg[j], ys[j]);
+            break;
+          }
+        }
+      }
+      expr_delete(ex);
+    }
+    expr_delete(ed);
+  }
+
+  /* exact, loaded, JIT and cc programs have no grid and run
+   * expr_eval_n */
+  for (k = 0; k < 4; k++) {
+    static const int gflags[] = { EXPR_EXACT, 0, EXPR_VM_JIT, EXPR_VM_CC };
+    static const char * const gnames[] = { "exact", "loaded", "jit", "cc" };
+    EXPR * ex = expr_new_with("sin(x*PI)", gflags[k]), * ld = ex;
+    if (k == 1) {
+      len = expr_serialize(ex, NULL, 0);
+      a = (unsigned char *)malloc(len);
+      expr_serialize(ex, a, len);
+      ld = expr_deserialize(a, len, 0);
+      free(a);
+    }
+    for (j = 0; j < 256; j++) xs[j] = (double)j / 255.0;
+    expr_eval_n(ex, xs, ys, 256);
+    if (!ld || ld->grid || expr_eval_grid(ld, yg, 256) ||
+        memcmp(ys, yg, sizeof(double) * 256))
+      printf("    failed: grid %s \"sin(x*PI)\"\n", gnames[k]);
+    if (ld != ex) expr_delete(ld);
+    expr_delete(ex);
+  }
+  if (expr_eval_grid(NULL, yg, 256) != -1)
+    printf("    failed: grid of no program\n");
+
+  for (j = 0; j < 65536; j++) xs[j] = (double)j / 65535.0;
+  for (i = 0; grid_stepped[i]; i++) {
+    EXPR * ex = expr_new(grid_stepped[i]);
+    if (ex) {
+      expr_eval_n(ex, xs, ys, 65536);
+      expr_eval_grid(ex, yg, 65536);
+    }
+    if (!ex || ex->grid || memcmp(ys, yg, sizeof(double) * 65536))
+      printf("    failed: grid under a step \"%s\"\n", grid_stepped[i]);
+    expr_delete(ex);
+  }
+
+  for (j = 0; j < 256; j++) xs[j] = (double)j / 255.0;
+  for (i = 0, n = 0; corpus[i]; i++)
+    if ((exs[n] = expr_new(corpus[i])) != NULL) n++;
+  for (pass = 0; pass < 20; pass++) {
+    t0 = clock();
+    for (i = 0; i < n; i++) expr_eval_grid(exs[i], yg, 256);
+    tg += clock() - t0;
+    t0 = clock();
+    for (i = 0; i < n; i++) expr_eval_n(exs[i], xs, ys, 256);
+    tn += clock() - t0;
+  }
+  for (i = 0; i < n; i++) expr_delete(exs[i]);
+  if (tg && tn)
+    printf("grid: %.2fx expr_eval_n over the corpus\n", (double)tn / (double)tg);
+
+  /* the preview's EXPR_FLOAT | EXPR_FAST carry over to the grid:
+   * it rounds to floats, but stays close */
+  {
+    EXPR * ed = expr_new("sin(x*PI)*.5 + exp(-x*x*4)");
+    EXPR * ex = expr_new_with("sin(x*PI)*.5 + exp(-x*x*4)", EXPR_FLOAT | EXPR_FAST);
+    if (!ed || !ex || !ex->grid || expr_eval_grid(ed, ys, 256) ||
+        expr_eval_grid(ex, yg, 256) || !memcmp(ys, yg, sizeof(double) * 256))
+      printf("    failed: grid float fast isn't\n");
+    for (j = 0; ex && j < 256; j++)
+      if (!(fabs(yg[j] - ys[j]) <= 1e-5)) {
+        printf("    failed: grid float fast (%lu): %.17g should be %.17g\n",
+               (unsigned long)j, yg[j], ys[j]);
+        break;
+      }
+    expr_delete(ex);
+    expr_delete(ed);
+  }
+  tg = tn = 0;
+  for (k = 0; k < 2; k++) {
+    int tier = k ? EXPR_FLOAT | EXPR_FAST : 0;
+    for (i = 0, n = 0; corpus[i]; i++)
+      if ((exs[n] = expr_new_with(corpus[i], tier)) != NULL) {
+        if (exs[n]->grid && exs[n]->grid->tier != tier)
+          printf("    failed: grid tier %d \"%s\"\n", exs[n]->grid->tier, corpus[i]);
+        n++;
+      }
+    for (pass = 0; pass < 20; pass++) {
+      t0 = clock();
+      for (i = 0; i < n; i++) expr_eval_grid(exs[i], yg, 256);
+      if (k) tg += clock() - t0;
+      else tn += clock() - t0;
+    }
+    for (i = 0; i < n; i++) expr_delete(exs[i]);
+  }
+  if (tg && tn)
+    printf("grid float fast: %.2fx double over the corpus\n", (double)tn / (double)tg);
+  fflush(stdout);
+}
+
+#ifdef EXPR_SIMD
+/* Run every SYMBOL through the kernel, and compare each lane against
+ * the scalar operator on that lane's arguments.
+ * Results must be bit-exact; any NaN matches any NaN.
+ */
+void
+test_simd1(const char * name, expr_simd_fn simd)
+{
+  static const double vals[] = {
+    0.0, -0.0, 0.5, -0.5, 1.5, -1.5, 2.5, -2.5, 3.0, -7.0, 0.3, -0.7,
+    1.0/3.0, 0.49999999999999994, 4503599627370495.5, -4503599627370497.0,
+    1e300, -1e300, 5e-324, INFINITY, -INFINITY, NAN
+  };
+#define NV  (sizeof(vals) / sizeof(vals[0]))
+  double block[EXPR_BLOCK * 3];
+  double args[3];
+  size_t i, rot;
+  int t, count = 0;
+
+  for (t = _OP_MIN; t <= _OP_MAX; t++) {
+    for (rot = 0; rot < NV; rot++) {
+      OPCODE op;
+      op.type = (expr_oper_t)t;
+      op.value = vals[rot];
+      for (i = 0; i < EXPR_BLOCK; i++) {
+        block[i] = vals[i % NV];
+        block[i + EXPR_BLOCK] = vals[(i + rot) % NV];
+        block[i + EXPR_BLOCK * 2] = vals[(i + rot * 2 + 1) % NV];
+      }
+      if (!simd(&op, block, EXPR_BLOCK)) break;
+      if (!rot) count++;
+      for (i = 0; i < EXPR_BLOCK; i++) {
+        double rv, got = block[i];
+        args[0] = vals[i % NV];
+        args[1] = vals[(i + rot) % NV];
+        args[2] = vals[(i + rot * 2 + 1) % NV];
+        rv = expr_apply(&op, 0.0, args);
+        if (isnan(rv) ? !isnan(got) : memcmp(&rv, &got, sizeof(rv))) {
+          printf("    failed: %s '%s'(%g, %g, %g): %.23g should be %.23g\n",
+                 name, op_name(t), args[0], args[1], args[2], got, rv);
+          break;
+        }
+      }
+    }
+  }
+  printf("simd %s: %d opcodes vectorized\n", name, count);
+  fflush(stdout);
+#undef NV
+}
+
+/* The scalar operator in the float evaluator's terms: the arguments
+ * are floats, and the result is rounded to one.
+ */
+static float
+test_applyf(const OPCODE * op, const float * args)
+{
+  double x = 0.0;
+  switch (op->type) {
+#undef COMMA
+#undef LIMIT
+#define zz  op->value
+#define slot(K)  x
+#define table(K)  ((const double *)NULL)
+#define aa  args[0]
+#define bb  args[1]
+#define cc  args[2]
+#define SYMBOL(ENUM,PREC,TOK,ARGC,DOC,EVAL) case ENUM: return (float)(EVAL);
+#include "expr-optab.inc"
+  }
+  return 0.0f;
+}
+
+/* The same for the float kernels, against test_applyf; to within the
+ * last bit, as the kernels round constants such as M_DEG_TO_RAD.
+ */
+void
+test_simdf1(const char * name, expr_simdf_fn simd)
+{
+  static const float vals[] = {
+    0.0f, -0.0f, 0.5f, -0.5f, 1.5f, -1.5f, 2.5f, -2.5f, 3.0f, -7.0f,
+    0.3f, -0.7f, 1.0f/3.0f, 0.49999997f, 8388607.5f, -8388609.0f,
+    1e38f, -1e38f, 1e-45f, INFINITY, -INFINITY, NAN
+  };
+#define NV  (sizeof(vals) / sizeof(vals[0]))
+  float block[EXPR_BLOCK * 3];
+  float args[3];
+  size_t i, rot;
+  int t, count = 0;
+
+  for (t = _OP_MIN; t <= _OP_MAX; t++) {
+    for (rot = 0; rot < NV; rot++) {
+      OPCODE op;
+      op.type = (expr_oper_t)t;
+      op.value = vals[rot];
+      for (i = 0; i < EXPR_BLOCK; i++) {
+        block[i] = vals[i % NV];
+        block[i + EXPR_BLOCK] = vals[(i + rot) % NV];
+        block[i + EXPR_BLOCK * 2] = vals[(i + rot * 2 + 1) % NV];
+      }
+      if (!simd(&op, block, EXPR_BLOCK)) break;
+      if (!rot) count++;
+      for (i = 0; i < EXPR_BLOCK; i++) {
+        float rv, got = block[i];
+        args[0] = vals[i % NV];
+        args[1] = vals[(i + rot) % NV];
+        args[2] = vals[(i + rot * 2 + 1) % NV];
+        rv = test_applyf(&op, args);
+        if (isnan(rv) ? !isnan(got) :
+            got == rv ? signbit(got) != signbit(rv) :
+            !isfinite(rv) || fabsf(got - rv) >
+              nextafterf(fabsf(rv), INFINITY) - fabsf(rv)) {
+          printf("    failed: %s '%s'(%g, %g, %g): %.13g should be %.13g\n",
+                 name, op_name(t), args[0], args[1], args[2], got, rv);
+          break;
+        }
+      }
+    }
+  }
+  printf("simd %s: %d opcodes vectorized\n", name, count);
+  fflush(stdout);
+#undef NV
+}
+
+void
+test_simd(void)
+{
+  test_simd1("sse2", expr_simd_sse2);
+  test_simdf1("sse2f", expr_simd_sse2f);
+  if (__builtin_cpu_supports("avx")) {
+    test_simd1("avx", expr_simd_avx);
+    test_simdf1("avxf", expr_simd_avxf);
+  }
+  if (__builtin_cpu_supports("avx") && __builtin_cpu_supports("fma")) {
+    test_simd1("fma", expr_simd_fma);
+    test_simdf1("fmaf", expr_simd_fmaf);
+  }
+}
+#endif
+
+#ifdef EXPR_THREADED
+/* The threaded evaluator must agree with the switch bit for bit, and
+ * should beat it; report both over the corpus.
+ */
+void
+test_threaded(void)
+{
+  EXPR * exs[sizeof(corpus) / sizeof(corpus[0])];
+  double rt = 0.0, rs = 0.0;
+  clock_t t0, tt = 0, ts = 0;
+  size_t i, j, n = 0, evals = 0;
+  int pass;
+
+  for (i = 0; corpus[i]; i++)
+    if ((exs[n] = expr_new(corpus[i])) != NULL) n++;
+
+  for (i = 0; i < n; i++) {
+    for (j = 0; j <= 1000; j++) {
+      double x = ((double)j - 250.0) / 500.0;
+      expr_eval_threaded(exs[i], exs[i]->ctx, x, &rt);
+      expr_eval_switch(exs[i], exs[i]->ctx, x, &rs);
+      if (isnan(rt) ? !isnan(rs) : memcmp(&rt, &rs, sizeof(rt))) {
+        printf("    failed: threaded \"%s\"(%g): %.23g should be %.23g\n",
+               corpus[i], x, rt, rs);
+        break;
+      }
+    }
+  }
+
+  for (pass = 0; pass < 20; pass++) {
+    t0 = clock();
+    for (i = 0; i < n; i++)
+      for (j = 0; j < 1000; j++)
+        expr_eval_threaded(exs[i], exs[i]->ctx, (double)j / 1000.0, &rt);
+    tt += clock() - t0;
+    t0 = clock();
+    for (i = 0; i < n; i++)
+      for (j = 0; j < 1000; j++)
+        expr_eval_switch(exs[i], exs[i]->ctx, (double)j / 1000.0, &rs);
+    ts += clock() - t0;
+    evals += n * 1000;
+  }
+  if (evals && tt)
+    printf("threaded: %.1f ns/eval, switch %.1f ns/eval (%.2fx)\n",
+           1e9 * (double)tt / CLOCKS_PER_SEC / (double)evals,
+           1e9 * (double)ts / CLOCKS_PER_SEC / (double)evals,
+           (double)ts / (double)tt);
+  for (i = 0; i < n; i++) expr_delete(exs[i]);
+  fflush(stdout);
+}
+#endif
+
+/* The other VMs must agree with the stack VM bit for bit; report the
+ * speed of each against it over the corpus.
+ */
+void
+test_vm1(const char * src, int flags, const char * name)
+{
+  EXPR * ex, * ev;
+  double rs = 0.0, rv = 0.0, xs[301], ys[301], yv[301];
+  size_t j;
+  ex = expr_new(src);
+  ev = expr_new_with(src, flags);
+  if (ex && ev) {
+    for (j = 0; j <= 1000; j++) {
+      double x = ((double)j - 250.0) / 500.0;
+      expr_eval(ex, x, &rs);
+      expr_eval(ev, x, &rv);
+      if (isnan(rs) ? !isnan(rv) : memcmp(&rs, &rv, sizeof(rs))) {
+        printf("    failed: %s \"%s\"(%g): %.23g should be %.23g\n",
+               name, src, x, rv, rs);
+        break;
+      }
+    }
+    for (j = 0; j < 301; j++) xs[j] = ((double)j - 50.0) / 200.0;
+    expr_eval_n(ex, xs, ys, 301);
+    expr_eval_n(ev, xs, yv, 301);
+    for (j = 0; j < 301; j++) {
+      if (isnan(ys[j]) ? !isnan(yv[j]) : memcmp(&ys[j], &yv[j], sizeof(rs))) {
+        printf("    failed: %s \"%s\" eval_n(%g): %.23g should be %.23g\n",
+               name, src, xs[j], yv[j], ys[j]);
+        break;
+      }
+    }
+  }
+  expr_delete(ex);
+  expr_delete(ev);
+}
+
+void
+test_vm(int flags, const char * name)
+{
+  EXPR * exs[sizeof(corpus) / sizeof(corpus[0])];
+  EXPR * evs[sizeof(corpus) / sizeof(corpus[0])];
+  double rv = 0.0;
+  clock_t t0, ts = 0, tv = 0;
+  size_t i, j, n = 0, evals = 0;
+  int pass;
+
+  for (i = 0; tests[i].src; i++) test_vm1(tests[i].src, flags, name);
+  for (i = 0; corpus[i]; i++) test_vm1(corpus[i], flags, name);
+
+  for (i = 0; corpus[i]; i++) {
+    exs[n] = expr_new(corpus[i]);
+    evs[n] = expr_new_with(corpus[i], flags);
+    if (exs[n] && evs[n]) n++;
+    else { expr_delete(exs[n]); expr_delete(evs[n]); }
+  }
+  for (pass = 0; pass < 20; pass++) {
+    t0 = clock();
+    for (i = 0; i < n; i++)
+      for (j = 0; j < 1000; j++)
+        expr_eval(exs[i], (double)j / 1000.0, &rv);
+    ts += clock() - t0;
+    t0 = clock();
+    for (i = 0; i < n; i++)
+      for (j = 0; j < 1000; j++)
+        expr_eval(evs[i], (double)j / 1000.0, &rv);
+    tv += clock() - t0;
+    evals += n * 1000;
+  }
+  if (evals && tv)
+    printf("%s: %.1f ns/eval, stack %.1f ns/eval (%.2fx)\n", name,
+           1e9 * (double)tv / CLOCKS_PER_SEC / (double)evals,
+           1e9 * (double)ts / CLOCKS_PER_SEC / (double)evals,
+           (double)ts / (double)tv);
+  for (i = 0; i < n; i++) {
+    expr_delete(exs[i]);
+    expr_delete(evs[i]);
+  }
+  fflush(stdout);
+}
+
+#ifdef EXPR_CC
+/* Compile the corpus twice into a fresh cache: the second round must
+ * be all hits. test_vm compiles each program twice as well.
+ */
+void
+test_cc(void)
+{
+  char dir[] = "/tmp/expr-test-XXXXXX";
+  char cmd[64];
+  unsigned long misses;
+  size_t i;
+
+  if (!mkdtemp(dir)) return;
+  expr_set_cache_dir(dir);
+  test_vm(EXPR_VM_CC, "cc");
+  misses = expr_cc_misses;
+  for (i = 0; corpus[i]; i++) expr_delete(expr_new_with(corpus[i], EXPR_VM_CC));
+  if (expr_cc_misses != misses)
+    printf("    failed: cc recompiled %lu cached programs\n",
+           expr_cc_misses - misses);
+  printf("cc: %lu compiled, %lu loaded from the cache\n",
+         expr_cc_misses, expr_cc_hits);
+  expr_set_cache_dir(NULL);
+  snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+  if (system(cmd)) printf("    failed: could not remove %s\n", dir);
+  fflush(stdout);
+}
+#endif
+
+#ifdef EXPR_JIT
+/* The width of each program's value, as the JIT sees it.
+ */
+struct width_s {
+  unsigned width;
+  char * src;
+} widths[] = {
+  { 8, "x*255 & 255" },
+  { 10, "(x*255 & 255) << 2" },
+  { 8, "(x*255 & 255) >> 1" },
+  { 8, "(x*255 & 255) // 3" },
+  { 9, "(x*255 & 255) + (x*255 & 255)" },
+  { 31, "~x" },
+  { 1, "x < .5" },
+  { 2, "x < .5 ? 1 : 3" },
+  { 2, "select(x*4, 1, 2, 3)" },
+  { EXPR_NOTINT, "x*255 << 1" },
+  { EXPR_NOTINT, "x//3" },
+  { EXPR_NOTINT, "x < .5 ? 1 : x" },
+  { 0, NULL }
+};
+
+void
+test_widths(void)
+{
+  size_t i, n, capacity;
+  for (i = 0; widths[i].src; i++) {
+    OPCODE * code = (OPCODE *)malloc(sizeof(OPCODE) * 64);
+    double * pool = NULL;
+    unsigned char * w = NULL;
+    capacity = 64;
+    if (!expr_parse_lib(widths[i].src, &code, &capacity, &pool, &n,
+                        default_error_handler, NULL, NULL)) {
+      expr_optimize(code);
+      expr_rewrite(code, capacity, 0);
+      expr_branch_mark(code);
+      expr_share(code, &n);
+      expr_branch(code, capacity);
+      w = expr_widths(code);
+    }
+    for (n = 0; code[n].type != OP_EOF; n++) /**/;
+    if (!w || !n || w[n - 1] != widths[i].width)
+      printf("    failed: \"%s\": width %u should be %u\n", widths[i].src,
+             w && n ? w[n - 1] : 0, widths[i].width);
+    free(w);
+    free(pool);
+    free(code);
+  }
+  fflush(stdout);
+}
+#endif
+
+struct opt_s {
+  size_t removed;
+  char * src;
+} opts[] = {
+  { 0, "x" },
+  { 2, "PI/2" },
+  { 2, "sin(1*x*PI+PI/2)/2+.5" },
+  { 2, "x*(4*PI)" },
+  { 1, "sin(x)+cos(2)" },
+  { 3, "1?x:2" },
+  { 3, "0?x:sin(x)" },
+  { 2, "0 && x" },
+  { 2, "1 || x" },
+  { 0, "x || 1" },
+  { 2, "NAN ?? x" },
+  { 0, NULL }
+};
+
+void
+test_optimize(void)
+{
+  EXPR * ex;
+  size_t i;
+  for (i = 0; opts[i].src; i++) {
+    ex = expr_new(opts[i].src);
+    if (!ex) {
+      printf("    failed: \"%s\": parse failed\n", opts[i].src);
+      continue;
+    }
+    if (ex->folded != opts[i].removed) {
+      printf("    failed: \"%s\": removed %lu should be %lu\n    ",
+             opts[i].src, (unsigned long)ex->folded,
+             (unsigned long)opts[i].removed);
+      expr_dump(ex, stdout);
     }
+    expr_delete(ex);
   }
-  assert((dst - ex->stack) == 1);
-  *rv = ex->stack[0];
-  return 0;
+  fflush(stdout);
 }
 
-/* ********************************************************************** */
-/* Constructor */
-/* ********************************************************************** */
+struct rewrite_s {
+  size_t rewrites;
+  size_t fused; /* more rewrites, with EXPR_FMA and hardware fma */
+  char * src;
+} rewrites[] = {
+  { 0, 0, "x" },
+  { 1, 0, "pow(x,2)" },
+  { 1, 0, "pow(x,1/2)" },
+  { 0, 0, "pow(x,1/3)" },
+  { 1, 0, "pow(square(x),1/3)" },
+  { 1, 0, "pow(x,1)" },
+  { 1, 0, "root(x,2)" },
+  { 1, 0, "log(x+1,2)" },
+  { 1, 1, "log(8*x+1,9)" },
+  { 0, 0, "1/sin(x)" },
+  { 0, 0, "1/tanh(x*3)" },
+  { 1, 0, "x/3" },
+  { 2, 0, "x/1" },
+  { 2, 0, "1*x*1" },
+  { 2, 0, "0+x-0" },
+  { 1, 0, "-1*x" },
+  { 2, 2, "sin(1*x*PI+PI/2)/2+.5" },
+  { 0, 1, "x*x+x" },
+  { 0, 1, "2+x*3" },
+  { 0, 0, NULL }
+};
 
-EXPR *
-expr_new(const char * src)
+/* The rewrites must stay within approx() of the exact program.
+ */
+void
+test_rewrite(void)
 {
-  EXPR * ex;
-  size_t srclen;
+  EXPR * ex, * ee;
+  double rv = 0.0, re = 0.0;
+  size_t i, j, want;
+  int fma;
+  for (i = 0; rewrites[i].src; i++) for (fma = 0; fma <= 1; fma++) {
+    ex = expr_new_with(rewrites[i].src, fma ? EXPR_FMA : 0);
+    ee = expr_new_with(rewrites[i].src, EXPR_EXACT);
+    if (!ex || !ee) {
+      printf("    failed: \"%s\": parse failed\n", rewrites[i].src);
+      expr_delete(ex);
+      expr_delete(ee);
+      continue;
+    }
+    want = rewrites[i].rewrites + (fma && expr_fma == 1 ? rewrites[i].fused : 0);
+    if (ex->rewritten != want) {
+      printf("    failed: \"%s\"%s: rewrites %lu should be %lu\n    ",
+             rewrites[i].src, fma ? " fma" : "", (unsigned long)ex->rewritten,
+             (unsigned long)want);
+      expr_dump(ex, stdout);
+    }
+    for (j = 0; j <= 400; j++) {
+      double x = ((double)j - 200.0) / 100.0;
+      expr_eval(ex, x, &rv);
+      expr_eval(ee, x, &re);
+      if (!same(rv, re) && !approx(rv, re)) {
+        printf("    failed: \"%s\"(%g): %.23g should be %.23g\n    ",
+               rewrites[i].src, x, rv, re);
+        expr_dump(ex, stdout);
+        break;
+      }
+    }
+    expr_delete(ex);
+    expr_delete(ee);
+  }
+  fflush(stdout);
+}
 
-  if (!error_handler) expr_set_error_handler(NULL, NULL);
+#ifdef EXPR_THREADS
+#define TEST_THREADS 4
+#define TEST_XS      301
 
-  if (!src || !*src) src = "x";
+struct test_thread_s {
+  EXPR ** exs;          /* shared by all the threads */
+  double * want;        /* their results, TEST_XS each */
+  size_t n;
+  unsigned long errors; /* counted by test_thread_error */
+  int failed;
+};
 
-  /* worst case: opcode count == srclen + eof
-   * worst case: func(every, token, gets, pushed, onto, the, stack)
-   */
-  srclen = strlen(src) + 1;
+static void
+test_thread_error(const char * msg, void * ctxt)
+{
+  (void)msg;
+  ((struct test_thread_s *)ctxt)->errors++;
+}
 
-  if (srclen >= (size_t)(INT_MAX / sizeof(OPCODE)))
-    return NULL; /* don't worry too much: 32-bits -> ~536M opcodes */
+/* Compile the corpus, reporting errors through this thread's own
+ * callback, then run the shared programs with a context of its own.
+ */
+static void *
+test_thread(void * arg)
+{
+  struct test_thread_s * t = (struct test_thread_s *)arg;
+  double xs[TEST_XS], ys[TEST_XS], rv = 0.0;
+  EXPR_CTX * ctx;
+  size_t i, j;
 
-  ex = (EXPR *)calloc(1, sizeof(EXPR));
-  assert(ex);
-  if (!ex) goto error;
+  for (i = 0; corpus[i]; i++)
+    expr_delete(expr_new_ex(corpus[i], 0, test_thread_error, t));
+  for (j = 0; j < TEST_XS; j++) xs[j] = ((double)j - 50.0) / 200.0;
+  for (i = 0; i < t->n; i++) {
+    const double * want = t->want + i * TEST_XS;
+    ctx = expr_ctx_new(t->exs[i]);
+    if (!ctx) continue;
+    for (j = 0; j < TEST_XS; j++) {
+      expr_eval_ctx(t->exs[i], ctx, xs[j], &rv);
+      if (!same(rv, want[j])) t->failed = 1;
+    }
+    expr_eval_n_ctx(t->exs[i], ctx, xs, ys, TEST_XS);
+    for (j = 0; j < TEST_XS; j++)
+      if (!same(ys[j], want[j])) t->failed = 1;
+    expr_ctx_delete(ctx);
+  }
+  return NULL;
+}
 
-  ex->code = (OPCODE *)malloc(sizeof(OPCODE) * srclen);
-  assert(ex->code);
-  if (!ex->code) goto error;
+void
+test_threads(void)
+{
+  EXPR * exs[sizeof(corpus) / sizeof(corpus[0])];
+  double want[sizeof(corpus) / sizeof(corpus[0]) * TEST_XS];
+  struct test_thread_s base, ts[TEST_THREADS];
+  pthread_t tids[TEST_THREADS];
+  int started[TEST_THREADS];
+  EXPR * small, * big;
+  EXPR_CTX * ctx;
+  double rv = 0.0;
+  size_t i, j, n = 0;
 
-  ex->stack = (double *)malloc(sizeof(double) * srclen);
-  assert(ex->stack);
-  if (!ex->stack) goto error;
+  memset(&base, 0, sizeof(base));
+  for (i = 0; corpus[i]; i++) {
+    if ((exs[n] = expr_new_ex(corpus[i], 0, test_thread_error, &base)) == NULL)
+      continue;
+    for (j = 0; j < TEST_XS; j++)
+      expr_eval(exs[n], ((double)j - 50.0) / 200.0, &want[n * TEST_XS + j]);
+    n++;
+  }
 
-  ex->capacity = srclen;
-  
-  if (expr_parse(src, ex->code, ex->capacity)) goto error;
-  return ex;
-error:
-  expr_delete(ex);
-  return NULL; /* no error printing on out-of-mem */
+  for (i = 0; i < TEST_THREADS; i++) {
+    memset(&ts[i], 0, sizeof(ts[i]));
+    ts[i].exs = exs;
+    ts[i].want = want;
+    ts[i].n = n;
+    started[i] = !pthread_create(&tids[i], NULL, test_thread, &ts[i]);
+  }
+  for (i = 0; i < TEST_THREADS; i++) {
+    if (!started[i]) {
+      printf("    failed: thread %lu didn't start\n", (unsigned long)i);
+      continue;
+    }
+    pthread_join(tids[i], NULL);
+    if (ts[i].failed)
+      printf("    failed: thread %lu: results differ\n", (unsigned long)i);
+    if (ts[i].errors != base.errors)
+      printf("    failed: thread %lu: %lu errors should be %lu\n",
+             (unsigned long)i, ts[i].errors, base.errors);
+  }
+
+  small = expr_new("x");
+  big = expr_new("x*(x+1)+cos(x*2)*cos(x*2)");
+  ctx = expr_ctx_new(small);
+  if (ctx && big && expr_eval_ctx(big, ctx, 0.5, &rv) != -1)
+    printf("    failed: a context too small was used\n");
+  expr_ctx_delete(ctx);
+  expr_delete(small);
+  expr_delete(big);
+
+  for (i = 0; i < n; i++) expr_delete(exs[i]);
+  printf("threads: %d, each compiling %lu programs and running %lu\n",
+         TEST_THREADS, (unsigned long)(sizeof(corpus) / sizeof(corpus[0]) - 1),
+         (unsigned long)n);
+  fflush(stdout);
 }
+#endif
+
+struct share_s {
+  size_t shared;
+  size_t nslots;
+  char * src;
+} shares[] = {
+  { 0, 0, "x" },
+  { 0, 0, "x+x" },
+  { 2, 1, "sin(x)+sin(x)" },
+  { 2, 1, "sin(cos(x))+cos(x)" },
+  { 3, 1, "sin(x*PI)*cos(x*PI)" },
+  { 4, 1, "((sin(x*(8*PI)) + sin(x*(4*PI)) + sin(x*(4*PI)))/5)+.5" },
+  { 8, 2, "(x*2+1)*(x*2+1)+(x*2)" },
+  { 4, 1, "x<.5 ? sin(x*3)*sin(x*3) : 0" },
+  { 4, 1, "sin(x*3) + (x<.5 ? sin(x*3) : 0)" },
+  { 0, 0, "(x<.5 ? sin(x*3) : 0) + sin(x*3)" },
+  { 4, 1, "(x<.5 ? sin(x*3) : 0) + sin(x*3) + sin(x*3)" },
+  { 0, 1, "s = sin(x*PI); s*s + s" },
+  { 0, 0, "s = sin(x*PI); 1 - s" },
+  { 0, 0, NULL }
+};
 
 void
-expr_delete(EXPR * ex)
+test_share(void)
 {
-  if (ex) {
-    if (ex->stack) free(ex->stack);
-    if (ex->code) free(ex->code);
-    free(ex);
+  EXPR * ex;
+  size_t i;
+  for (i = 0; shares[i].src; i++) {
+    ex = expr_new_with(shares[i].src, EXPR_EXACT);
+    if (!ex) {
+      printf("    failed: \"%s\": parse failed\n", shares[i].src);
+      continue;
+    }
+    if (ex->shared != shares[i].shared || ex->nslots != shares[i].nslots) {
+      printf("    failed: \"%s\": shared %lu in %lu slots should be %lu in %lu\n    ",
+             shares[i].src, (unsigned long)ex->shared,
+             (unsigned long)ex->nslots, (unsigned long)shares[i].shared,
+             (unsigned long)shares[i].nslots);
+      expr_dump(ex, stdout);
+    }
+    expr_delete(ex);
   }
+  fflush(stdout);
 }
 
-/* ********************************************************************** */
-/* Test */
-/* ********************************************************************** */
+/* Misused bindings and tables must fail as a misspelt name or a
+ * missing token does.
+ */
+static const struct {
+  const char * src;
+  const char * err;
+} lets[] = {
+  { "a = 1; b",    "unknown identifier 'b'" },
+  { "a = a; a",    "unknown identifier 'a'" },
+  { "a = 1 a",     "unknown identifier 'a'" },
+  { "1 + a = 2",   "unknown identifier 'a'" },
+  { "a = 1;",      "unexpected 'end'" },
+  { "a = 1, 2; a", "unexpected ',', expected ';'" },
+  { "x = 1; x",    "unexpected '=', expected 'end'" },
+  { "lut(x)",      "unexpected 'x', expected '['" },
+  { "lut([], x)",  "unexpected ']', expected a number" },
+  { "lut([0, x], x)", "unexpected 'x', expected a number" },
+  { "lut([0, 1])", "unexpected ')', expected ','" },
+  { "lut([0], x, 1)", "function takes 1 args, found 2" },
+  { "select(x)",   "function takes 2 or more args, found 1" },
+  { "select()",    "function takes 2 or more args, found 0" },
+  { "piecewise(x, 1, 2)", "function takes an even number of args, found 3" },
+  { NULL, NULL }
+};
 
-#ifdef TEST
+static void
+test_let_error(const char * msg, void * ctxt)
+{
+  strncpy((char *)ctxt, msg, 255);
+}
 
-struct test_s {
-  double rv;
+void
+test_let(void)
+{
+  char err[256];
+  EXPR * ex;
+  size_t i;
+  for (i = 0; lets[i].src; i++) {
+    memset(err, 0, sizeof(err));
+    ex = expr_new_ex(lets[i].src, 0, test_let_error, err);
+    if (ex || !strstr(err, lets[i].err))
+      printf("    failed: \"%s\": \"%s\" should be \"%s\"\n",
+             lets[i].src, err, lets[i].err);
+    expr_delete(ex);
+  }
+  fflush(stdout);
+}
+
+/* A library, and calls to it with what they should inline to, with as
+ * many branches, or the error they should give.
+ */
+const char * libsrcs[] = {
+  "ease(t) = t*t*(3 - 2*t)",
+  "sin(x*PI)",
+  "mix(a, b, t) = a + (b - a)*ease(t)",
+  "twice(t) = ease(ease(t))",
+  "half() = 0.5",
+  "later(t) = early(t) + 1",
+  "early(t) = t*2",
+  "sq(x) = x*x",
+  "loop(t) = loop2(t)",
+  "loop2(t) = loop(t) + 1",
+  "self(t) = self(t)",
+  "ease(t) = t",
+  "cos(t) = t",
+  "dup(t, t) = t",
+  "bad(t) = t +",
+  "uses(t) = bad(t)",
+  "ramp(t) = lut([0, .25, 1], t)",
+  NULL
+};
+
+struct call_s {
   char * src;
-} tests[] = {
-  { 0.5, "x" },
-  { 1.0/M_PHI, "1/PHI" },
-  { M_PHI, "PHI" },
-  { M_E, "E" },
-  { M_GAMMA, "GAMMA" },
-  { 55.0*5.0, "55*5" },
-  { 1.0+ +2e3, "1++2e3" },
-  { 1.0?2.0:3.0, "1?2:3" },
-  { 1.0+2.0?3.0+4.0:5.0+6.0, "1+2?3+4:5+6" },
-  { 0.0?1.0:2.0 ? 3.0?4.0:5.0 : 6.0?7.0:8.0, "0?1:2 ? 3?4:5 : 6?7:8" },
-  { 5.0+0.5*7.0, "5+x*7" },
-  { 5.0*0.5+7.0, "5*x+7" },
-  { +5+-3- -3+ +3-+3, "+5+-3--3++3-+3" },
-  { ~-!-3, "~-!-3" },
-  { 5>>3>=2, "5>>3>=2" },
-  { 1.5875015614538918, "log((5 * 9),(4 + 7))" },
-  { 0.9163138199826525, "log(5 ? 9 : 8,4 + 7)" },
-  { -(-2.0+5.0/3.0), "abs(-2+5/3)" },
-  { 0.0, "0 && x" },
-  { M_TAU, "TAU || x" },
-  { -0.0, "-0" },
-  { INFINITY, "1/0" },
-  { 4.0, "atanh(5)??4" },
-  { 1.0, "5>4>=3>>2" },
-  { 1.0, "5<4<=3<<2" },
-  { 0.0, "5==4!=3==!2" },
-  { 3.0, "6^5 && 4&3 || 2|1" },
-  { 7.0, "7 || 6|5 && 4&3" },
-  { 5.0, "root(5*5, 2)" },
-  { 7.0, "root(7*7*7, 3) == 7 ? 44 : cbrt(7*7*7)" },
-  { 9.0, "root(9*9*9*9, 4)" },
-  { 0.0, NULL }
+  char * same;
+  char * err;
+} calls[] = {
+  { "ease(x)", "x*x*(3 - 2*x)", NULL },
+  { "mix(0, 1, x)", "0 + (1 - 0)*(x*x*(3 - 2*x))", NULL },
+  { "twice(x)", "e = x*x*(3 - 2*x); e*e*(3 - 2*e)", NULL },
+  { "half() + later(x)", "0.5 + (x*2 + 1)", NULL },
+  { "sq(sin(x))", "s = sin(x); s*s", NULL },
+  { "t = x/2; sq(t) + sq(x)", "t = x/2; t*t + x*x", NULL },
+  { "x<.5 ? 0 : sq(gamma(x))", "x<.5 ? 0 : gamma(x)*gamma(x)", NULL },
+  { "x<.5 ? sq(x) : sq(gamma(x)) + 1", "x<.5 ? x*x : gamma(x)*gamma(x) + 1", NULL },
+  { "ease(t) = t*t*(3 - 2*t)", "x*x*(3 - 2*x)", NULL },
+  { "f(x) = sq(x) + 1", "x*x + 1", NULL },
+  { "k() = 0.25", "0.25", NULL },
+  { "lut([1, 0], x) + ramp(x)", "lut([1, 0], x) + lut([0, .25, 1], x)", NULL },
+  { "ramp(ramp(x))", "lut([0, .25, 1], lut([0, .25, 1], x))", NULL },
+  { "loop(x)", NULL, "'loop' has errors" },
+  { "self(x)", NULL, "'self' has errors" },
+  { "uses(x)", NULL, "'uses' has errors" },
+  { "dup(x, x)", NULL, "'dup' has errors" },
+  { "ease(x, 1)", NULL, "function takes 1 args, found 2" },
+  { "mix(x)", NULL, "function takes 3 args, found 1" },
+  { "g(a, b) = a", NULL, "a curve takes at most 1 arg, found 2" },
+  { "nope(x)", NULL, "unknown identifier 'nope'" },
+  { NULL, NULL, NULL }
+};
+
+const char * liberrs[] = {
+  "in 'loop2' at 12: 'loop' calls itself",
+  "in 'self' at 11: 'self' calls itself",
+  "in 'ease' at 1: 'ease' is already defined",
+  "in 'cos' at 1: 'cos' is built in",
+  "in 'dup' at 8: 't' is already a parameter",
+  "in 'bad' at 13: unexpected 'end'",
+  "in 'uses' at 11: 'bad' has errors",
+  NULL
 };
 
 void
-print_opcode(OPCODE * opc)
+test_lib_error(const char * msg, void * ctxt)
 {
-  if (opc->type == OP_NUMBER) {
-    fprintf(stdout, "(%.23g)", opc->value);
-  } else
-    fprintf(stdout, "%s", op_name(opc->type));
+  size_t len = strlen((char *)ctxt);
+  snprintf((char *)ctxt + len, 4096 - len, "%s\n", msg);
+}
+
+void
+test_lib(void)
+{
+  char * errs = (char *)calloc(1, 4096), err[256];
+  EXPR_LIB * lib = expr_lib_new(libsrcs, test_lib_error, errs);
+  EXPR * ex, * same;
+  size_t i, j;
 
-  if (opc->type == OP_EOF) {
-    fprintf(stdout, "\n");
-    fflush(stdout);
+  for (i = 0; liberrs[i]; i++)
+    if (!strstr(errs, liberrs[i]))
+      printf("    failed: \"%s\" should be among:\n%s", liberrs[i], errs);
+  for (i = 0; calls[i].src; i++) {
+    memset(err, 0, sizeof(err));
+    ex = expr_new_lib(calls[i].src, 0, lib, test_let_error, err);
+    if (calls[i].err) {
+      if (ex || !strstr(err, calls[i].err))
+        printf("    failed: \"%s\": \"%s\" should be \"%s\"\n",
+               calls[i].src, err, calls[i].err);
+      expr_delete(ex);
+      continue;
+    }
+    same = expr_new(calls[i].same);
+    if (!ex || !same) {
+      printf("    failed: \"%s\": parse failed: %s\n", calls[i].src, err);
+    } else if (ex->codelen != same->codelen ||
+               ex->branches != same->branches) {
+      printf("    failed: \"%s\" should compile as \"%s\"\n    ",
+             calls[i].src, calls[i].same);
+      expr_dump(ex, stdout);
+      printf("    ");
+      expr_dump(same, stdout);
+    } else {
+      for (j = 0; j <= 4; j++) {
+        double rv, rs;
+        expr_eval(ex, (double)j / 4, &rv);
+        expr_eval(same, (double)j / 4, &rs);
+        if (rv != rs)
+          printf("    failed: \"%s\" at %g: %g should be %g\n",
+                 calls[i].src, (double)j / 4, rv, rs);
+      }
+    }
+    expr_delete(same);
+    expr_delete(ex);
   }
+  expr_lib_delete(lib);
+  free(errs);
+  fflush(stdout);
 }
 
+struct branch_s {
+  size_t branches;
+  char * src;
+} branches[] = {
+  { 0, "x<.5 ? x*2 : 1" },
+  { 0, "sin(x) && x" },
+  { 1, "x<.5 ? sin(x) : 1" },
+  { 1, "x<.5 ? 1 : sin(x)" },
+  { 2, "x>.25 && sin(x) || tan(x)" },
+  { 1, "x ?? asin(x)" },
+  { 2, "x<.25 ? sin(x) : x<.75 ? cos(x) : 1" },
+  { 1, "a = gamma(x); x<.5 ? 0 : a*a" },
+  { 1, "a = sin(x); b = a*a; x<.5 ? 0 : b + a" },
+  { 1, "a = sin(x); x<.5 ? 0 : x<.75 ? a*a : a" },
+  { 0, "a = gamma(x); (x<.5 ? a : 0) + a" },
+  { 0, NULL }
+};
+
 void
-test_parse(void)
+test_branch(void)
 {
-  double rv = 0.0;
   EXPR * ex;
+  size_t i;
+  for (i = 0; branches[i].src; i++) {
+    ex = expr_new(branches[i].src);
+    if (!ex) {
+      printf("    failed: \"%s\": parse failed\n", branches[i].src);
+      continue;
+    }
+    if (ex->branches != branches[i].branches) {
+      printf("    failed: \"%s\": %lu branches should be %lu\n    ",
+             branches[i].src, (unsigned long)ex->branches,
+             (unsigned long)branches[i].branches);
+      expr_dump(ex, stdout);
+    }
+    expr_delete(ex);
+  }
+  fflush(stdout);
+}
+
+/* Each dispatch must agree with its chain of ?:, and lower every ?:
+ * it compiles to, however cheap its arms.
+ */
+struct dispatch_s {
+  size_t branches;
+  char * src;
+  char * same;
+} dispatches[] = {
+  { 3, "select(x*4, .1, .2, .3, .4)",
+       "x*4<1 ? .1 : x*4<2 ? .2 : x*4<3 ? .3 : .4" },
+  { 4, "piecewise(x, .2, 0, .4, x, .6, x*x, .8, sin(x), 1)",
+       "x<.2 ? 0 : x<.4 ? x : x<.6 ? x*x : x<.8 ? sin(x) : 1" },
+  { 7, "select(floor(x*8), 0, 1, 2, 3, 4, 5, 6, 7)",
+       "max(min(floor(x*8), 7), 0)" },
+  { 0, "select(x, 7)", "7" },
+  { 0, "piecewise(x, sin(x))", "sin(x)" },
+  { 0, NULL, NULL }
+};
+
+void
+test_dispatch(void)
+{
+  EXPR * ex, * same;
+  double rv, rs;
   size_t i, j;
-  int err;
-  for (i = 0; tests[i].src; i++) {
+  for (i = 0; dispatches[i].src; i++) {
+    ex = expr_new(dispatches[i].src);
+    same = expr_new(dispatches[i].same);
+    if (!ex || !same) {
+      printf("    failed: \"%s\": parse failed\n", dispatches[i].src);
+    } else if (ex->branches != dispatches[i].branches) {
+      printf("    failed: \"%s\": %lu branches should be %lu\n    ",
+             dispatches[i].src, (unsigned long)ex->branches,
+             (unsigned long)dispatches[i].branches);
+      expr_dump(ex, stdout);
+    } else {
+      for (j = 0; j <= 33; j++) {
+        double x = j < 33 ? ((double)j - 8.0) / 16.0 : NAN;
+        expr_eval(ex, x, &rv);
+        expr_eval(same, x, &rs);
+        if (!same(rv, rs)) {
+          printf("    failed: \"%s\"(%g): %g should be %g\n",
+                 dispatches[i].src, x, rv, rs);
+          break;
+        }
+      }
+    }
+    expr_delete(same);
+    expr_delete(ex);
+  }
+  fflush(stdout);
+}
 
-    printf("parsing '%s'...\n", tests[i].src); fflush(stdout);
-    ex = expr_new(tests[i].src);
-    if (!ex) {
-      printf("parse failed.\n"); fflush(stdout);
+/* A fit must stay within its error on [0,1], and be the original
+ * outside, where it was left unfitted, and after a round trip through
+ * expr_serialize; report its speed against the original's.
+ */
+struct fit_s {
+  double maxerr;
+  char * src;
+} fits[] = {
+  { 1e-9, "erf(x*4 - 2)" },
+  { 1e-9, "gamma(x + .5)" },
+  { 1e-9, "jn(3, x*10)" },
+  { 1e-6, "sink(x*2 + .5)" },
+  { 1e-9, "x < .5 ? exp(x) : ln(x + 2)" },
+  { 1e-9, "floor(x*3)/3 + sin(x)" },
+  { 1e-6, "1/(x - .3)" },
+  { 1e-12, "x*x" },
+  { 0.0, NULL }
+};
+
+void
+test_fit(void)
+{
+  static const double outside[] = { -0.5, 1.5, -INFINITY, INFINITY, NAN };
+  static double xs[65536], ys[65536], yf[65536];
+  clock_t t0, tf = 0, to = 0;
+  size_t i, j, len;
+  int pass;
+
+  for (j = 0; j < 65536; j++) xs[j] = (double)j / 65535.0;
+  for (i = 0; fits[i].src; i++) {
+    EXPR * ex = expr_new(fits[i].src), * fx, * ld;
+    double err = -1.0, worst = 0.0, rv, rs;
+    unsigned char * a;
+    fx = expr_new_fit(fits[i].src, 0, NULL, fits[i].maxerr, &err, NULL, NULL);
+    if (!ex || !fx || !fx->fitted || !(err <= fits[i].maxerr)) {
+      printf("    failed: fit \"%s\": %lu pieces, error %g\n", fits[i].src,
+             fx ? (unsigned long)fx->fitted : 0UL, err);
+      expr_delete(ex);
+      expr_delete(fx);
       continue;
     }
-    printf("parsed. evaling...\n"); fflush(stdout);
+    expr_eval_n(ex, xs, ys, 65536);
+    expr_eval_n(fx, xs, yf, 65536);
+    for (j = 0; j < 65536; j++) {
+      double e = fabs(yf[j] - ys[j]);
+      if (!same(yf[j], ys[j]) && !(e <= worst)) worst = e;
+    }
+    /* between the check points, the error may run a little over */
+    if (worst > 2 * fits[i].maxerr)
+      printf("    failed: fit \"%s\": error %g should be within %g\n",
+             fits[i].src, worst, fits[i].maxerr);
+    for (j = 0; j < sizeof(outside) / sizeof(outside[0]); j++) {
+      expr_eval(ex, outside[j], &rs);
+      expr_eval(fx, outside[j], &rv);
+      if (!same(rv, rs))
+        printf("    failed: fit \"%s\"(%g): %g should be %g\n",
+               fits[i].src, outside[j], rv, rs);
+    }
 
-    err = expr_eval(ex, 0.5, &rv);
-    printf("eval'ed\n"); fflush(stdout);
+    len = expr_serialize(fx, NULL, 0);
+    a = (unsigned char *)malloc(len);
+    expr_serialize(fx, a, len);
+    ld = expr_deserialize(a, len, 0);
+    if (!ld || ld->fitted != fx->fitted || ld->fiterr != fx->fiterr)
+      printf("    failed: fit \"%s\": serialized differently\n", fits[i].src);
+    expr_delete(ld);
+    free(a);
 
-    if (err || rv != tests[i].rv) {
-      fprintf(stdout, "    failed: \"%s\": %.23g should be %.23g\n",
-              tests[i].src, rv, tests[i].rv); fflush(stdout);
+    for (pass = 0; pass < 4; pass++) {
+      t0 = clock();
+      expr_eval_n(fx, xs, yf, 65536);
+      tf += clock() - t0;
+      t0 = clock();
+      expr_eval_n(ex, xs, ys, 65536);
+      to += clock() - t0;
+    }
+    expr_delete(ex);
+    expr_delete(fx);
+  }
+  if (expr_new_fit("x", 0, NULL, 0.0, NULL, NULL, NULL))
+    printf("    failed: fit with no error allowed\n");
+  if (tf && to)
+    printf("fit: %.2fx the original over a 16-bit grid\n", (double)to / (double)tf);
+  fflush(stdout);
+}
 
-      fprintf(stdout, "    ");
-      for (j = 0; j < ex->capacity; j++) {
-        print_opcode(&(ex->code[j]));
-        if (ex->code[j].type == OP_EOF) break;
-        fprintf(stdout, " ");
-        fflush(stdout);
+/* A loaded program must write out the same bytes and compute the same
+ * values; damage must be refused, by the hash or, behind a good hash,
+ * by the checks.
+ */
+void
+test_serialize1(const char * src, int flags)
+{
+  EXPR * ex = expr_new_with(src, flags), * ld;
+  unsigned char * a, * b;
+  size_t len, j;
+  double rs = 0.0, rv = 0.0;
+
+  if (!ex) return;
+  len = expr_serialize(ex, NULL, 0);
+  a = (unsigned char *)malloc(len * 2);
+  b = a + len;
+  expr_serialize(ex, a, len);
+  ld = expr_deserialize(a, len, flags);
+  if (!ld) {
+    printf("    failed: serialize \"%s\": not loaded\n", src);
+  } else if (expr_serialize(ld, b, len) != len || memcmp(a, b, len)) {
+    printf("    failed: serialize \"%s\": loads differently\n", src);
+  } else {
+    for (j = 0; j <= 100; j++) {
+      double x = (double)j / 50.0 - 0.5;
+      expr_eval(ex, x, &rs);
+      expr_eval(ld, x, &rv);
+      if (isnan(rs) ? !isnan(rv) : memcmp(&rs, &rv, sizeof(rs))) {
+        printf("    failed: serialize \"%s\"(%g): %.23g should be %.23g\n",
+               src, x, rv, rs);
+        break;
       }
     }
+  }
+  expr_delete(ld);
+  expr_delete(ex);
+  free(a);
+}
+
+void
+test_serialize(void)
+{
+  static const char * src = "x < 0.5 ? sin(x*x) + 2 : x && cos(x) ?? 3";
+  EXPR * ex, * ld;
+  unsigned char * a;
+  size_t i, len, bad = 0;
+
+  for (i = 0; tests[i].src; i++) test_serialize1(tests[i].src, 0);
+  for (i = 0; corpus[i]; i++) test_serialize1(corpus[i], 0);
+  for (i = 0; corpus[i]; i++) test_serialize1(corpus[i], EXPR_EXACT);
+  for (i = 0; shares[i].src; i++) test_serialize1(shares[i].src, 0);
+  for (i = 0; branches[i].src; i++) test_serialize1(branches[i].src, 0);
+  for (i = 0; dispatches[i].src; i++) test_serialize1(dispatches[i].src, 0);
+
+  ex = expr_new(src);
+  len = expr_serialize(ex, NULL, 0);
+  a = (unsigned char *)malloc(len);
+  expr_serialize(ex, a, len);
+  for (i = 0; i < len * 8; i++) {
+    a[i / 8] ^= (unsigned char)(1 << (i % 8));
+    if ((ld = expr_deserialize(a, len, 0)) != NULL) bad++;
+    expr_delete(ld);
+    a[i / 8] ^= (unsigned char)(1 << (i % 8));
+  }
+  for (i = EXPR_SERIAL_HEAD; i < len - 4; i++) {
+    unsigned char c = a[i];
+    a[i] = (unsigned char)(c + 1);
+    ser_put(a + len - 4, ser_hash(0x811C9DC5UL, a, len - 4));
+    if ((ld = expr_deserialize(a, len, 0)) != NULL) {
+      double rv = 0.0;
+      expr_eval(ld, 0.25, &rv); /* must not crash */
+      expr_delete(ld);
+    }
+    a[i] = c;
+  }
+  ser_put(a + len - 4, ser_hash(0x811C9DC5UL, a, len - 4));
+  if (bad) printf("    failed: serialize: %lu damaged loads\n", (unsigned long)bad);
+  if (expr_deserialize(a, len - 1, 0) || expr_deserialize(a, len, EXPR_EXACT))
+    printf("    failed: serialize: truncated or inexact load\n");
+  if (!(ld = expr_deserialize(a, len, 0)))
+    printf("    failed: serialize: restored program not loaded\n");
+  expr_delete(ld);
+  expr_delete(ex);
+  free(a);
+  fflush(stdout);
+}
+
+/* Each name must be found as the linear search finds it. Then time
+ * the tokenizer on a long source, hashed and linear.
+ */
+void
+test_lookup(void)
+{
+  EXPRSTATE ex;
+  EXPRSTATE * pex = &ex;
+  const char * name;
+  char * src;
+  size_t i, len, reps, size = 0, toks = 0;
+  clock_t t0, th = 0, tl = 0;
+  int t, u, pass, bad = 0;
+
+  expr_init_once();
+  for (t = _OP_IDENT_MIN; t <= _OP_IDENT_MAX; t++) {
+    for (u = _OP_IDENT_MIN; strcmp(op_name(u), op_name(t)); u++) /**/;
+    if (tok_ident(op_name(t), strlen(op_name(t))) != (expr_oper_t)u) bad++;
+  }
+  for (t = _OP_OPER_MIN; t <= _OP_OPER_MAX; t++) {
+    for (name = op_name(t); ispunct((unsigned char)*name); name++) /**/;
+    if (*name) continue; /* not a token */
+    for (u = _OP_OPER_MIN; strcmp(op_name(u), op_name(t)); u++) /**/;
+    if (tok_oper(op_name(t), &len) != (expr_oper_t)u ||
+        len != strlen(op_name(t))) bad++;
+  }
+  if (tok_ident("sinx", 4) != OP_EOF || tok_ident("si", 2) != OP_EOF ||
+      tok_oper("~<x", &len) != OP_BITNOT || len != 1 ||
+      tok_oper(">>>>", &len) != OP_USHR || len != 3 ||
+      tok_oper("#", &len) != OP_EOF)
+    bad++;
+  if (!tok_hashed) printf("    failed: lookup: no perfect hash\n");
+  if (bad) printf("    failed: lookup: %d names misread\n", bad);
+
+  for (i = 0; corpus[i]; i++) size += strlen(corpus[i]) + 3;
+  reps = ((size_t)1 << 20) / size + 1;
+  src = (char *)malloc(size * reps + 1);
+  for (size = 0; reps--; )
+    for (i = 0; corpus[i]; i++) {
+      len = strlen(corpus[i]);
+      memcpy(src + size, corpus[i], len);
+      memcpy(src + size + len, " + ", 3);
+      size += len + 3;
+    }
+  size -= 3;
+  src[size] = '\0';
+
+  for (pass = 0; pass < 10; pass++) {
+    int hashed = tok_hashed;
+    for (u = 0; u < 2; u++) {
+      t0 = clock();
+      tok_init(pex, src, NULL, 0);
+      for (toks = 0; !tok_next(pex) && CURTYPE != OP_EOF; toks++) /**/;
+      if (u) tl += clock() - t0; else th += clock() - t0;
+      tok_hashed = 0;
+    }
+    tok_hashed = hashed;
+  }
+  if (th && tl)
+    printf("tokenizer: %.0f MB/s, %lu tokens, linear lookup %.0f MB/s (%.2fx)\n",
+           10.0 * (double)size / 1e6 / ((double)th / CLOCKS_PER_SEC),
+           (unsigned long)toks,
+           10.0 * (double)size / 1e6 / ((double)tl / CLOCKS_PER_SEC),
+           (double)tl / (double)th);
+  free(src);
+  fflush(stdout);
+}
+
+/* Generated sources: 100k levels of nesting of each kind, and a 10 MB
+ * polynomial. Each must compile without exhausting the C stack, in
+ * time linear in its length, and evaluate as its short form does.
+ */
+static char *
+test_repeat(const char * head, const char * mid, const char * tail, size_t n)
+{
+  size_t lh = strlen(head), lt = strlen(tail), i;
+  char * s = (char *)malloc((lh + lt) * n + strlen(mid) + 1), * p = s;
+  for (i = 0; i < n; i++, p += lh) memcpy(p, head, lh);
+  strcpy(p, mid);
+  p += strlen(mid);
+  for (i = 0; i < n; i++, p += lt) memcpy(p, tail, lt);
+  *p = '\0';
+  return s;
+}
+
+void
+test_stress(void)
+{
+  static const struct {
+    const char * head, * mid, * tail;
+    double x, want;
+  } nests[] = {
+    { "(",            "x",  ")",  0.25, 0.25 },
+    { "-",            "x",  "",   0.25, 0.25 },
+    { "min(1,",       "x",  ")",  0.25, 0.25 },
+    { "x<0?0:",       "x",  "",   0.25, 0.25 },
+    { "1+(",          "x",  ")",  0.25, 100000.25 },
+    { NULL, NULL, NULL, 0.0, 0.0 }
+  };
+  static const double xs[] = { 0.0, 0.5, -1.0, 3.0 };
+  static const char * const sqs[] = { "sq(t) = t*t", NULL };
+  EXPR_LIB * lib;
+  EXPR * ex;
+  char * src;
+  size_t i, n, len;
+  double rv = 0.0, sum;
+  clock_t t0;
+
+  for (i = 0; nests[i].head; i++) {
+    src = test_repeat(nests[i].head, nests[i].mid, nests[i].tail, 100000);
+    t0 = clock();
+    ex = expr_new(src);
+    if (!ex || expr_eval(ex, nests[i].x, &rv) || rv != nests[i].want)
+      printf("    failed: stress \"%s%s%s\" x 100000: %g should be %g\n",
+             nests[i].head, nests[i].mid, nests[i].tail, rv, nests[i].want);
+    else
+      printf("stress: \"%s%s%s\" x 100000 in %.2fs\n",
+             nests[i].head, nests[i].mid, nests[i].tail,
+             (double)(clock() - t0) / CLOCKS_PER_SEC);
     expr_delete(ex);
+    free(src);
+  }
+
+  /* a chain of names, each used twice by the next, which must not
+   * double the code at each link */
+  len = 1000;
+  src = (char *)malloc(len * 48 + 64);
+  for (n = (size_t)sprintf(src, "a0 = x; "), i = 1; i < len; i++)
+    n += (size_t)sprintf(src + n, "a%lu = (a%lu + a%lu)/2; ", (unsigned long)i,
+                         (unsigned long)i - 1, (unsigned long)i - 1);
+  sprintf(src + n, "a%lu", (unsigned long)len - 1);
+  t0 = clock();
+  ex = expr_new(src);
+  if (!ex || ex->codelen > 16 * len || expr_eval(ex, 0.3, &rv) || rv != 0.3 ||
+      clock() - t0 > 2 * CLOCKS_PER_SEC)
+    printf("    failed: stress %lu chained names: %lu bytes of code\n",
+           (unsigned long)len, ex ? (unsigned long)ex->codelen : 0UL);
+  else
+    printf("stress: %lu chained names in %lu bytes of code, %.2fs\n",
+           (unsigned long)len, (unsigned long)ex->codelen,
+           (double)(clock() - t0) / CLOCKS_PER_SEC);
+  expr_delete(ex);
+  free(src);
+
+  /* and of calls, each using its argument twice */
+  lib = expr_lib_new(sqs, NULL, NULL);
+  src = test_repeat("sq(", "x", ")", len);
+  t0 = clock();
+  ex = expr_new_lib(src, 0, lib, NULL, NULL);
+  if (!ex || ex->codelen > 16 * len || expr_eval(ex, -1.0, &rv) || rv != 1.0 ||
+      clock() - t0 > 2 * CLOCKS_PER_SEC)
+    printf("    failed: stress %lu nested calls: %lu bytes of code\n",
+           (unsigned long)len, ex ? (unsigned long)ex->codelen : 0UL);
+  else
+    printf("stress: %lu nested calls in %lu bytes of code, %.2fs\n",
+           (unsigned long)len, (unsigned long)ex->codelen,
+           (double)(clock() - t0) / CLOCKS_PER_SEC);
+  expr_delete(ex);
+  expr_lib_delete(lib);
+  free(src);
+
+  /* x*x - x*x/2 + x*x/3 - ..., around 10 MB, which at x is x*x
+   * times the same sum of the coefficients */
+  len = 10 << 20;
+  src = (char *)malloc(len + 64);
+  for (n = 0, i = 1, sum = 0.0; n < len; i++) {
+    double k = (i % 2 ? 1.0 : -1.0) / (double)i;
+    n += (size_t)sprintf(src + n, "%s%.17g*x*x", i > 1 ? "+" : "", k);
+    sum += k;
   }
+  t0 = clock();
+  ex = expr_new(src);
+  for (i = 0; ex && i < sizeof(xs) / sizeof(xs[0]); i++)
+    if (expr_eval(ex, xs[i], &rv) ||
+        fabs(rv - xs[i] * xs[i] * sum) > 1e-9 * fabs(xs[i] * xs[i] * sum))
+      break;
+  if (!ex || i < sizeof(xs) / sizeof(xs[0]))
+    printf("    failed: stress %lu bytes at %g: %.17g should be %.17g\n",
+           (unsigned long)n, ex ? xs[i] : 0.0, rv,
+           ex ? xs[i] * xs[i] * sum : 0.0);
+  else
+    printf("stress: %lu bytes in %.2fs\n", (unsigned long)n,
+           (double)(clock() - t0) / CLOCKS_PER_SEC);
+  expr_delete(ex);
+  free(src);
+  fflush(stdout);
 }
 
 void
@@ -513,6 +7114,7 @@ test_token(void)
   EXPRSTATE ex;
   EXPRSTATE * pex = &ex;
   size_t i;
+  expr_init_once();
   for (i = 0; tests[i].src; i++) {
     printf("tokenizing '%s'...\n", tests[i].src); fflush(stdout);
     tok_init(pex, tests[i].src, buf, 2048);
@@ -529,7 +7131,38 @@ main(void)
 {
   expr_set_error_handler(NULL, NULL);
   test_token();
+  test_lookup();
   test_parse();
+  test_stress();
+  test_optimize();
+  test_rewrite();
+  test_share();
+  test_let();
+  test_lib();
+  test_branch();
+  test_dispatch();
+  test_fit();
+  test_serialize();
+  test_eval_n();
+  test_tier();
+  test_grid();
+#ifdef EXPR_SIMD
+  test_simd();
+#endif
+#ifdef EXPR_THREADED
+  test_threaded();
+#endif
+#ifdef EXPR_THREADS
+  test_threads();
+#endif
+  test_vm(EXPR_VM_REGISTER, "register");
+  test_vm(EXPR_VM_JIT, "jit");
+#ifdef EXPR_JIT
+  test_widths();
+#endif
+#ifdef EXPR_CC
+  test_cc();
+#endif
   printf("done\n");
   return 0;
 }
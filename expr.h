@@ -1,43 +1,332 @@
-/* expr.h
- * Parse and evaluate expressions.
- * The only variable is 'x'.
- */
-#ifndef EXPR_H_
-#define EXPR_H_ 1
-
-/** The EXPR program.
- * This is an opaque type which cannot be instantiated directly.
- */
-typedef struct EXPR_s EXPR;
-
-/** Parse and compile an expression into a program.
- *
- * @param src The source code of the expression.
- * @return The compiled program.
- * @see expr_set_error_handler
- */
-extern EXPR * expr_new(const char * src);
-
-/** Free an EXPR program.
- *
- * @param ex The EXPR program to destroy.
- */
-extern void expr_delete(EXPR * ex);
-
-/** Evaluate an expression program for a given value of 'x'.
- *
- * @param ex The expression program to evaluate.
- * @param x The value of the 'x' variable.
- * @param[out] rv The location of the expression's resulting value.
- * @return 0 on success. The current implementation always succeeds.
- */
-extern int expr_eval(const EXPR * ex, double x, double * rv);
-
-/** Set the callback function to report parsing errors.
- *
- * @param handle The function to call on error. Pass NULL to print to stderr.
- * @param ctxt Context data for the callback.
- */
-extern void expr_set_error_handler(void (*handle)(const char *, void *), void * ctxt);
-
-#endif /* EXPR_H_ */
+/* expr.h
+ * Parse and evaluate expressions.
+ * The only variable is 'x'.
+ */
+#ifndef EXPR_H_
+#define EXPR_H_ 1
+
+#include <stdio.h>
+
+/** The EXPR program.
+ * This is an opaque type which cannot be instantiated directly.
+ */
+typedef struct EXPR_s EXPR;
+
+/** Scratch space for evaluating an EXPR program.
+ * This is an opaque type which cannot be instantiated directly.
+ *
+ * A program is read-only once compiled, but an evaluation writes its
+ * intermediate values somewhere. expr_eval(), expr_eval_n() and
+ * expr_eval_grid() use a context inside the program, so only one
+ * thread at a time may call them on it; any number of threads may
+ * share a program through expr_eval_ctx() and expr_eval_n_ctx(), each
+ * with its own context.
+ */
+typedef struct EXPR_CTX_s EXPR_CTX;
+
+/** Parse and compile an expression into a program.
+ *
+ * Compiling is thread-safe, as long as nothing calls
+ * expr_set_error_handler() or expr_set_cache_dir() at the same time.
+ *
+ * @param src The source code of the expression.
+ * @return The compiled program.
+ * @see expr_set_error_handler
+ */
+extern EXPR * expr_new(const char * src);
+
+/** Flags for expr_new_with().
+ */
+enum expr_flags_e {
+  /** Evaluate with the stack VM. This is the default. */
+  EXPR_VM_STACK    = 0,
+  /** Evaluate with the register VM, which keeps the top of the stack
+   * in a local and folds constant and 'x' operands into the
+   * instructions. Only expr_eval() uses it; expr_eval_n() always
+   * runs the stack VM. */
+  EXPR_VM_REGISTER = 1,
+  /** Compile to native code where supported (x86-64 Unix), for both
+   * expr_eval() and expr_eval_n(). Falls back to the register VM
+   * when the JIT is unavailable, or built with EXPR_NO_JIT. */
+  EXPR_VM_JIT      = 2,
+  /** Translate to C, build it with the system compiler, and load the
+   * result, for both expr_eval() and expr_eval_n(). Objects are
+   * cached; see expr_set_cache_dir(). Takes precedence over the other
+   * VMs, which run instead when there is no cache directory or the
+   * build fails. */
+  EXPR_VM_CC       = 4,
+  /** Skip the algebraic rewrites, such as a/k to a*(1/k), which
+   * may change results in the last bit. */
+  EXPR_EXACT       = 8,
+  /** Have expr_eval_n() work in single precision, rounding each
+   * intermediate value to a float. Arithmetic takes twice the samples
+   * per vector instruction, and functions such as sin() call the
+   * single precision libm, such as sinf(), which is faster and close
+   * to a float's last bit, though not the same on every platform.
+   * Precedes the JIT and the C VM there; expr_eval() still evaluates
+   * in double. */
+  EXPR_FLOAT       = 16,
+  /** Flush denormals to zero while evaluating, where the CPU can
+   * (SSE), so curves such as exp(-x*800) don't slow to a crawl as
+   * they underflow, and, without EXPR_FLOAT, have expr_eval_n() run
+   * sin(), cos() and tanh() through the batch kernels of expr-math.h,
+   * a few ulps off. Results are no longer the same on every platform. */
+  EXPR_FAST        = 32,
+  /** Also rewrite a*b+c to fma(a,b,c), where the CPU has it in
+   * hardware. The rounding then depends on the CPU, so it is off by
+   * default; EXPR_EXACT overrides it. */
+  EXPR_FMA         = 64
+};
+
+/** Parse and compile an expression, choosing how it is evaluated.
+ *
+ * @param src The source code of the expression.
+ * @param flags Zero or more expr_flags_e values, or'ed together.
+ * @return The compiled program.
+ * @see expr_new
+ */
+extern EXPR * expr_new_with(const char * src, int flags);
+
+/** Parse and compile an expression, reporting errors to a callback
+ * of its own instead of the one set by expr_set_error_handler().
+ *
+ * @param src The source code of the expression.
+ * @param flags Zero or more expr_flags_e values, or'ed together.
+ * @param handle The function to call on error. Pass NULL to print to stderr.
+ * @param ctxt Context data for the callback.
+ * @return The compiled program.
+ * @see expr_new_with
+ */
+extern EXPR * expr_new_ex(const char * src, int flags,
+                          void (*handle)(const char *, void *), void * ctxt);
+
+/** Write a compiled program out, for expr_deserialize() to load
+ * without parsing and optimizing the source again.
+ *
+ * The format is versioned and the same on every platform, but only
+ * loads into a build with the same operators.
+ *
+ * @param ex The program to write.
+ * @param buf Where to write it, or NULL to only get its size.
+ * @param len The size of buf; nothing is written when it is too small.
+ * @return The size of the serialized program, or 0 when ex is NULL
+ *   or too big for the format.
+ */
+extern size_t expr_serialize(const EXPR * ex, void * buf, size_t len);
+
+/** Load a program written by expr_serialize().
+ *
+ * The data is checked before it is used; anything from another
+ * version of the format or of the operators, or damaged, is refused,
+ * and the caller should compile the source again.
+ *
+ * @param buf The serialized program.
+ * @param len Its size.
+ * @param flags As for expr_new_with(). EXPR_EXACT and EXPR_FMA must
+ *   match the flags the program was compiled with; the others choose
+ *   the VM and the precision.
+ * @return The program, or NULL when it can't be loaded. It has no
+ *   copy for expr_eval_grid(), which runs expr_eval_n() on it.
+ */
+extern EXPR * expr_deserialize(const void * buf, size_t len, int flags);
+
+/** A library of functions for programs to call.
+ * This is an opaque type which cannot be instantiated directly.
+ *
+ * Each function is defined by a line such as "ease(t) = t*t*(3-2*t)",
+ * and may call any other in the library, defined before it or after,
+ * but not itself, directly or through others. Calls are inlined when
+ * a program is compiled, so the result optimizes as one program. A
+ * library is read-only once made, and may be shared between threads.
+ */
+typedef struct EXPR_LIB_s EXPR_LIB;
+
+/** Compile the function definitions among some sources.
+ *
+ * Sources which are not definitions are skipped. Errors in one
+ * definition, or a cycle of calls, are reported, and make calls to
+ * the functions concerned fail to compile.
+ *
+ * @param srcs The sources, ending with NULL.
+ * @param handle The function to call on error. Pass NULL to print to stderr.
+ * @param ctxt Context data for the callback.
+ * @return The library, or NULL when out of memory.
+ */
+extern EXPR_LIB * expr_lib_new(const char * const * srcs,
+                               void (*handle)(const char *, void *), void * ctxt);
+
+/** Free a library. Programs compiled with it remain valid.
+ *
+ * @param lib The library to destroy.
+ */
+extern void expr_lib_delete(EXPR_LIB * lib);
+
+/** Parse and compile an expression which may call the functions of a
+ * library, as expr_new_ex() does.
+ *
+ * The source may also be a definition of at most one parameter, which
+ * compiles as its body with the parameter standing for 'x'.
+ *
+ * @param src The source code of the expression.
+ * @param flags Zero or more expr_flags_e values, or'ed together.
+ * @param lib The library, or NULL for none.
+ * @param handle The function to call on error. Pass NULL to print to stderr.
+ * @param ctxt Context data for the callback.
+ * @return The compiled program.
+ * @see expr_new_ex
+ */
+extern EXPR * expr_new_lib(const char * src, int flags, const EXPR_LIB * lib,
+                           void (*handle)(const char *, void *), void * ctxt);
+
+/** Compile an expression as expr_new_lib() does, then replace it on
+ * [0,1] with piecewise polynomials, interpolating it at Chebyshev
+ * nodes until the error at evenly spaced check points is within
+ * maxerr. That is a sampled estimate, not a bound: between the check
+ * points the error may run somewhat over maxerr.
+ *
+ * Suits smooth curves which are costly to evaluate, such as ones of
+ * erf(), tgamma() or jn(). Pieces are halved where the fit is poor;
+ * where halving doesn't help, as at a discontinuity, and outside
+ * [0,1], the program evaluates the expression as compiled.
+ *
+ * @param src The source code of the expression.
+ * @param flags Zero or more expr_flags_e values, or'ed together.
+ * @param lib The library, or NULL for none.
+ * @param maxerr The largest absolute error allowed at the check points;
+ *   must be positive.
+ * @param[out] err If not NULL, the largest error of the fit at the
+ *   points it was checked at, or 0 when nothing could be fitted.
+ * @param handle The function to call on error. Pass NULL to print to stderr.
+ * @param ctxt Context data for the callback.
+ * @return The compiled program.
+ * @see expr_new_lib
+ */
+extern EXPR * expr_new_fit(const char * src, int flags, const EXPR_LIB * lib,
+                           double maxerr, double * err,
+                           void (*handle)(const char *, void *), void * ctxt);
+
+/** Set the directory where EXPR_VM_CC caches compiled programs.
+ *
+ * The directory must already exist. Objects are named by a hash of
+ * the generated code and the compiler command, so stale entries are
+ * never reused, and the directory can be emptied at any time.
+ *
+ * @param dir The cache directory. Pass NULL to disable EXPR_VM_CC.
+ */
+extern void expr_set_cache_dir(const char * dir);
+
+/** Free an EXPR program.
+ *
+ * @param ex The EXPR program to destroy.
+ */
+extern void expr_delete(EXPR * ex);
+
+/** Allocate a context for evaluating a program.
+ *
+ * The context also fits any program no deeper, and with no more
+ * shared subexpressions, than the one it was made for.
+ * expr_eval_ctx() and expr_eval_n_ctx() fail on one which doesn't.
+ *
+ * @param ex The program the context is for.
+ * @return The context, or NULL when out of memory.
+ */
+extern EXPR_CTX * expr_ctx_new(const EXPR * ex);
+
+/** Free an evaluation context.
+ *
+ * @param ctx The context to destroy.
+ */
+extern void expr_ctx_delete(EXPR_CTX * ctx);
+
+/** Evaluate an expression program for a given value of 'x'.
+ *
+ * @param ex The expression program to evaluate.
+ * @param x The value of the 'x' variable.
+ * @param[out] rv The location of the expression's resulting value.
+ * @return 0 on success. The current implementation always succeeds.
+ */
+extern int expr_eval(const EXPR * ex, double x, double * rv);
+
+/** Evaluate an expression program, using a given context.
+ *
+ * @param ex The expression program to evaluate.
+ * @param ctx The context, from expr_ctx_new().
+ * @param x The value of the 'x' variable.
+ * @param[out] rv The location of the expression's resulting value.
+ * @return 0 on success, or -1 when the context doesn't fit ex.
+ */
+extern int expr_eval_ctx(const EXPR * ex, EXPR_CTX * ctx, double x, double * rv);
+
+/** Evaluate an expression program for many values of 'x'.
+ *
+ * Equivalent to calling expr_eval() for each element of xs, but the
+ * dispatch cost is paid once per block of samples instead of once
+ * per sample. The input and output arrays may be the same.
+ *
+ * @param ex The expression program to evaluate.
+ * @param xs The values of the 'x' variable.
+ * @param[out] out The resulting values, one for each element of xs.
+ * @param n The number of elements in xs and out.
+ * @return 0 on success. The current implementation always succeeds.
+ */
+extern int expr_eval_n(const EXPR * ex, const double * xs, double * out, size_t n);
+
+/** Evaluate an expression program for many values of 'x', using a
+ * given context.
+ *
+ * @param ex The expression program to evaluate.
+ * @param ctx The context, from expr_ctx_new().
+ * @param xs The values of the 'x' variable.
+ * @param[out] out The resulting values, one for each element of xs.
+ * @param n The number of elements in xs and out.
+ * @return 0 on success, or -1 when the context doesn't fit ex.
+ */
+extern int expr_eval_n_ctx(const EXPR * ex, EXPR_CTX * ctx,
+                           const double * xs, double * out, size_t n);
+
+/** Evaluate an expression program on a uniform grid over [0,1], as
+ * for a LUT.
+ *
+ * Equivalent to expr_eval_n() with xs[i] = i / (n - 1), but the
+ * subexpressions which are low-degree polynomials in 'x', or sines
+ * and cosines of a linear function of 'x', advance from one sample to
+ * the next by additions and rotations instead of libm calls. Results
+ * may differ from expr_eval_n()'s in the last few bits, or for a fast
+ * wave such as sin(x*1000) by a few ulps of its angle; never across a
+ * step, such as that of floor() or <, nor out of the domain of a
+ * function such as sqrt() or acos(), where that would give NaN. This
+ * runs on the stack VM, so programs compiled for EXPR_VM_JIT or
+ * EXPR_VM_CC without EXPR_FLOAT, or with EXPR_EXACT, and those from
+ * expr_deserialize(), run expr_eval_n() on the grid instead.
+ *
+ * @param ex The expression program to evaluate.
+ * @param[out] out The resulting values.
+ * @param n The number of samples, with the last at 1; just 0 when 1.
+ * @return 0 on success, or -1 when ex or out is NULL.
+ */
+extern int expr_eval_grid(const EXPR * ex, double * out, size_t n);
+
+/** Print a compiled program, for debugging.
+ *
+ * The opcodes are printed in evaluation order (RPN), followed by
+ * the number of opcodes the optimizer removed, the number of
+ * algebraic rewrites, the number of opcodes that common
+ * subexpression elimination replaced with loads, the number of
+ * conditional operators compiled to jumps, for expr_new_fit() the
+ * pieces fitted and their error, and the subexpressions
+ * expr_eval_grid() runs incrementally.
+ *
+ * @param ex The expression program to print.
+ * @param out The stream to print to.
+ */
+extern void expr_dump(const EXPR * ex, FILE * out);
+
+/** Set the callback function to report parsing errors from
+ * expr_new() and expr_new_with().
+ *
+ * @param handle The function to call on error. Pass NULL to print to stderr.
+ * @param ctxt Context data for the callback.
+ */
+extern void expr_set_error_handler(void (*handle)(const char *, void *), void * ctxt);
+
+#endif /* EXPR_H_ */
@@ -92,6 +92,25 @@ static char * g_exprs_defs_array[] = { /* avoid 509 limit on literals */
 
 static char ** g_exprs = NULL;
 
+/* The functions defined among the expressions, as in
+ * "ease(t) = t*t*(3-2*t)", for the others to call. Compiled programs
+ * have them inlined, so the cache is cleared with each new library;
+ * g_lib_hash keeps saved programs from outliving theirs.
+ */
+static EXPR_LIB * g_lib = NULL;
+static guint g_lib_hash = 0;
+
+static void expr_cache_clear(void);
+
+static void
+exprs_lib(const char * data)
+{
+  expr_lib_delete(g_lib);
+  g_lib = expr_lib_new((const char * const *)g_exprs, NULL, NULL);
+  g_lib_hash = g_str_hash(data);
+  expr_cache_clear();
+}
+
 static void
 exprs_set(const char * data)
 {
@@ -99,6 +118,7 @@ exprs_set(const char * data)
   if (d) {
     if (g_exprs) g_strfreev(g_exprs);
     g_exprs = d;
+    exprs_lib(data);
     toa_save_set_string("plug-in-sinxpi-exprs", data);
   }
 }
@@ -110,12 +130,14 @@ exprs_init(void)
   g_exprs_defs = g_strjoinv("\n", g_exprs_defs_array);
   data = toa_save_get_string("plug-in-sinxpi-exprs", g_exprs_defs);
   g_exprs = toa_strparse(data);
+  exprs_lib(data);
   g_free(data);
 }
 
 static void
 exprs_destroy(void)
 {
+  expr_lib_delete(g_lib);
   if (g_exprs) g_strfreev(g_exprs);
   if (g_exprs_defs) g_free(g_exprs_defs);
 }
@@ -156,6 +178,7 @@ expr_init(void)
 static void
 expr_destroy(void)
 {
+  expr_cache_clear();
   g_free(g_expr.r);
   g_free(g_expr.g);
   g_free(g_expr.b);
@@ -175,34 +198,183 @@ expr_set(int which, gchar * ex)
   *p = g_strdup(ex);
 }
 
-#define expr_mapfloat(MAP,SRC,ERR) expr_map0(MAP, TRUE, SRC, ERR)
-#define expr_mapbyte(MAP,SRC,ERR)  expr_map0(MAP, FALSE, SRC, ERR)
+/* ********************************************************************** */
+/* ********************************************************************** */
+
+/* Compiled expressions, most recently used first. The preview, the
+ * menu icons and the editor's graph all ask for the same few sources
+ * over and over, so each is compiled and mapped once. The key is the
+ * source with each run of whitespace made a single space, which the
+ * tokenizer can't tell apart, plus the flags.
+ */
+#define EXPR_CACHE_SIZE 32
+
+static struct exprcache_s {
+  gchar  * key;      /* the normalized source */
+  gchar  * src;      /* the source as compiled, for the error offset */
+  int      flags;
+  EXPR   * ex;       /* NULL when it didn't compile */
+  gchar  * err;      /* and why */
+  double   map[256]; /* f(i/255), clamped to [0,1] */
+} * g_cache[EXPR_CACHE_SIZE];
+
+static gulong g_cache_hits = 0;
+static gulong g_cache_misses = 0;
+
+static gchar *
+expr_normalize(const char * src)
+{
+  GString * s = g_string_new(NULL);
+  for (; *src; ++src) {
+    if ((guchar)*src > ' ')
+      g_string_append_c(s, *src);
+    else if (s->len && s->str[s->len - 1] != ' ' && (guchar)src[1] > ' ')
+      g_string_append_c(s, ' ');
+  }
+  return g_string_free(s, FALSE);
+}
+
+static void
+expr_cache_free(struct exprcache_s * e)
+{
+  if (!e) return;
+  expr_delete(e->ex);
+  g_free(e->key);
+  g_free(e->src);
+  g_free(e->err);
+  g_free(e);
+}
+
+static void
+expr_cache_clear(void)
+{
+  int i;
+  for (i = 0; i < EXPR_CACHE_SIZE; ++i) {
+    expr_cache_free(g_cache[i]);
+    g_cache[i] = NULL;
+  }
+}
+
+/* ex, when not NULL, is the program for src, compiled elsewhere.
+ */
+#define expr_cache_get(SRC,FLAGS)  expr_cache_get0(SRC, FLAGS, NULL)
+static struct exprcache_s *
+expr_cache_get0(const char * src, int flags, EXPR * ex)
+{
+  gchar * key = expr_normalize(src);
+  struct exprcache_s * e;
+  int i, j;
+
+  for (i = 0; i < EXPR_CACHE_SIZE && g_cache[i]; ++i)
+    if (g_cache[i]->flags == flags && !strcmp(g_cache[i]->key, key)) break;
+
+  if (i < EXPR_CACHE_SIZE && g_cache[i]) {
+    ++g_cache_hits;
+    e = g_cache[i];
+    g_free(key);
+    expr_delete(ex);
+  } else {
+    ++g_cache_misses;
+    if (i == EXPR_CACHE_SIZE) /* full; drop the least recently used */
+      expr_cache_free(g_cache[--i]);
+    e = g_new0(struct exprcache_s, 1);
+    e->key = key;
+    e->src = g_strdup(src);
+    e->flags = flags;
+    e->ex = ex ? ex : expr_new_lib(src, flags, g_lib, &expr_error_handle, &(e->err));
+    if (e->ex)
+      expr_eval_grid(e->ex, e->map, 256); /* at j / 255 */
+    else
+      for (j = 0; j <= 255; ++j) e->map[j] = ((double)j) / 255.0;
+    for (j = 0; j <= 255; ++j) {
+      double rv = e->map[j];
+      e->map[j] = isnan(rv) ? 0.0 : (rv < 0.0) ? 0.0 : (rv > 1.0) ? 1.0 : rv;
+    }
+  }
+  memmove(&(g_cache[1]), &(g_cache[0]), sizeof(g_cache[0]) * (size_t)i);
+  g_cache[0] = e;
+  return e;
+}
+
+#define expr_mapfloat(MAP,SRC,ERR,FLAGS) expr_map0(MAP, TRUE, SRC, ERR, FLAGS)
+#define expr_mapbyte(MAP,SRC,ERR,FLAGS)  expr_map0(MAP, FALSE, SRC, ERR, FLAGS)
 static gboolean
-expr_map0(void * map, gboolean isFloat, const char * src, char ** err)
+expr_map0(void * map, gboolean isFloat, const char * src, char ** err, int flags)
 {
   double * mapf = isFloat ? map : NULL;
   guchar * mapb = isFloat ? NULL : map;
+  struct exprcache_s * e = expr_cache_get(src, flags);
   int i;
-  EXPR * ex;
-  expr_set_error_handler(&expr_error_handle, (void*)err);
-  ex = expr_new(src);
   for (i = 0; i <= 255; ++i) {
-    double rv = ((double)i) / 255.0;
-    if (ex) expr_eval(ex, rv, &rv);
-    rv = isnan(rv) ? 0.0 : (rv < 0.0) ? 0.0 : (rv > 1.0) ? 1.0 : rv;
-    if (mapf) mapf[i] = rv;
-    else      mapb[i] = (guchar)(rv * 255.0);
+    if (mapf) mapf[i] = e->map[i];
+    else      mapb[i] = (guchar)(e->map[i] * 255.0);
+  }
+  if (!e->ex) {
+    if (strcmp(e->src, src)) /* the same error, but at its offset in src */
+      expr_delete(expr_new_lib(src, flags, g_lib, &expr_error_handle, (void*)err));
+    else if (e->err)
+      expr_error_handle(e->err, (void*)err);
   }
-  expr_delete(ex);
-  return ex != NULL;
+  return e->ex != NULL;
 }
 
+/* The compiled programs are saved next to their sources, so that
+ * GIMP_RUN_WITH_LAST_VALS skips the parser; see expr_serialize. Each
+ * is stored after its normalized source and the library's hash, and
+ * ignored unless those still match, or when expr_deserialize refuses
+ * it.
+ */
+static void
+expr_save(const char * name, const char * src, int flags)
+{
+  struct exprcache_s * e = expr_cache_get(src, flags);
+  gchar * key = g_strdup_printf("%08x %s", g_lib_hash, e->key);
+  size_t keylen = strlen(key) + 1;
+  size_t len = expr_serialize(e->ex, NULL, 0);
+  guchar * data;
+  if (len) {
+    data = g_malloc(keylen + len);
+    memcpy(data, key, keylen);
+    expr_serialize(e->ex, data + keylen, len);
+    toa_save_set_data(name, data, keylen + len);
+    g_free(data);
+  }
+  g_free(key);
+}
+
+static void
+expr_load(const char * name, const char * src, int flags)
+{
+  gsize len = 0;
+  guchar * data = toa_save_get_data(name, &len);
+  gchar * norm = expr_normalize(src);
+  gchar * key = g_strdup_printf("%08x %s", g_lib_hash, norm);
+  size_t keylen = strlen(key) + 1;
+  EXPR * ex = NULL;
+  if (data && len > keylen && !memcmp(data, key, keylen))
+    ex = expr_deserialize(data + keylen, len - keylen, flags);
+  if (ex) expr_cache_get0(src, flags, ex);
+  g_free(key);
+  g_free(norm);
+  g_free(data);
+}
+
+/* flags: EXPR_IMAGE_FLAGS for the final image, whose 256-entry map
+ * is too small to pay for a run of the system compiler (EXPR_VM_CC),
+ * so the JIT takes it; and with it, expr_eval_grid gives the same map
+ * whether the program was compiled or loaded by expr_load.
+ * EXPR_PREVIEW_FLAGS trades the last bits of precision, which 8-bit
+ * previews and icons can't show, for speed.
+ */
+#define EXPR_IMAGE_FLAGS    EXPR_VM_JIT
+#define EXPR_PREVIEW_FLAGS  (EXPR_FLOAT | EXPR_FAST)
+
 static gboolean
-expr_buildmap(void)
+expr_buildmap(int flags)
 {
-  gboolean r = expr_mapbyte(g_map.r, g_expr.r, NULL);
-  gboolean g = expr_mapbyte(g_map.g, g_expr.g, NULL);
-  gboolean b = expr_mapbyte(g_map.b, g_expr.b, NULL);
+  gboolean r = expr_mapbyte(g_map.r, g_expr.r, NULL, flags);
+  gboolean g = expr_mapbyte(g_map.g, g_expr.g, NULL, flags);
+  gboolean b = expr_mapbyte(g_map.b, g_expr.b, NULL, flags);
   return r && g && b;
 }
 
@@ -210,7 +382,7 @@ static GdkPixbuf *
 expr_pixbuf(const char * src, gint size, char ** err)
 {
   double map[256];
-  expr_mapfloat(map, src, err);
+  expr_mapfloat(map, src, err, EXPR_PREVIEW_FLAGS);
   return toa_pixbuf_from_map(map, 256, size);
 }
 
@@ -356,7 +528,7 @@ static void
 filterImage(GimpDrawable * drawable, gboolean hasDisplay)
 {
   gint x = 0, y = 0, w = 0, h = 0;
-  if (!expr_buildmap()) { /* don't mod image on expr error */
+  if (!expr_buildmap(EXPR_IMAGE_FLAGS)) { /* don't mod image on expr error */
     g_status = GIMP_PDB_EXECUTION_ERROR;
     return;
   }
@@ -373,7 +545,8 @@ static void
 preview_cb(GimpPreview * preview, GimpDrawable * drawable)
 {
   UNUSED(drawable);
-  expr_buildmap(); /* don't fail this; always update the preview */
+  /* don't fail this; always update the preview */
+  expr_buildmap(EXPR_PREVIEW_FLAGS);
   filter_preview_channels(preview); /* no indexed variant of preview */
 }
 
@@ -758,6 +931,9 @@ run(const gchar * name,
         toa_save_set_string("plug-in-sinxpi-expr-g", g_expr.g);
         toa_save_set_string("plug-in-sinxpi-expr-b", g_expr.b);
         filterImage(drawable, TRUE);
+        expr_save("plug-in-sinxpi-code-r", g_expr.r, EXPR_IMAGE_FLAGS);
+        expr_save("plug-in-sinxpi-code-g", g_expr.g, EXPR_IMAGE_FLAGS);
+        expr_save("plug-in-sinxpi-code-b", g_expr.b, EXPR_IMAGE_FLAGS);
       }
       break;
     case GIMP_RUN_WITH_LAST_VALS: {
@@ -767,6 +943,9 @@ run(const gchar * name,
         expr_set('r', r);
         expr_set('g', g);
         expr_set('b', b);
+        expr_load("plug-in-sinxpi-code-r", r, EXPR_IMAGE_FLAGS);
+        expr_load("plug-in-sinxpi-code-g", g, EXPR_IMAGE_FLAGS);
+        expr_load("plug-in-sinxpi-code-b", b, EXPR_IMAGE_FLAGS);
         g_free(r);
         g_free(g);
         g_free(b);
@@ -785,6 +964,10 @@ run(const gchar * name,
       break;
   }
 
+#ifdef SINXPI_DEBUG
+  g_printerr("sinxpi: expression cache: %lu hits, %lu misses\n",
+             g_cache_hits, g_cache_misses);
+#endif
   g_editor_docs_destroy();
   expr_destroy();
   exprs_destroy();
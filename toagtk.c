@@ -215,6 +215,25 @@ toa_save_set_string(const gchar * name, const gchar * val)
   gimp_set_data(name, val, (guint)strlen(val) + 1);
 }
 
+gpointer
+toa_save_get_data(const gchar * name, gsize * len)
+{
+  gpointer rv = NULL;
+  gint size = gimp_get_data_size(name);
+  if (size > 0) {
+    rv = g_malloc((size_t)size);
+    gimp_get_data(name, rv);
+  }
+  *len = size > 0 ? (gsize)size : 0;
+  return rv;
+}
+
+void
+toa_save_set_data(const gchar * name, gconstpointer val, gsize len)
+{
+  gimp_set_data(name, val, (guint)len);
+}
+
 /* ********************************************************************** */
 /* ********************************************************************** */
 
@@ -8,6 +8,8 @@ extern void debug(const char * fmt, ...);
 
 extern gchar * toa_save_get_string(const gchar * name, const gchar * def);
 extern void    toa_save_set_string(const gchar * name, const gchar * val);
+extern gpointer toa_save_get_data(const gchar * name, gsize * len);
+extern void     toa_save_set_data(const gchar * name, gconstpointer val, gsize len);
 
 extern void        toa_pixbuf_put_pixel(GdkPixbuf * pb, gint x, gint y, guint32 color);
 extern GdkPixbuf * toa_pixbuf_from_map(const double * map, gint maplen, gint size);